@@ -1,14 +1,13 @@
 #include "util/camera.hpp"
 #include "util/common.hpp"
 #include "util/shader.hpp"
+#include "util/scene.hpp"
 #include <imgui/imgui.h>
 #include <imgui/imgui_impl_glfw.h>
 #include <imgui/imgui_impl_opengl3.h>
 #include <string>
 
-float roughness = 0.1f;
-float metallic = 0.97f;
-glm::vec3 color(1);
+GroundMaterial ground;
 
 float debug_x, debug_y = -1.f, debug_z;
 /*float particle_size = 1.5;
@@ -23,9 +22,12 @@ int camera_cnt, current_camera;
 
 float alpha = 0.98;
 
-float movement = 0;
-
 float ssdo_alpha = 1;
+
+RenderConfig render_config;
+float render_gpu_ms = 0, render_scale = 1, render_tile_hits = -1; // reported back by the scene
+GpuStats *gpu_stats = nullptr;
+const RingBuffer *upload_ring = nullptr;
 namespace Control {
 
 
@@ -85,7 +87,6 @@ static void cursor_position_callback(GLFWwindow* window, double xpos, double ypo
             if(camera) {
                 camera -> pitch -= (float)dy;
                 camera -> yaw += (float)dx;
-                movement += (abs(dx) + abs(dy));
             }
         }
         l_xpos = xpos, l_ypos = ypos;
@@ -99,7 +100,6 @@ void update(double now) {
     {
         if (key_WASD[i]) {
             camera -> position += camera -> dir4(i) * stride * float(now - last_time) * speed;
-            movement += speed * float(now - last_time) / 3;
         }
     }
     last_time = now;
@@ -129,11 +129,11 @@ void ui() {
         ImGui::SliderFloat("Rotate speed", &rot_speed, 0.1, 5);
         ImGui::SliderInt("Particle number", &particle_number, 1000, 1e5);*/
         ImGui::Text("Ground Material");
-        ImGui::SliderFloat("roughness", &roughness, 0.f, 1.f);
-        ImGui::SliderFloat("metallic", &metallic, 0.f, 1.f);
-        ImGui::SliderFloat("r", &color.x, 0.f, 1.f);
-        ImGui::SliderFloat("g", &color.y, 0.f, 1.f);
-        ImGui::SliderFloat("b", &color.z, 0.f, 1.f);
+        ImGui::SliderFloat("roughness", &ground.roughness, 0.f, 1.f);
+        ImGui::SliderFloat("metallic", &ground.metallic, 0.f, 1.f);
+        ImGui::SliderFloat("r", &ground.color.x, 0.f, 1.f);
+        ImGui::SliderFloat("g", &ground.color.y, 0.f, 1.f);
+        ImGui::SliderFloat("b", &ground.color.z, 0.f, 1.f);
         ImGui::Text("Lights Info");
         for(int i = 0; i < (int) lights.size(); ++i) {
             auto &l = lights[i];
@@ -144,8 +144,60 @@ void ui() {
             ImGui::SliderFloat((std::to_string(i) + ": intense.y:").c_str(), &l.intense.y, -10, 10);
             ImGui::SliderFloat((std::to_string(i) + ": intense.z:").c_str(), &l.intense.z, -10, 10);
         }
+        ImGui::Checkbox("Deferred lighting", &render_config.deferred);
+        ImGui::Text("Shadow filter");
+        ImGui::RadioButton("hard", &render_config.shadow_filter, 0); ImGui::SameLine();
+        ImGui::RadioButton("PCF 7x7", &render_config.shadow_filter, 1);
+        ImGui::Checkbox("GPU-driven G-buffer (GL 4.3)", &render_config.gpu_driven);
+        ImGui::Checkbox("GPU frustum culling", &render_config.gpu_culling);
         ImGui::SliderFloat("SSDO strength", &ssdo_alpha, 0.f, 1.f);
+        ImGui::SliderInt("SSDO samples", &render_config.ssdo_spp, 4, Scene::max_ssdo_spp);
+        ImGui::SliderFloat("SSDO radius", &render_config.ssdo_radius, 0.1f, 5.f);
+        ImGui::SliderFloat("SSDO radius (px, 0 = fixed)", &render_config.ssdo_radius_px, 0.f, 1000.f);
+        ImGui::Checkbox("SSDO Hi-Z tracing (experimental)", &render_config.ssdo_hiz);
+        if(ImGui::IsItemHovered()) ImGui::SetTooltip("Marches every sample through the depth pyramid, several times slower than the end-point test");
+        ImGui::Checkbox("SSDO compute shader (GL 4.3, radius <= 8 px)", &render_config.ssdo_compute);
+        ImGui::Text("SSDO resolution");
+        ImGui::RadioButton("full", &render_config.ssdo_scale, 1); ImGui::SameLine();
+        ImGui::RadioButton("half", &render_config.ssdo_scale, 2); ImGui::SameLine();
+        ImGui::RadioButton("quarter", &render_config.ssdo_scale, 4);
         ImGui::SliderFloat("Temporal Denoising", &alpha, 0.f, 1.f);
+        ImGui::Checkbox("A-trous denoiser", &render_config.atrous);
+        ImGui::SliderInt("Denoise passes", &render_config.denoise_passes, 0, Scene::max_denoise_passes);
+        ImGui::Checkbox("Fuse last denoise pass with mixer", &render_config.fused_composite);
+        ImGui::Checkbox("Dynamic resolution", &render_config.dynamic_resolution);
+        ImGui::SliderFloat("Target GPU ms", &render_config.target_ms, 4.f, 50.f);
+        ImGui::SliderFloat("Min render scale", &render_config.min_render_scale, 0.25f, 1.f);
+        ImGui::Text("GPU %.2f ms, render scale %.3f", render_gpu_ms, render_scale);
+        if(render_config.ssdo_compute && render_tile_hits >= 0) ImGui::Text("SSDO tile hits %.1f%%", render_tile_hits * 100);
+        if(upload_ring && upload_ring->buffer()) {
+            auto &uploads = upload_ring->stats();
+            ImGui::Text("Streamed %.1f KB/frame (peak %.1f KB), %d fence waits (%.2f ms)",
+                        uploads.frame_bytes / 1024., uploads.peak_bytes / 1024., uploads.waits, uploads.wait_ms);
+        }
+        if(gpu_stats && ImGui::CollapsingHeader("GPU timings")) {
+            bool counters = gpu_stats->pipeline_statistics();
+            if(ImGui::Checkbox("Pipeline statistics", &counters)) gpu_stats->enable_pipeline_statistics(counters);
+            int columns = 4 + (counters ? GpuStats::counters : 0);
+            if(ImGui::BeginTable("gpu_timings", columns, ImGuiTableFlags_Borders | ImGuiTableFlags_SizingFixedFit)) {
+                ImGui::TableSetupColumn("stage");
+                ImGui::TableSetupColumn("ms");
+                ImGui::TableSetupColumn("avg");
+                ImGui::TableSetupColumn("p99");
+                for(int c = 0; counters && c < GpuStats::counters; ++c) ImGui::TableSetupColumn(GpuStats::counter_names[c]);
+                ImGui::TableHeadersRow();
+                for(auto &s: gpu_stats->summary()) {
+                    ImGui::TableNextColumn(); ImGui::TextUnformatted(s.name.c_str());
+                    ImGui::TableNextColumn(); ImGui::Text("%.3f", s.last_ms);
+                    ImGui::TableNextColumn(); ImGui::Text("%.3f", s.avg_ms);
+                    ImGui::TableNextColumn(); ImGui::Text("%.3f", s.p99_ms);
+                    for(int c = 0; counters && c < GpuStats::counters; ++c) {
+                        ImGui::TableNextColumn(); ImGui::Text("%llu", (unsigned long long)s.last[c]);
+                    }
+                }
+                ImGui::EndTable();
+            }
+        }
         ImGui::Text("Debug parameters");
         ImGui::SliderFloat("x:", &debug_x, -100, 100);
         ImGui::SliderFloat("y:", &debug_y, -100, 100);
@@ -2,6 +2,10 @@
 
 #define GLFW_INCLUDE_NONE
 #include <GLFW/glfw3.h>
+#ifdef HAS_EGL
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#endif
 #include <iostream>
 #include <vector>
 #include <fstream>
@@ -12,24 +16,34 @@
 #include <imgui/imgui_impl_opengl3.h>
 
 
+// tried in order until a context is created
+static const int context_versions[][2] = {{4, 3}, {4, 1}, {3, 3}};
+
 static void error_callback(int error, const char* description) {
     fprintf(stderr, "Error: %s\n", description);
 }
  
-GLFWwindow *window_init(int width = 800, int height = 600, const char *title = "no title", bool allow_transparent = false, int vsync = 0) {
+GLFWwindow *window_init(int width = 800, int height = 600, const char *title = "no title", bool allow_transparent = false, int vsync = 0, bool visible = true) {
     printf("[Initiating glfw window ...\n");
     // glfwSetErrorCallback(error_callback);
     if(glfwInit() == GLFW_FALSE) {
         throw std::runtime_error("fail to init glfw");
     }
-    glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 4);
-    glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, 1);
      glfwWindowHint(GLFW_OPENGL_PROFILE, GLFW_OPENGL_CORE_PROFILE);
     if(allow_transparent) glfwWindowHint(GLFW_TRANSPARENT_FRAMEBUFFER, GLFW_TRUE);
+    if(!visible) glfwWindowHint(GLFW_VISIBLE, GLFW_FALSE);
 #ifdef __APPLE__
     glfwWindowHint(GLFW_OPENGL_FORWARD_COMPAT, GL_TRUE);
 #endif
-    GLFWwindow *window = glfwCreateWindow(width, height, title, nullptr, nullptr);
+    // 4.3 enables the compute shader SSDO, 4.1 is the most macOS offers and
+    // 3.3 is what the rest of the renderer needs
+    GLFWwindow *window = nullptr;
+    for(auto &version: context_versions) {
+        glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, version[0]);
+        glfwWindowHint(GLFW_CONTEXT_VERSION_MINOR, version[1]);
+        window = glfwCreateWindow(width, height, title, nullptr, nullptr);
+        if(window) break;
+    }
     if (!window)
     {
         glfwTerminate();
@@ -45,10 +59,70 @@ GLFWwindow *window_init(int width = 800, int height = 600, const char *title = "
     return window;
 }
 
-void glew_init() {
+#ifdef HAS_EGL
+static EGLDisplay egl_display = EGL_NO_DISPLAY;
+
+// Offscreen context of a pbuffer, for machines without a display. Surfaceless
+// Mesa (llvmpipe) needs neither a display server nor a GPU. Returns no window.
+GLFWwindow *headless_init(int width, int height) {
+    printf("[Initiating headless EGL context ...\n");
+    auto get_platform_display = (PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+    if(get_platform_display) egl_display = get_platform_display(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, nullptr);
+    if(egl_display == EGL_NO_DISPLAY) egl_display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+    EGLint major, minor;
+    if(egl_display == EGL_NO_DISPLAY || !eglInitialize(egl_display, &major, &minor)) {
+        throw std::runtime_error("fail to init EGL");
+    }
+    eglBindAPI(EGL_OPENGL_API);
+    EGLint config_attribs[] = {
+        EGL_SURFACE_TYPE, EGL_PBUFFER_BIT, EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+        EGL_RED_SIZE, 8, EGL_GREEN_SIZE, 8, EGL_BLUE_SIZE, 8, EGL_DEPTH_SIZE, 24, EGL_NONE
+    };
+    EGLConfig config;
+    EGLint configs = 0;
+    if(!eglChooseConfig(egl_display, config_attribs, &config, 1, &configs) || !configs) {
+        throw std::runtime_error("no EGL config with a pbuffer");
+    }
+    EGLint surface_attribs[] = {EGL_WIDTH, width, EGL_HEIGHT, height, EGL_NONE};
+    EGLSurface surface = eglCreatePbufferSurface(egl_display, config, surface_attribs);
+    // same versions as window_init
+    EGLContext context = EGL_NO_CONTEXT;
+    for(auto &version: context_versions) {
+        EGLint context_attribs[] = {
+            EGL_CONTEXT_MAJOR_VERSION, version[0], EGL_CONTEXT_MINOR_VERSION, version[1],
+            EGL_CONTEXT_OPENGL_PROFILE_MASK, EGL_CONTEXT_OPENGL_CORE_PROFILE_BIT, EGL_NONE
+        };
+        context = eglCreateContext(egl_display, config, EGL_NO_CONTEXT, context_attribs);
+        if(context != EGL_NO_CONTEXT) break;
+    }
+    if(surface == EGL_NO_SURFACE || context == EGL_NO_CONTEXT || !eglMakeCurrent(egl_display, surface, surface, context)) {
+        throw std::runtime_error("failed to create EGL context");
+    }
+    printf("  EGL Version: %d.%d\n", major, minor);
+    printf("  OpenGL Version: %s\n", glGetString(GL_VERSION));
+    printf("  Renderer: %s\n", glGetString(GL_RENDERER));
+    printf("done]\n");
+    return nullptr;
+}
+
+void headless_terminate() {
+    if(egl_display != EGL_NO_DISPLAY) eglTerminate(egl_display);
+}
+#else
+// Without EGL the offscreen context is a hidden window, which still needs a display.
+GLFWwindow *headless_init(int width, int height) {
+    return window_init(width, height, "headless", false, 0, false);
+}
+
+void headless_terminate() {
+}
+#endif
+
+void glew_init(bool headless = false) {
     printf("initiating glew...");
     GLenum e = glewInit();
-    if (e != GLEW_OK)
+    // a GLX build of GLEW finds no GLX display under EGL, it still loads the GL entry points
+    if (e != GLEW_OK && !(headless && e == GLEW_ERROR_NO_GLX_DISPLAY))
     {
         std::cerr << glewGetErrorString(e) << std::endl;
         throw std::runtime_error("failed to init glew");
@@ -13,9 +13,40 @@
 #include "util/bound.hpp"
 // #include "util/particle.hpp"
 #include "util/scene.hpp"
+#include "util/camera_path.hpp"
+#include "util/beatmap.hpp"
+#include "util/frame_log.hpp"
+#include "util/image_metrics.hpp"
+#include "util/program_cache.hpp"
+#include <chrono>
+#include <sstream>
+#include <stb_image_write.h>
 
 static const int width = 1920, height = 1080;
 
+// --headless: render frames offscreen, and write them to out as PNG when given
+struct HeadlessOptions {
+    int frames = 1;
+    int width = 1920, height = 1080;
+    Path out;
+};
+
+// --record / --replay: camera paths for reproducible frame times
+struct BenchOptions {
+    Path record;  // written when the window closes
+    Path replay;  // drives the camera at a fixed timestep instead of the controls
+    Path summary; // JSON written when the replay ends
+};
+static const float replay_step = 1 / 60.f;
+
+// --sweep: error against cost of the GI settings, see Application::sweep
+struct SweepOptions {
+    Path dir;
+    std::string grid = "spp=4,8,16,32;scale=1,2,4;passes=0,2,4;alpha=0.05,0.1,0.2";
+    int frames = 16;           // per grid point, the last one is compared
+    int reference_frames = 64; // averaged at the highest sample count
+};
+
 /*
 
 TODO:
@@ -37,17 +68,22 @@ class Application {
     // std::unique_ptr <Mesh> mesh, ground;
     // std::unique_ptr <ParticleSystem> ps;
     glm::mat4 model;
-    std::vector <std::pair <int,int>> beatmap;
+    Beatmap beatmap;
+    BenchOptions bench;
+    CameraPath path; // being recorded or replayed
+    FrameLog log;
+    std::vector <std::string> scene_names;
 public:
-    Application(): scene(nullptr) { }
+    Application(): window(nullptr), scene(nullptr) { }
     ~Application() {
         scene = nullptr;
         glfwDestroyWindow(window);
         printf("Window destroyed\n");
+        headless_terminate();
         glfwTerminate();
         printf("Terminated..");
     }
-    void init() {
+    void init(const HeadlessOptions *headless = nullptr) {
         /*camera.position = glm::vec3(-0.6f,2.f, 4.f);
         camera.pitch = glm::radians(-30.f);
         camera.yaw = -PI/2;*/
@@ -80,20 +116,39 @@ public:
             glm::vec3(20),
             POINT_LIGHT,
         });*/
-        window = window_init(width, height, "SSDO_test");
-        glew_init();
         model = glm::mat4(1.f);
-        init_control(window);
+        if(headless) {
+            window = headless_init(headless->width, headless->height);
+            glew_init(true);
+        } else {
+            window = window_init(width, height, "SSDO_test");
+            glew_init();
+            init_control(window);
+        }
         Control::camera = &camera;
         scene = std::make_unique<Scene>();
+        gpu_stats = &scene->stats;
+        upload_ring = &scene->uploads;
         printf("Application initiated.\n");
     }
-    void load_beatmap(const char* path) {
-        FILE *f = fopen(path, "r");
-        int t, p;
-        while(~fscanf(f, "%d%d", &t,&p)){ 
-            beatmap.emplace_back(t, p);
+    bool load_beatmap(const char *path, const char *mesh) {
+        try {
+            beatmap.load(path);
+        } catch(const std::string &msg) {
+            printf("Fail to load beatmap: %s\n", msg.c_str());
+            return false;
         }
+        if(mesh) beatmap.mesh = mesh;
+        bool found = false;
+        for(auto &[name, m]: scene->meshes) found |= name == beatmap.mesh;
+        if(!found) printf("Beatmap: the scene has no mesh named %s, the notes are not drawn\n", beatmap.mesh.c_str());
+        return true;
+    }
+    // instances of the beatmap's mesh are the notes on screen at now, in seconds
+    void update_beatmap(double now) {
+        if(beatmap.empty()) return;
+        beatmap.seek(now * 1000);
+        beatmap.transforms(now * 1000, scene->model()[beatmap.mesh]);
     }
     void load(std::string name, const Path &path) {
         try{
@@ -114,14 +169,72 @@ public:
         printf("Particle system generated.\n");
         */
     }
-    glm::mat4 projection() {
+    glm::mat4 projection(int width, int height) {
         return glm::perspective(glm::radians(45.f), 1.f * width / height, .1f, 100.f);
     }
-    void load_scene(char *str) {
+    // the ground takes its material from the UI
+    void update_ground() {
+        scene->set_ground(ground);
+    }
+    void open_stats_csv(const char *path) {
+        scene->stats.open_csv(path);
+    }
+    // loads the path to replay, false when it can't be used
+    bool set_bench(const BenchOptions &options) {
+        bench = options;
+        if(bench.replay.empty()) return true;
+        try {
+            path.load(bench.replay);
+        } catch(const std::string &msg) {
+            printf("Fail to load camera path: %s\n", msg.c_str());
+            return false;
+        }
+        // every frame of a replay is timed, even when the GPU falls behind
+        scene->stats.lossless = true;
+        return true;
+    }
+    int replay_frames() {
+        return (int)(path.duration() / replay_step) + 1;
+    }
+    // camera of the given replay frame, also sets the light intensities
+    void replay_camera(int frame) {
+        camera = path.sample(frame * replay_step, scene->light_info);
+        Control::camera = &camera;
+    }
+    void log_frame(int frame, double cpu_ms) {
+        auto finished = scene->stats.take_finished();
+        if(bench.replay.empty()) return;
+        log.cpu(frame, cpu_ms);
+        for(auto [f, ms]: finished) log.gpu(f, ms);
+    }
+    void finish_bench(int width, int height) {
+        if(!bench.record.empty()) path.save(bench.record);
+        if(bench.replay.empty()) return;
+        // read back the frames still in flight
+        glFinish();
+        scene->stats.begin_frame(scene->frame);
+        for(auto [f, ms]: scene->stats.take_finished()) log.gpu(f, ms);
+        printf("replay of %s, %dx%d, frame times in ms:\n", bench.replay.u8string().c_str(), width, height);
+        log.print();
+        if(bench.summary.empty()) return;
+        std::string names;
+        for(auto &name: scene_names) names += (names.empty() ? "" : " ") + name;
+        log.write_json(bench.summary, {
+            {"scene", names},
+            {"path", bench.replay.u8string()},
+            {"size", std::to_string(width) + "x" + std::to_string(height)},
+            {"renderer", (const char *)glGetString(GL_RENDERER)},
+            {"version", (const char *)glGetString(GL_VERSION)},
+        }, scene->stats.summary());
+    }
+    void load_scene(const char *str) {
+        scene_names.push_back(str);
         try {
             scene -> load(str);
-        } catch(char *msg) {
+        } catch(const char *msg) {
             printf("Fail to load scene: %s\n", msg);
+        } catch(const std::string &msg) {
+            printf("Fail to load scene: %s\n", msg.c_str());
         }
     }
     /*glm::mat4 view() {
@@ -130,38 +243,35 @@ public:
                glm::translate(glm::mat4(1.f), -camera);
     }*/
     void main_loop() {
-        std::sort(beatmap.begin(), beatmap.end());
         puts("init draw");
         scene->init_draw(width, height);
         // scene->model()["robot"] = {glm::translate(glm::mat4(1.f), glm::vec3(0.7f, -1.f, 0.7f)) * glm::scale(glm::mat4(1.f), glm::vec3(0.01f))};
         scene->activate_shadow();
+        if(scene->view) camera = *scene->view;
         puts("Enter main loop");
         auto last = glfwGetTime();
         int frame_count = 0;
-        while (!glfwWindowShouldClose(window)) {
-            for(auto &[x,y]: scene -> meshes) if(x == "ground") {
-                for(auto m: y->mtl->materials) {
-                    m->roughness = roughness;
-                    m->metallic= metallic;
-                    m->Kd = color;
-                }
-            }
+        int fb_width = width, fb_height = height;
+        for(int replay_frame = 0; !glfwWindowShouldClose(window); ++replay_frame) {
+            glfwGetFramebufferSize(window, &fb_width, &fb_height);
+            glfwPollEvents();
+            update_ground();
             auto now = glfwGetTime();
             float t = now / 10;
             float dz = abs(t  - int(t / 2) * 2 - 1);
            // scene->model()["plant"] = {glm::translate(glm::mat4(1.f), glm::vec3(0, -1, dz))};
             control_update_frame(now);
-            /*scene->model()["wheel"] = {};
-            for(auto [t, x]: beatmap) {
-                int _t = t - now * 1000;
-                if(_t >= -300 && _t <= 1e4) {
-                    scene->model()["wheel"].push_back(glm::translate(glm::mat4(1.f), glm::vec3((x - 2) * 2.f, -1.f, -_t / 30.f)) * glm::scale(glm::mat4(1.f), glm::vec3(0.04)));
-                }
-            }*/
+            if(!bench.replay.empty()) {
+                if(replay_frame == replay_frames()) break;
+                now = replay_frame * replay_step;
+                replay_camera(replay_frame);
+            }
+            if(!bench.record.empty()) path.add(now - last, camera, scene->light_info);
+            update_beatmap(now);
             // printf("Frame: %d\n", ++frame_count);
 
             // printf("%f %f\n", pitch, yaw);
-            auto vp = projection() * Control::camera->view();
+            auto vp = projection(fb_width, fb_height) * Control::camera->view();
             /*for(auto i: {glm::vec3(0,0,0), glm::vec3(0,0,1), glm::vec3(0,1,1), glm::vec3(1,1,1)}) {
                 auto p = vp * glm::vec4(i, 1);
                 auto q = glm::vec3(p.xyz) / p.w;
@@ -186,15 +296,190 @@ public:
             mesh->draw(vp, Control::camera, light);*/
             // scene->update_light(lights);
             // light, light_intense);
-            float m = movement;
-            movement = 0;
-            scene->render(window, vp, camera.position, now, 1 - alpha, m, ssdo_alpha);
+            scene->config = render_config;
+            auto begin = std::chrono::steady_clock::now();
+            int frame = scene->frame;
+            scene->render(fb_width, fb_height, vp, camera.position, 1 - alpha, ssdo_alpha);
+            render_gpu_ms = scene->gpu_ms;
+            render_tile_hits = scene->ssdo_tile_hits;
+            render_scale = scene->render_scale;
 
             // ps->set_particle_size(2e-3 * particle_size);
             // ps->draw(particle_number, vp, Control::camera, now / 100 * rot_speed, light);
+            scene->stats.begin("ui");
             render_ui();
+            scene->stats.end();
+            log_frame(frame, std::chrono::duration <double, std::milli> (std::chrono::steady_clock::now() - begin).count());
+            glfwSwapBuffers(window);
             // break;
         }
+        finish_bench(fb_width, fb_height);
+    }
+    // renders from the scene's camera, or along the replayed path, at a fixed timestep
+    void headless_loop(const HeadlessOptions &opt) {
+        scene->init_draw(opt.width, opt.height);
+        scene->finish_programs();
+        scene->activate_shadow();
+        if(scene->view) camera = *scene->view;
+        std::error_code error;
+        if(!opt.out.empty()) fs::create_directories(opt.out, error);
+        std::vector <unsigned char> pixels;
+        int frames = bench.replay.empty() ? opt.frames : replay_frames();
+        for(int i = 0; i < frames; ++i) {
+            if(!bench.replay.empty()) replay_camera(i);
+            auto vp = projection(opt.width, opt.height) * camera.view();
+            auto begin = std::chrono::steady_clock::now();
+            update_ground();
+            update_beatmap(i * replay_step);
+            scene->config = render_config;
+            int frame = scene->frame;
+            scene->render(opt.width, opt.height, vp, camera.position, 1 - alpha, ssdo_alpha);
+            double ms = std::chrono::duration <double, std::milli> (std::chrono::steady_clock::now() - begin).count();
+            log_frame(frame, ms);
+            printf("frame %d: %.2f ms, GPU %.2f ms (frame %d), render scale %.3f",
+                   i, ms, scene->gpu_ms, scene->gpu_frame, scene->render_scale);
+            if(!beatmap.empty()) printf(", %d notes", beatmap.active());
+            if(scene->ssdo_tile_hits >= 0) printf(", SSDO tile hits %.1f%%", scene->ssdo_tile_hits * 100);
+            printf("\n");
+            if(opt.out.empty()) continue;
+
+            read_frame(pixels, opt.width, opt.height);
+            char name[32];
+            snprintf(name, sizeof(name), "frame_%04d.png", i);
+            write_png(opt.out / name, pixels, opt.width, opt.height);
+        }
+        finish_bench(opt.width, opt.height);
+    }
+    void read_frame(std::vector <unsigned char> &pixels, int width, int height) {
+        pixels.resize(width * height * 3);
+        glBindFramebuffer(GL_FRAMEBUFFER, 0);
+        glPixelStorei(GL_PACK_ALIGNMENT, 1);
+        glReadPixels(0, 0, width, height, GL_RGB, GL_UNSIGNED_BYTE, pixels.data());
+        CheckGLError();
+    }
+    void write_png(const Path &path, const std::vector <unsigned char> &pixels, int width, int height) {
+        stbi_flip_vertically_on_write(1);
+        if(!stbi_write_png(path.u8string().c_str(), width, height, 3, pixels.data(), width * 3)) {
+            warn(2, "fail to write %s", path.u8string().c_str());
+        }
+    }
+    /*
+     * Renders the view many ways: first a reference averaging reference_frames
+     * frames of the most SSDO samples with no a-trous blur, then every point of
+     * the grid for opt.frames frames from a reset history. The last frame of a
+     * point is compared with the reference, its cost is the mean GPU time after
+     * two warm-up frames. With --replay the camera moves along the end of the
+     * path and the reference is rendered where it stops. Sampling depends on
+     * the frame since the history reset only, so reruns give the same images.
+     */
+    bool sweep(const SweepOptions &opt, int width, int height) {
+        std::map <std::string, std::vector <float>> axes = {
+            {"spp", {16}}, {"scale", {1}}, {"passes", {2}}, {"alpha", {1 - alpha}},
+        };
+        std::istringstream grid(opt.grid);
+        for(std::string axis; std::getline(grid, axis, ';');) {
+            auto eq = axis.find('=');
+            auto key = axis.substr(0, eq);
+            if(eq == std::string::npos || !axes.count(key)) {
+                printf("--grid: unknown axis %s, expected spp, scale, passes and alpha\n", key.c_str());
+                return false;
+            }
+            axes[key].clear();
+            std::istringstream values(axis.substr(eq + 1));
+            for(std::string v; std::getline(values, v, ',');) axes[key].push_back(atof(v.c_str()));
+        }
+
+        scene->init_draw(width, height);
+        scene->finish_programs();
+        scene->activate_shadow();
+        if(scene->view) camera = *scene->view;
+        scene->stats.lossless = true;
+        std::error_code error;
+        fs::create_directories(opt.dir, error);
+
+        // the frames rendered for one setting, returns the mean GPU ms
+        auto run = [&](RenderConfig config, float denoise_alpha, int frames, bool moving, std::vector <unsigned char> &pixels) {
+            // every setting has its own SSDO variant, compiled before the frames are timed
+            scene->prepare_variants(config);
+            scene->finish_programs();
+            scene->reset_history();
+            scene->stats.take_finished();
+            int start = scene->frame;
+            for(int i = 0; i < frames; ++i) {
+                if(!bench.replay.empty()) replay_camera(std::max(0, replay_frames() - (moving ? frames - i : 1)));
+                update_ground();
+                scene->config = config;
+                scene->render(width, height, projection(width, height) * camera.view(), camera.position,
+                              denoise_alpha, ssdo_alpha);
+            }
+            read_frame(pixels, width, height);
+            scene->stats.begin_frame(scene->frame);
+            float sum = 0;
+            int measured = 0;
+            for(auto [f, ms]: scene->stats.take_finished()) {
+                if(f >= start + 2) sum += ms, measured++;
+            }
+            return measured ? sum / measured : 0.f;
+        };
+
+        RenderConfig base = render_config;
+        base.dynamic_resolution = false;
+        // the passes axis sweeps the a-trous filter, the reference runs none of it
+        base.atrous = true;
+        std::vector <unsigned char> reference, pixels;
+        auto config = base;
+        config.ssdo_spp = Scene::max_ssdo_spp;
+        config.ssdo_scale = 1;
+        config.denoise_passes = 0;
+        // alpha 0 leaves the temporal pass a running mean
+        float reference_ms = run(config, 0.f, opt.reference_frames, false, reference);
+        write_png(opt.dir / "reference.png", reference, width, height);
+        printf("sweep: reference of %d spp x %d frames, %.2f ms per frame\n",
+               Scene::max_ssdo_spp, opt.reference_frames, reference_ms);
+
+        struct Point {
+            int spp = 0, scale = 0, passes = 0;
+            float alpha = 0, ms = 0, rmse = 0, ssim = 0, flip = 0;
+            bool pareto = false;
+        };
+        std::vector <Point> points;
+        for(float spp: axes["spp"]) for(float scale: axes["scale"]) for(float passes: axes["passes"]) for(float a: axes["alpha"]) {
+            Point p{(int)spp, (int)scale, (int)passes, a};
+            config = base;
+            config.ssdo_spp = p.spp;
+            config.ssdo_scale = p.scale;
+            config.denoise_passes = p.passes;
+            p.ms = run(config, a, opt.frames, true, pixels);
+            p.rmse = ImageMetrics::rmse(pixels, reference, width, height);
+            p.ssim = ImageMetrics::ssim(pixels, reference, width, height);
+            p.flip = ImageMetrics::flip(pixels, reference, width, height);
+            char name[64];
+            snprintf(name, sizeof(name), "spp%d_scale%d_passes%d_alpha%.3g.png", p.spp, p.scale, p.passes, a);
+            write_png(opt.dir / name, pixels, width, height);
+            printf("sweep: %s %.2f ms, rmse %.4f, ssim %.4f, flip %.4f\n", name, p.ms, p.rmse, p.ssim, p.flip);
+            points.push_back(p);
+        }
+
+        // a point is on the front when no other one is as fast and as good, and better in one
+        for(auto &p: points) {
+            p.pareto = std::none_of(points.begin(), points.end(), [&](const Point &q) {
+                return q.ms <= p.ms && q.flip <= p.flip && (q.ms < p.ms || q.flip < p.flip);
+            });
+        }
+        std::sort(points.begin(), points.end(), [](const Point &a, const Point &b) { return a.ms < b.ms; });
+        auto csv_path = (opt.dir / "sweep.csv").u8string();
+        FILE *csv = fopen(csv_path.c_str(), "w");
+        if(csv) fprintf(csv, "spp,scale,passes,alpha,gpu_ms,rmse,ssim,flip,pareto\n");
+        printf("GI settings at %dx%d by GPU time, * on the Pareto front of time and FLIP:\n", width, height);
+        printf("   %4s %5s %6s %6s %9s %8s %8s %8s\n", "spp", "scale", "passes", "alpha", "ms", "rmse", "ssim", "flip");
+        for(auto &p: points) {
+            printf(" %c %4d %5d %6d %6.3f %9.3f %8.4f %8.4f %8.4f\n", p.pareto ? '*' : ' ',
+                   p.spp, p.scale, p.passes, p.alpha, p.ms, p.rmse, p.ssim, p.flip);
+            if(csv) fprintf(csv, "%d,%d,%d,%g,%.4f,%.5f,%.5f,%.5f,%d\n",
+                            p.spp, p.scale, p.passes, p.alpha, p.ms, p.rmse, p.ssim, p.flip, (int)p.pareto);
+        }
+        if(csv) fclose(csv), printf("sweep: table written to %s\n", csv_path.c_str());
+        return true;
     }
 };
 
@@ -203,8 +488,62 @@ int main(int argc, char **argv) {
         printf("Usage: program [Path to .obj]\n");
         return 0;
     }*/
+    HeadlessOptions headless;
+    BenchOptions bench;
+    SweepOptions sweep;
+    bool is_headless = false;
+    const char *stats_csv = nullptr;
+    const char *beatmap = nullptr, *beatmap_mesh = nullptr;
+    std::vector <const char *> scenes;
+    for(int i = 1; i < argc; ++i) {
+        bool value = i + 1 < argc;
+        if(strcmp(argv[i], "--stats-csv") == 0 && value) {
+            stats_csv = argv[++i];
+        } else if(strcmp(argv[i], "--shader-cache") == 0 && value) {
+            ProgramCache::dir = argv[++i];
+        } else if(strcmp(argv[i], "--no-shader-cache") == 0) {
+            ProgramCache::dir.clear();
+        } else if(strcmp(argv[i], "--beatmap") == 0 && value) {
+            beatmap = argv[++i];
+        } else if(strcmp(argv[i], "--beatmap-mesh") == 0 && value) {
+            beatmap_mesh = argv[++i];
+        } else if(strcmp(argv[i], "--gpu-driven") == 0) {
+            render_config.gpu_driven = true;
+        } else if(strcmp(argv[i], "--headless") == 0) {
+            is_headless = true;
+        } else if(strcmp(argv[i], "--frames") == 0 && value) {
+            headless.frames = atoi(argv[++i]);
+        } else if(strcmp(argv[i], "--size") == 0 && value) {
+            if(sscanf(argv[++i], "%dx%d", &headless.width, &headless.height) != 2 ||
+               headless.width <= 0 || headless.height <= 0) {
+                printf("--size takes WIDTHxHEIGHT, got %s\n", argv[i]);
+                return 1;
+            }
+        } else if(strcmp(argv[i], "--out") == 0 && value) {
+            headless.out = argv[++i];
+        } else if(strcmp(argv[i], "--record") == 0 && value) {
+            bench.record = argv[++i];
+        } else if(strcmp(argv[i], "--replay") == 0 && value) {
+            bench.replay = argv[++i];
+        } else if(strcmp(argv[i], "--summary") == 0 && value) {
+            bench.summary = argv[++i];
+        } else if(strcmp(argv[i], "--sweep") == 0 && value) {
+            sweep.dir = argv[++i];
+            is_headless = true;
+        } else if(strcmp(argv[i], "--grid") == 0 && value) {
+            sweep.grid = argv[++i];
+        } else if(strcmp(argv[i], "--sweep-frames") == 0 && value) {
+            sweep.frames = std::max(1, atoi(argv[++i]));
+        } else if(strcmp(argv[i], "--reference-frames") == 0 && value) {
+            sweep.reference_frames = std::max(1, atoi(argv[++i]));
+        } else {
+            scenes.push_back(argv[i]);
+        }
+    }
+    if(scenes.empty()) scenes.push_back("2.scene");
+
     Application app;
-    app.init();
+    app.init(is_headless ? &headless : nullptr);
     /*std::string name = "";
     for(int i = 1; i < argc; ++i) {
         if(strcmp(argv[i], "-name") == 0) {
@@ -215,9 +554,11 @@ int main(int argc, char **argv) {
         printf("loading %s %s\n", name.c_str(), argv[i]);
         app.load(name, argv[i]);
     }*/
-    char s[]="D:/ssdo/graphics2024/2.scene";
-    app.load_scene(s);
-    for(int i = 1; i < argc; ++i) app.load_scene(argv[i]);
-    // app.load_beatmap("2.beatmap");
-    app.main_loop();
+    for(auto path: scenes) app.load_scene(path);
+    if(stats_csv) app.open_stats_csv(stats_csv);
+    if(!app.set_bench(bench)) return 1;
+    if(beatmap && !app.load_beatmap(beatmap, beatmap_mesh)) return 1;
+    if(!sweep.dir.empty()) return app.sweep(sweep, headless.width, headless.height) ? 0 : 1;
+    if(is_headless) app.headless_loop(headless);
+    else app.main_loop();
 }
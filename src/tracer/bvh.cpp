@@ -0,0 +1,281 @@
+#include "bvh.hpp"
+#include "../util/common.hpp"
+#include <algorithm>
+#include <chrono>
+#include <limits>
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define BVH_SSE
+#endif
+
+namespace {
+
+const float inf = std::numeric_limits <float>::infinity();
+
+struct Box {
+    glm::vec3 lo = glm::vec3(inf), hi = glm::vec3(-inf);
+    void grow(glm::vec3 p) { lo = glm::min(lo, p), hi = glm::max(hi, p); }
+    void grow(const Box &b) { lo = glm::min(lo, b.lo), hi = glm::max(hi, b.hi); }
+    float area() const {
+        glm::vec3 d = hi - lo;
+        if(d.x < 0 || d.y < 0 || d.z < 0) return 0;
+        return 2 * (d.x * d.y + d.y * d.z + d.z * d.x);
+    }
+};
+
+// binary tree, leaves have left == -1 and cover order[first, first + count)
+struct BuildNode {
+    Box box;
+    int left = -1, right = -1;
+    int first = 0, count = 0;
+};
+
+struct Builder {
+    static const int bins = 16, max_leaf = 8;
+    std::vector <Box> boxes;
+    std::vector <glm::vec3> centroids;
+    std::vector <int> order;
+    std::vector <BuildNode> nodes;
+
+    int build(int first, int count) {
+        int index = nodes.size();
+        nodes.emplace_back();
+        Box box, centroid_box;
+        for(int i = first; i < first + count; ++i) {
+            box.grow(boxes[order[i]]);
+            centroid_box.grow(centroids[order[i]]);
+        }
+        nodes[index].box = box, nodes[index].first = first, nodes[index].count = count;
+        if(count <= 2) return index;
+
+        // best of 16 bins along each axis, cost in triangle tests with a box test costing 1
+        float best_cost = inf;
+        int best_axis = -1, best_bin = 0;
+        glm::vec3 extent = centroid_box.hi - centroid_box.lo;
+        for(int axis = 0; axis < 3; ++axis) {
+            if(extent[axis] <= 0) continue;
+            Box bin_box[bins];
+            int bin_count[bins] = {};
+            float scale = bins / extent[axis];
+            auto bin_of = [&](int t) {
+                return std::min(bins - 1, (int)((centroids[t][axis] - centroid_box.lo[axis]) * scale));
+            };
+            for(int i = first; i < first + count; ++i) {
+                int b = bin_of(order[i]);
+                bin_box[b].grow(boxes[order[i]]);
+                bin_count[b]++;
+            }
+            // sweep from the right, then from the left
+            float right_area[bins];
+            int right_count[bins];
+            Box acc;
+            int n = 0;
+            for(int b = bins - 1; b > 0; --b) {
+                acc.grow(bin_box[b]), n += bin_count[b];
+                right_area[b] = acc.area(), right_count[b] = n;
+            }
+            acc = Box(), n = 0;
+            for(int b = 0; b < bins - 1; ++b) {
+                acc.grow(bin_box[b]), n += bin_count[b];
+                if(n == 0 || right_count[b + 1] == 0) continue;
+                float cost = acc.area() * n + right_area[b + 1] * right_count[b + 1];
+                if(cost < best_cost) best_cost = cost, best_axis = axis, best_bin = b;
+            }
+        }
+        float area = box.area();
+        int mid;
+        if(best_axis < 0) {
+            // every centroid in one spot, split the list in half
+            if(count <= max_leaf) return index;
+            mid = first + count / 2;
+        } else {
+            best_cost = 1 + (area > 0 ? best_cost / area : count);
+            if(count <= max_leaf && count <= best_cost) return index;
+            float scale = bins / extent[best_axis];
+            auto it = std::partition(order.begin() + first, order.begin() + first + count, [&](int t) {
+                return std::min(bins - 1, (int)((centroids[t][best_axis] - centroid_box.lo[best_axis]) * scale)) <= best_bin;
+            });
+            mid = it - order.begin();
+        }
+        int left = build(first, mid - first);
+        int right = build(mid, first + count - mid);
+        nodes[index].left = left, nodes[index].right = right;
+        return index;
+    }
+};
+
+}
+
+void Bvh::build(const std::vector <glm::vec3> &corners) {
+    auto begin = std::chrono::steady_clock::now();
+    int n = corners.size() / 3;
+    nodes.clear(), triangles.clear();
+    _stats = Stats();
+    _stats.triangles = n;
+    if(n == 0) return;
+
+    Builder builder;
+    builder.boxes.resize(n), builder.centroids.resize(n), builder.order.resize(n);
+    for(int i = 0; i < n; ++i) {
+        for(int k = 0; k < 3; ++k) builder.boxes[i].grow(corners[3 * i + k]);
+        builder.centroids[i] = (builder.boxes[i].lo + builder.boxes[i].hi) * .5f;
+        builder.order[i] = i;
+    }
+    builder.build(0, n);
+    auto &bnodes = builder.nodes;
+
+    triangles.resize(n);
+    for(int i = 0; i < n; ++i) {
+        int t = builder.order[i];
+        glm::vec3 a = corners[3 * t], b = corners[3 * t + 1], c = corners[3 * t + 2];
+        triangles[i] = {a, b - a, c - a, t};
+    }
+
+    // pull grandchildren up until four children are taken, widest box first
+    float root_area = std::max(bnodes[0].box.area(), 1e-20f);
+    auto collapse = [&](auto &self, int b, int depth) -> int {
+        _stats.depth = std::max(_stats.depth, depth);
+        std::vector <int> kids;
+        if(bnodes[b].left < 0) kids = {b};
+        else kids = {bnodes[b].left, bnodes[b].right};
+        while((int)kids.size() < width) {
+            int widest = -1;
+            for(int i = 0; i < (int)kids.size(); ++i) {
+                if(bnodes[kids[i]].left >= 0 && (widest < 0 || bnodes[kids[i]].box.area() > bnodes[kids[widest]].box.area())) {
+                    widest = i;
+                }
+            }
+            if(widest < 0) break;
+            int k = kids[widest];
+            kids[widest] = bnodes[k].left;
+            kids.push_back(bnodes[k].right);
+        }
+        int index = nodes.size();
+        nodes.emplace_back();
+        _stats.sah += bnodes[b].box.area() / root_area;
+        for(int i = 0; i < width; ++i) {
+            Box box;
+            int32_t child = 0, count = 0;
+            if(i < (int)kids.size()) {
+                auto &k = bnodes[kids[i]];
+                box = k.box;
+                if(k.left < 0) {
+                    child = ~k.first, count = k.count;
+                    _stats.leaves++;
+                    _stats.sah += k.box.area() / root_area * k.count;
+                } else {
+                    child = self(self, kids[i], depth + 1);
+                }
+            }
+            auto &node = nodes[index];
+            for(int a = 0; a < 3; ++a) node.lo[a][i] = box.lo[a], node.hi[a][i] = box.hi[a];
+            node.child[i] = child, node.count[i] = count;
+        }
+        return index;
+    };
+    collapse(collapse, 0, 1);
+    if((width - 1) * _stats.depth + 1 > max_stack) {
+        warn(2, "[ERROR] Bvh: depth %d overflows the traversal stack of %d entries", _stats.depth, max_stack);
+        exit(1);
+    }
+    _stats.nodes = nodes.size();
+    _stats.build_ms = std::chrono::duration <double, std::milli> (std::chrono::steady_clock::now() - begin).count();
+}
+
+template <bool any> bool Bvh::traverse(const Ray &ray, Hit &hit) const {
+    if(nodes.empty()) return false;
+    glm::vec3 inv;
+    int sign[3];
+    for(int a = 0; a < 3; ++a) {
+        // keeps the slab distances finite for axis-aligned rays
+        float d = std::abs(ray.dir[a]) < 1e-20f ? (ray.dir[a] < 0 ? -1e-20f : 1e-20f) : ray.dir[a];
+        inv[a] = 1 / d;
+        sign[a] = d < 0;
+    }
+    float tmax = ray.tmax;
+    bool found = false;
+
+    struct Entry {
+        int32_t child, count;
+        float t;
+    } stack[max_stack]; // deep enough for _stats.depth, checked by build
+    int top = 0;
+    stack[top++] = {0, 0, 0};
+    while(top) {
+        Entry e = stack[--top];
+        if(e.t > tmax) continue;
+        if(e.count > 0) {
+            for(int i = ~e.child; i < ~e.child + e.count; ++i) {
+                auto &tri = triangles[i];
+                glm::vec3 p = glm::cross(ray.dir, tri.e2);
+                float det = glm::dot(tri.e1, p);
+                if(std::abs(det) < 1e-12f) continue;
+                float inv_det = 1 / det;
+                glm::vec3 s = ray.origin - tri.v0;
+                float u = glm::dot(s, p) * inv_det;
+                if(u < 0 || u > 1) continue;
+                glm::vec3 q = glm::cross(s, tri.e1);
+                float v = glm::dot(ray.dir, q) * inv_det;
+                if(v < 0 || u + v > 1) continue;
+                float t = glm::dot(tri.e2, q) * inv_det;
+                if(t <= 0 || t >= tmax) continue;
+                if(any) return true;
+                tmax = t, found = true;
+                hit.t = t, hit.triangle = tri.id, hit.u = u, hit.v = v;
+            }
+            continue;
+        }
+        // slabs of the four boxes, empty slots have lo > hi and always miss
+        auto &node = nodes[e.child];
+        alignas(16) float tnear[width];
+        int mask;
+#ifdef BVH_SSE
+        __m128 t0 = _mm_setzero_ps(), t1 = _mm_set1_ps(tmax);
+        for(int a = 0; a < 3; ++a) {
+            __m128 o = _mm_set1_ps(ray.origin[a]), d = _mm_set1_ps(inv[a]);
+            __m128 near = _mm_load_ps(sign[a] ? node.hi[a] : node.lo[a]);
+            __m128 far = _mm_load_ps(sign[a] ? node.lo[a] : node.hi[a]);
+            t0 = _mm_max_ps(t0, _mm_mul_ps(_mm_sub_ps(near, o), d));
+            t1 = _mm_min_ps(t1, _mm_mul_ps(_mm_sub_ps(far, o), d));
+        }
+        mask = _mm_movemask_ps(_mm_cmple_ps(t0, t1));
+        _mm_store_ps(tnear, t0);
+#else
+        mask = 0;
+        for(int i = 0; i < width; ++i) {
+            float t0 = 0, t1 = tmax;
+            for(int a = 0; a < 3; ++a) {
+                float near = sign[a] ? node.hi[a][i] : node.lo[a][i];
+                float far = sign[a] ? node.lo[a][i] : node.hi[a][i];
+                t0 = std::max(t0, (near - ray.origin[a]) * inv[a]);
+                t1 = std::min(t1, (far - ray.origin[a]) * inv[a]);
+            }
+            tnear[i] = t0;
+            if(t0 <= t1) mask |= 1 << i;
+        }
+#endif
+        // far children go on the stack first so the nearest is visited next,
+        // an insertion sort by entry distance while collecting them
+        int hits[width], n = 0;
+        for(int i = 0; i < width; ++i) {
+            if(!(mask >> i & 1)) continue;
+            int k = n++;
+            for(; k > 0 && tnear[hits[k - 1]] < tnear[i]; --k) hits[k] = hits[k - 1];
+            hits[k] = i;
+        }
+        for(int k = 0; k < n; ++k) {
+            int i = hits[k];
+            stack[top++] = {node.child[i], node.count[i], tnear[i]};
+        }
+    }
+    return found;
+}
+
+bool Bvh::intersect(const Ray &ray, Hit &hit) const {
+    return traverse <false> (ray, hit);
+}
+
+bool Bvh::occluded(const Ray &ray) const {
+    Hit hit;
+    return traverse <true> (ray, hit);
+}
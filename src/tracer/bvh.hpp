@@ -0,0 +1,55 @@
+#pragma once
+#include <glm/glm.hpp>
+#include <cstdint>
+#include <vector>
+
+struct Ray {
+    glm::vec3 origin, dir;
+    float tmax;
+};
+
+struct Hit {
+    float t;
+    int triangle = -1; // index into the corners given to Bvh::build
+    float u, v;        // barycentrics of corners 1 and 2
+};
+
+/*
+ * Four-wide bounding volume hierarchy over triangles. A binary tree is built
+ * with the binned surface area heuristic, then collapsed so every node holds
+ * the boxes of up to four children side by side and one ray tests them
+ * together with SSE (a plain loop elsewhere).
+ */
+class Bvh {
+public:
+    struct Stats {
+        int triangles = 0, nodes = 0, leaves = 0, depth = 0;
+        float sah = 0; // expected cost of a random ray, in box tests
+        double build_ms = 0;
+    };
+
+    // three corners per triangle
+    void build(const std::vector <glm::vec3> &corners);
+    bool intersect(const Ray &ray, Hit &hit) const; // closest hit before ray.tmax
+    bool occluded(const Ray &ray) const;            // any hit before ray.tmax
+    const Stats &stats() const { return _stats; }
+
+private:
+    // traversal pushes at most width - 1 more entries per level than it pops
+    static const int width = 4, max_stack = 256;
+    // children are node indices, or ~first triangle with count > 0 for leaves
+    struct alignas(16) Node {
+        float lo[3][width], hi[3][width];
+        int32_t child[width];
+        int32_t count[width];
+    };
+    struct Triangle {
+        glm::vec3 v0, e1, e2;
+        int id;
+    };
+    std::vector <Node> nodes;
+    std::vector <Triangle> triangles;
+    Stats _stats;
+
+    template <bool any> bool traverse(const Ray &ray, Hit &hit) const;
+};
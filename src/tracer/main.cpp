@@ -0,0 +1,86 @@
+#include "path_tracer.hpp"
+#include <glm/gtc/matrix_transform.hpp>
+
+/*
+ * pathtracer [scenes] [--size WxH] [--spp N] [--threads N] [--tile N] [--depth N]
+ *            [--out DIR] [--save-every N]
+ *
+ * Renders the view of the scene on the CPU, without a GPU or a GL context.
+ * With --out the running mean is written as reference.pfm (linear radiance)
+ * and reference.png (tonemapped like the GL frames) after passes 1, 2, 4, ...
+ * and the last one, or every N passes with --save-every.
+ */
+int main(int argc, char **argv) {
+    PathTracer::Options options;
+    int spp = 64, save_every = 0;
+    Path out;
+    std::vector <const char *> scenes;
+    for(int i = 1; i < argc; ++i) {
+        bool value = i + 1 < argc;
+        if(strcmp(argv[i], "--size") == 0 && value) {
+            if(sscanf(argv[++i], "%dx%d", &options.width, &options.height) != 2 ||
+               options.width <= 0 || options.height <= 0) {
+                printf("--size takes WIDTHxHEIGHT, got %s\n", argv[i]);
+                return 1;
+            }
+        } else if(strcmp(argv[i], "--spp") == 0 && value) {
+            spp = std::max(1, atoi(argv[++i]));
+        } else if(strcmp(argv[i], "--threads") == 0 && value) {
+            options.threads = std::max(0, atoi(argv[++i]));
+        } else if(strcmp(argv[i], "--tile") == 0 && value) {
+            options.tile = std::max(1, atoi(argv[++i]));
+        } else if(strcmp(argv[i], "--depth") == 0 && value) {
+            options.max_depth = std::max(0, atoi(argv[++i]));
+        } else if(strcmp(argv[i], "--out") == 0 && value) {
+            out = argv[++i];
+        } else if(strcmp(argv[i], "--save-every") == 0 && value) {
+            save_every = std::max(0, atoi(argv[++i]));
+        } else {
+            scenes.push_back(argv[i]);
+        }
+    }
+    if(scenes.empty()) scenes.push_back("2.scene");
+
+    Scene scene;
+    for(auto path: scenes) {
+        try {
+            scene.load(path);
+        } catch(const char *e) {
+            printf("%s: %s\n", path, e);
+            return 1;
+        } catch(std::string e) {
+            printf("%s: %s\n", path, e.c_str());
+            return 1;
+        }
+    }
+    // the viewer drives the ground's material from its UI, start from the same defaults
+    scene.set_ground(GroundMaterial());
+    Camera camera = scene.view ? *scene.view : Camera();
+    // the viewer's projection
+    auto vp = glm::perspective(glm::radians(45.f), 1.f * options.width / options.height, .1f, 100.f) * camera.view();
+
+    PathTracer tracer(scene, options);
+    auto &bvh = tracer.bvh().stats();
+    printf("BVH: %d triangles, %d nodes, %d leaves, depth %d, SAH cost %.2f, built in %.1f ms\n",
+           bvh.triangles, bvh.nodes, bvh.leaves, bvh.depth, bvh.sah, bvh.build_ms);
+    printf("Tracing %dx%d, %d spp, %d threads, %dx%d tiles\n",
+           options.width, options.height, spp, tracer.threads(), options.tile, options.tile);
+
+    std::error_code error;
+    if(!out.empty()) fs::create_directories(out, error);
+    uint64_t rays = 0;
+    double ms = 0;
+    for(int i = 1; i <= spp; ++i) {
+        auto stats = tracer.pass(vp, camera.position);
+        rays += stats.rays, ms += stats.ms;
+        printf("pass %d: %.1f ms, %.2f Mrays/s, %d tiles stolen\n", i, stats.ms, stats.rays / stats.ms / 1e3, stats.steals);
+        bool save = save_every > 0 ? i % save_every == 0 : (i & (i - 1)) == 0;
+        if(out.empty() || !(save || i == spp)) continue;
+        if(tracer.write_pfm(out / "reference.pfm") && tracer.write_png(out / "reference.png")) {
+            printf("saved %d spp to %s\n", i, out.u8string().c_str());
+        }
+    }
+    printf("%d spp in %.2f s: %.2f Mrays/s, %.2f Mrays/s per thread\n",
+           spp, ms / 1e3, rays / ms / 1e3, rays / ms / 1e3 / tracer.threads());
+    return 0;
+}
@@ -0,0 +1,288 @@
+#include "path_tracer.hpp"
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <stb_image_write.h>
+
+// PCG32, seeded per pixel and pass so images do not depend on the thread schedule
+struct PathTracer::Rng {
+    uint64_t state;
+    Rng(uint32_t x, uint32_t y, uint32_t pass) {
+        state = ((uint64_t)y << 32 | x) * 0x9e3779b97f4a7c15ull ^ (uint64_t)pass * 0xbf58476d1ce4e5b9ull;
+        next(), next();
+    }
+    uint32_t next() {
+        uint64_t old = state;
+        state = old * 6364136223846793005ull + 1442695040888963407ull;
+        uint32_t shifted = ((old >> 18) ^ old) >> 27, rot = old >> 59;
+        return shifted >> rot | shifted << ((32 - rot) & 31);
+    }
+    float uniform() {
+        return (next() >> 8) * (1.f / (1 << 24));
+    }
+};
+
+/*
+ * Same terms as fresnel, D_GGX and G_Smith of the shaders, and L without the
+ * light: kD albedo / PI + F D G / (4 n.v n.i).
+ */
+static glm::vec3 fresnel(glm::vec3 v, glm::vec3 h, glm::vec3 F0) {
+    return F0 + (glm::vec3(1) - F0) * std::pow(glm::clamp(1 - glm::dot(v, h), 0.f, 1.f), 5.f);
+}
+static float D_GGX(glm::vec3 n, glm::vec3 h, float roughness) {
+    float a = roughness * roughness, a2 = a * a;
+    float NdotH = std::max(glm::dot(n, h), 0.f);
+    float denom = NdotH * NdotH * (a2 - 1) + 1;
+    return a2 / (PI * denom * denom);
+}
+static float G_SchlickGGX(float NdotV, float roughness) {
+    float r = roughness + 1, k = r * r / 8;
+    return NdotV / (NdotV * (1 - k) + k);
+}
+static float G_Smith(glm::vec3 n, glm::vec3 v, glm::vec3 i, float roughness) {
+    return G_SchlickGGX(std::max(0.f, glm::dot(n, v)), roughness) * G_SchlickGGX(std::max(0.f, glm::dot(n, i)), roughness);
+}
+static glm::vec3 brdf(glm::vec3 n, glm::vec3 v, glm::vec3 i, glm::vec3 albedo, float metallic, float roughness) {
+    glm::vec3 h = glm::normalize(i + v);
+    glm::vec3 F0 = glm::mix(glm::vec3(0.04f), albedo, metallic);
+    glm::vec3 F = fresnel(v, h, F0);
+    glm::vec3 kD = (glm::vec3(1) - F) * (1 - metallic);
+    glm::vec3 specular = F * D_GGX(n, h, roughness) * G_Smith(n, v, i, roughness) /
+                         (4 * std::max(glm::dot(n, v), 0.f) * std::max(glm::dot(n, i), 0.f) + 0.0001f);
+    return kD * albedo / PI + specular;
+}
+
+// orthonormal frame around n, n as the third axis
+static glm::vec3 to_world(glm::vec3 n, glm::vec3 local) {
+    glm::vec3 up = std::abs(n.z) > 0.999f ? glm::vec3(1, 0, 0) : glm::vec3(0, 0, 1);
+    glm::vec3 tangent = glm::normalize(glm::cross(up, n));
+    glm::vec3 bitangent = glm::cross(n, tangent);
+    return tangent * local.x + bitangent * local.y + n * local.z;
+}
+
+PathTracer::PathTracer(Scene &scene, const Options &options): options(options) {
+    _threads = options.threads > 0 ? options.threads : std::max(1u, std::thread::hardware_concurrency());
+    for(auto &[name, mesh]: scene.meshes) {
+        auto models = scene.model().count(name) ? scene.model()[name] : std::vector <glm::mat4> {glm::mat4(1.f)};
+        for(auto &model: models) {
+            glm::mat3 normal_matrix = glm::transpose(glm::inverse(glm::mat3(model)));
+            for(auto &object: mesh->objects) {
+                for(size_t k = 0; k + 2 < object.triangles.size(); k += 3) {
+                    Triangle t;
+                    glm::vec3 p[3];
+                    for(int c = 0; c < 3; ++c) {
+                        auto &vertex = mesh->vertices[object.triangles[k + c]];
+                        p[c] = apply_transform_vec3(vertex.position, model);
+                        t.corners[c] = {normal_matrix * vertex.normal, vertex.uv};
+                        positions.push_back(p[c]);
+                    }
+                    t.normal = glm::cross(p[1] - p[0], p[2] - p[0]);
+                    float len = glm::length(t.normal);
+                    t.normal = len > 0 ? t.normal / len : glm::vec3(0, 1, 0);
+                    t.material = object.material();
+                    triangles.push_back(t);
+                }
+            }
+        }
+    }
+    for(auto &light: scene.light_info) {
+        lights.push_back({light.camera.position, light.camera.dir(), light.intense, light.type});
+    }
+    _bvh.build(positions);
+    film.assign((size_t)options.width * options.height, glm::vec3(0));
+}
+
+glm::vec3 PathTracer::radiance(Ray ray, Rng &rng, uint64_t &rays) const {
+    glm::vec3 color(0), throughput(1);
+    for(int depth = 0; depth <= options.max_depth; ++depth) {
+        Hit hit;
+        rays++;
+        if(!_bvh.intersect(ray, hit)) break;
+
+        auto &tri = triangles[hit.triangle];
+        float w = 1 - hit.u - hit.v;
+        const glm::vec3 *p = &positions[3 * hit.triangle];
+        glm::vec3 pos = w * p[0] + hit.u * p[1] + hit.v * p[2];
+        glm::vec3 n = w * tri.corners[0].normal + hit.u * tri.corners[1].normal + hit.v * tri.corners[2].normal;
+        glm::vec2 uv = w * tri.corners[0].uv + hit.u * tri.corners[1].uv + hit.v * tri.corners[2].uv;
+
+        // what the G-buffer pass writes
+        glm::vec3 albedo(0);
+        float metallic = 0.5f, roughness = 0.5f;
+        if(auto m = tri.material) {
+            albedo = m->Kd, metallic = m->metallic, roughness = m->roughness;
+            if(m->texture) {
+                glm::vec4 c = m->texture->sample(uv / glm::vec2(m->texture_scale));
+                albedo = glm::pow(glm::vec3(c), glm::vec3(2.2f));
+            }
+            if(m->texture_normal) {
+                glm::vec3 c = glm::vec3(m->texture_normal->sample(uv / glm::vec2(m->texture_normal_scale))) * 2.f - 1.f;
+                n = glm::vec3(c.x, c.z, c.y);
+            }
+        }
+        n = glm::dot(n, n) > 1e-12f ? glm::normalize(n) : tri.normal;
+
+        // two-sided: both normals face the viewer
+        glm::vec3 v = -ray.dir, ng = tri.normal;
+        if(glm::dot(ng, v) < 0) ng = -ng;
+        if(glm::dot(n, ng) < 0) n = -n;
+        glm::vec3 origin = pos + ng * (1e-4f * std::max(1.f, glm::length(pos)));
+
+        // direct light of every light, visibility by a shadow ray
+        for(auto &light: lights) {
+            glm::vec3 i, radiance;
+            float dist = std::numeric_limits <float>::infinity();
+            if(light.type == DIRECTIONAL_LIGHT) {
+                i = -light.direction;
+                radiance = light.intense;
+            } else {
+                i = light.position - pos;
+                float r = glm::dot(i, i);
+                dist = std::sqrt(r);
+                i /= dist;
+                if(light.type == CONE_LIGHT && glm::dot(-light.direction, i) < 0.7f) continue;
+                radiance = light.intense / r;
+            }
+            float theta = glm::dot(i, n);
+            if(theta <= 0 || glm::dot(i, ng) <= 0) continue;
+            rays++;
+            if(_bvh.occluded({origin, i, dist})) continue;
+            color += throughput * brdf(n, v, i, albedo, metallic, roughness) * radiance * theta;
+        }
+        if(depth == options.max_depth) break;
+
+        // next direction, one-sample MIS of cosine and GGX half-vector sampling
+        float a = std::max(roughness * roughness, 1e-3f), a2 = a * a;
+        float specular_prob = glm::mix(0.25f, 0.75f, metallic);
+        float u1 = rng.uniform(), u2 = rng.uniform();
+        glm::vec3 i;
+        if(rng.uniform() < specular_prob) {
+            float cos_h = std::sqrt((1 - u1) / (1 + (a2 - 1) * u1)), sin_h = std::sqrt(std::max(0.f, 1 - cos_h * cos_h));
+            glm::vec3 h = to_world(n, glm::vec3(sin_h * std::cos(2 * PI * u2), sin_h * std::sin(2 * PI * u2), cos_h));
+            i = glm::reflect(ray.dir, h);
+        } else {
+            float r = std::sqrt(u1);
+            i = to_world(n, glm::vec3(r * std::cos(2 * PI * u2), r * std::sin(2 * PI * u2), std::sqrt(std::max(0.f, 1 - u1))));
+        }
+        float NdotI = glm::dot(n, i);
+        if(NdotI <= 0 || glm::dot(ng, i) <= 0) break;
+        glm::vec3 h = glm::normalize(i + v);
+        float NdotH = std::max(glm::dot(n, h), 0.f), denom = NdotH * NdotH * (a2 - 1) + 1;
+        float pdf_ggx = a2 / (PI * denom * denom) * NdotH / (4 * std::max(glm::dot(v, h), 1e-6f));
+        float pdf = specular_prob * pdf_ggx + (1 - specular_prob) * NdotI / PI;
+        if(pdf <= 0) break;
+        throughput *= brdf(n, v, i, albedo, metallic, roughness) * NdotI / pdf;
+
+        // Russian roulette from the third hit on
+        if(depth >= 2) {
+            float q = std::min(0.95f, std::max(throughput.x, std::max(throughput.y, throughput.z)));
+            if(rng.uniform() >= q) break;
+            throughput /= q;
+        }
+        ray = {origin, i, std::numeric_limits <float>::infinity()};
+    }
+    return color;
+}
+
+PathTracer::PassStats PathTracer::pass(const glm::mat4 &vp, glm::vec3 camera) {
+    auto begin = std::chrono::steady_clock::now();
+    int width = options.width, height = options.height, size = options.tile;
+    int tiles_x = (width + size - 1) / size, tiles_y = (height + size - 1) / size;
+    int tiles = tiles_x * tiles_y;
+    glm::mat4 inv = glm::inverse(vp);
+    uint32_t pass = _passes;
+
+    // contiguous runs of tiles per thread, taken from the front; thieves take from the back
+    struct Queue {
+        std::mutex lock;
+        std::deque <int> tiles;
+    };
+    std::vector <Queue> queues(_threads);
+    for(int t = 0; t < tiles; ++t) queues[(int64_t)t * _threads / tiles].tiles.push_back(t);
+    auto take = [&](int q, bool steal, int &tile) {
+        std::lock_guard <std::mutex> guard(queues[q].lock);
+        auto &d = queues[q].tiles;
+        if(d.empty()) return false;
+        if(steal) tile = d.back(), d.pop_back();
+        else tile = d.front(), d.pop_front();
+        return true;
+    };
+
+    std::atomic <uint64_t> total_rays(0);
+    std::atomic <int> steals(0);
+    auto work = [&](int self) {
+        uint64_t rays = 0;
+        int tile;
+        for(;;) {
+            bool stolen = false;
+            if(!take(self, false, tile)) {
+                bool found = false;
+                for(int k = 1; k < _threads && !found; ++k) found = take((self + k) % _threads, true, tile);
+                if(!found) break;
+                stolen = true;
+            }
+            if(stolen) steals++;
+            int x0 = tile % tiles_x * size, y0 = tile / tiles_x * size;
+            for(int y = y0; y < std::min(y0 + size, height); ++y) {
+                for(int x = x0; x < std::min(x0 + size, width); ++x) {
+                    Rng rng(x, y, pass);
+                    float sx = x + rng.uniform(), sy = y + rng.uniform();
+                    glm::vec4 far = inv * glm::vec4(sx / width * 2 - 1, sy / height * 2 - 1, 1, 1);
+                    glm::vec3 dir = glm::normalize(glm::vec3(far) / far.w - camera);
+                    film[(size_t)y * width + x] += radiance({camera, dir, std::numeric_limits <float>::infinity()}, rng, rays);
+                }
+            }
+        }
+        total_rays += rays;
+    };
+    std::vector <std::thread> workers;
+    for(int t = 1; t < _threads; ++t) workers.emplace_back(work, t);
+    work(0);
+    for(auto &w: workers) w.join();
+    _passes++;
+
+    PassStats stats;
+    stats.ms = std::chrono::duration <double, std::milli> (std::chrono::steady_clock::now() - begin).count();
+    stats.rays = total_rays;
+    stats.steals = steals;
+    return stats;
+}
+
+std::vector <glm::vec3> PathTracer::image() const {
+    std::vector <glm::vec3> out(film.size());
+    float scale = _passes ? 1.f / _passes : 0;
+    for(size_t i = 0; i < film.size(); ++i) out[i] = film[i] * scale;
+    return out;
+}
+
+bool PathTracer::write_pfm(const Path &path) const {
+    FILE *f = fopen(path.u8string().c_str(), "wb");
+    if(!f) {
+        warn(2, "PathTracer: fail to open %s", path.u8string().c_str());
+        return false;
+    }
+    // negative scale: little endian floats, rows from the bottom up
+    fprintf(f, "PF\n%d %d\n-1.0\n", options.width, options.height);
+    auto pixels = image();
+    fwrite(pixels.data(), sizeof(glm::vec3), pixels.size(), f);
+    fclose(f);
+    return true;
+}
+
+bool PathTracer::write_png(const Path &path) const {
+    auto pixels = image();
+    std::vector <unsigned char> rgb(pixels.size() * 3);
+    for(size_t i = 0; i < pixels.size(); ++i) {
+        glm::vec3 c = glm::max(pixels[i], glm::vec3(0));
+        c = glm::pow(c / (c + glm::vec3(1)), glm::vec3(1 / 2.2f));
+        for(int k = 0; k < 3; ++k) rgb[3 * i + k] = (unsigned char)std::lround(glm::clamp(c[k], 0.f, 1.f) * 255);
+    }
+    stbi_flip_vertically_on_write(1);
+    if(!stbi_write_png(path.u8string().c_str(), options.width, options.height, 3, rgb.data(), options.width * 3)) {
+        warn(2, "PathTracer: fail to write %s", path.u8string().c_str());
+        return false;
+    }
+    return true;
+}
@@ -0,0 +1,69 @@
+#pragma once
+#include "bvh.hpp"
+#include "../util/scene.hpp"
+#include <cstdint>
+#include <vector>
+
+/*
+ * Reference renderer on the CPU. Takes the triangles, materials and lights of
+ * a loaded Scene, needs no GL context, and shades with the BRDF of the GL
+ * lighting passes: Lambert plus GGX with Schlick's Fresnel and the Smith
+ * term. Direct light is sampled towards every light with a shadow ray, the
+ * indirect light by following paths, so the images converge to what SSDO
+ * approximates. Every pass adds one sample to each pixel; the tiles of a pass
+ * are dealt out to the worker threads, and a thread that runs dry steals from
+ * the others.
+ */
+class PathTracer {
+public:
+    struct Options {
+        int width = 1920, height = 1080;
+        int threads = 0;   // 0 for one per hardware thread
+        int tile = 16;     // tile size in pixels
+        int max_depth = 5; // bounces after the first hit
+    };
+    struct PassStats {
+        double ms = 0;
+        uint64_t rays = 0; // camera, shadow and bounce rays
+        int steals = 0;    // tiles rendered by another thread than the one dealt them
+    };
+
+    PathTracer(Scene &scene, const Options &options);
+    const Bvh &bvh() const { return _bvh; }
+    int threads() const { return _threads; }
+    int passes() const { return _passes; }
+
+    // one sample per pixel through the pixels of vp, rendering from camera
+    PassStats pass(const glm::mat4 &vp, glm::vec3 camera);
+    // mean radiance so far, rows from the bottom up like glReadPixels
+    std::vector <glm::vec3> image() const;
+    bool write_pfm(const Path &path) const;
+    // tonemapped and gamma corrected like the mixer of the GL pipeline
+    bool write_png(const Path &path) const;
+
+private:
+    struct Corner {
+        glm::vec3 normal;
+        glm::vec2 uv;
+    };
+    struct Triangle {
+        Corner corners[3];
+        glm::vec3 normal; // geometric, from the winding
+        Material *material;
+    };
+    struct Light {
+        glm::vec3 position, direction, intense;
+        LightType type;
+    };
+    struct Rng;
+
+    Options options;
+    int _threads, _passes = 0;
+    std::vector <glm::vec3> positions; // three corners per triangle
+    std::vector <Triangle> triangles;
+    std::vector <Light> lights;
+    Bvh _bvh;
+    std::vector <glm::vec3> film; // radiance summed over the passes
+
+    glm::vec3 radiance(Ray ray, Rng &rng, uint64_t &rays) const;
+};
@@ -0,0 +1,50 @@
+#include "beatmap.hpp"
+#include <sstream>
+
+void Beatmap::load(const Path &path) {
+    std::ifstream file(path);
+    if(!file.is_open()) throw std::string("Beatmap: fail to open ") + path.u8string();
+    notes.clear();
+    std::string line;
+    for(int number = 1; std::getline(file, line); ++number) {
+        auto comment = line.find('#');
+        if(comment != std::string::npos) line.resize(comment);
+        std::istringstream in(line);
+        Note note;
+        if(!(in >> note.time)) continue;
+        if(!(in >> note.lane)) throw std::string("Beatmap: bad note at line ") + std::to_string(number);
+        notes.push_back(note);
+    }
+    // stable, so notes at the same time keep the order of the file
+    std::stable_sort(notes.begin(), notes.end(), [](const Note &a, const Note &b) { return a.time < b.time; });
+    begin = end = 0;
+    last = 0;
+    printf("Beatmap: %d notes, %.2f s from %s\n", size(),
+           notes.empty() ? 0.f : (notes.back().time - notes.front().time) / 1e3f, path.u8string().c_str());
+}
+
+void Beatmap::seek(double now) {
+    auto before = [](const Note &note, double t) { return note.time < t; };
+    if(now < last) {
+        // replays and restarts go back, the ends are found again
+        begin = std::lower_bound(notes.begin(), notes.end(), now - lead_out, before) - notes.begin();
+        end = std::upper_bound(notes.begin() + begin, notes.end(), now + lead_in,
+                               [](double t, const Note &note) { return t < note.time; }) - notes.begin();
+    } else {
+        while(begin < (int)notes.size() && notes[begin].time < now - lead_out) ++begin;
+        end = std::max(end, begin);
+        while(end < (int)notes.size() && notes[end].time <= now + lead_in) ++end;
+    }
+    last = now;
+}
+
+void Beatmap::transforms(double now, std::vector <glm::mat4> &out) const {
+    out.resize(end - begin);
+    // translate * scale written out, no matrix products
+    for(int i = begin; i < end; ++i) {
+        auto &note = notes[i];
+        auto &m = out[i - begin];
+        m = glm::mat4(scale);
+        m[3] = glm::vec4((note.lane - center_lane) * lane_width, height, -(note.time - now) * speed, 1.f);
+    }
+}
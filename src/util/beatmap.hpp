@@ -0,0 +1,40 @@
+#pragma once
+#include "common.hpp"
+#include <string>
+#include <vector>
+
+/*
+ * Notes of a beatmap played back against a clock. A .beatmap file holds
+ * "time lane" pairs, time in ms. The notes are sorted by time once, and
+ * playback keeps the range of notes on screen, those from lead_out ms in
+ * the past to lead_in ms ahead. Moving forward only advances the two ends
+ * of the range, and moving back binary searches them. So a frame costs
+ * O(notes on screen) however long the chart is.
+ */
+class Beatmap {
+public:
+    struct Note {
+        int time; // ms
+        int lane;
+    };
+    // a note approaches along -z at speed, centered on lane center_lane
+    int lead_in = 10000, lead_out = 300; // ms
+    float lane_width = 2.f, height = -1.f, speed = 1.f / 30.f, scale = .04f;
+    int center_lane = 2;
+    std::string mesh = "wheel"; // mesh of the scene instanced per note
+
+    // throws std::string on a malformed line
+    void load(const Path &path);
+    bool empty() const { return notes.empty(); }
+    int size() const { return notes.size(); }
+    // moves the on-screen range to now, in ms
+    void seek(double now);
+    int active() const { return end - begin; }
+    // model matrices of the notes on screen at now, out is resized and reuses its capacity
+    void transforms(double now, std::vector <glm::mat4> &out) const;
+
+private:
+    std::vector <Note> notes;
+    int begin = 0, end = 0;
+    double last = 0;
+};
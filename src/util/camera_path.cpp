@@ -0,0 +1,72 @@
+#include "camera_path.hpp"
+#include <sstream>
+
+void CameraPath::add(float time, const Camera &camera, const std::vector <LightInfo> &lights) {
+    Key key{time, camera, {}};
+    for(auto &light: lights) key.intense.push_back(light.intense);
+    keys.push_back(key);
+}
+
+void CameraPath::load(const Path &path) {
+    std::ifstream file(path);
+    if(!file.is_open()) throw std::string("CameraPath: fail to open ") + path.u8string();
+    keys.clear();
+    std::string line;
+    for(int number = 1; std::getline(file, line); ++number) {
+        auto comment = line.find('#');
+        if(comment != std::string::npos) line.resize(comment);
+        std::istringstream in(line);
+        Key key;
+        if(!(in >> key.time)) continue;
+        auto &c = key.camera;
+        if(!(in >> c.pitch >> c.yaw >> c.position.x >> c.position.y >> c.position.z)) {
+            throw std::string("CameraPath: bad key at line ") + std::to_string(number);
+        }
+        glm::vec3 intense;
+        while(in >> intense.x >> intense.y >> intense.z) key.intense.push_back(intense);
+        if(!keys.empty() && key.time < keys.back().time) {
+            throw std::string("CameraPath: time goes back at line ") + std::to_string(number);
+        }
+        keys.push_back(key);
+    }
+    if(keys.empty()) throw std::string("CameraPath: no keys in ") + path.u8string();
+    printf("CameraPath: %d keys, %.2f s from %s\n", (int)keys.size(), duration(), path.u8string().c_str());
+}
+
+bool CameraPath::save(const Path &path) const {
+    FILE *f = fopen(path.u8string().c_str(), "w");
+    if(!f) {
+        warn(2, "CameraPath: fail to open %s", path.u8string().c_str());
+        return false;
+    }
+    fprintf(f, "# time pitch yaw x y z [r g b per light]\n");
+    for(auto &key: keys) {
+        auto &c = key.camera;
+        fprintf(f, "%.4f %.5f %.5f %.5f %.5f %.5f", key.time, c.pitch, c.yaw, c.position.x, c.position.y, c.position.z);
+        for(auto &i: key.intense) fprintf(f, " %g %g %g", i.x, i.y, i.z);
+        fprintf(f, "\n");
+    }
+    fclose(f);
+    printf("CameraPath: saved %d keys to %s\n", (int)keys.size(), path.u8string().c_str());
+    return true;
+}
+
+float CameraPath::duration() const {
+    return keys.empty() ? 0 : keys.back().time - keys.front().time;
+}
+
+Camera CameraPath::sample(float time, std::vector <LightInfo> &lights) const {
+    if(keys.empty()) return Camera();
+    time += keys.front().time;
+    auto next = std::upper_bound(keys.begin(), keys.end(), time,
+                                 [](float t, const Key &key) { return t < key.time; });
+    auto &b = next == keys.end() ? keys.back() : *next;
+    auto &a = next == keys.begin() ? keys.front() : *(next - 1);
+    float span = b.time - a.time;
+    float t = span > 0 ? glm::clamp((time - a.time) / span, 0.f, 1.f) : 0;
+    for(int i = 0; i < (int)std::min(lights.size(), a.intense.size()); ++i) {
+        lights[i].intense = i < (int)b.intense.size() ? glm::mix(a.intense[i], b.intense[i], t) : a.intense[i];
+    }
+    return Camera(glm::mix(a.camera.pitch, b.camera.pitch, t), glm::mix(a.camera.yaw, b.camera.yaw, t),
+                  glm::mix(a.camera.position, b.camera.position, t));
+}
@@ -0,0 +1,31 @@
+#pragma once
+#include "common.hpp"
+#include "camera.hpp"
+#include <vector>
+
+/*
+ * Timestamped camera and light intensities, recorded from a live session
+ * and replayed at a fixed timestep so frame times can be compared run to run.
+ *
+ * A .path file holds one key per line:
+ *     time pitch yaw x y z [r g b per light]
+ * lines starting with # are comments.
+ */
+class CameraPath {
+public:
+    struct Key {
+        float time;
+        Camera camera;
+        std::vector <glm::vec3> intense;
+    };
+    std::vector <Key> keys;
+
+    void add(float time, const Camera &camera, const std::vector <LightInfo> &lights);
+    // throws std::string on a malformed line
+    void load(const Path &path);
+    bool save(const Path &path) const;
+    float duration() const;
+    // camera at time, interpolated between keys; light intensities are
+    // written to the lights the key has
+    Camera sample(float time, std::vector <LightInfo> &lights) const;
+};
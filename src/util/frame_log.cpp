@@ -0,0 +1,92 @@
+#include "frame_log.hpp"
+
+FrameLog::Percentiles FrameLog::percentiles(std::vector <float> ms) {
+    Percentiles p;
+    p.count = ms.size();
+    if(ms.empty()) return p;
+    std::sort(ms.begin(), ms.end());
+    auto at = [&](float q) { return ms[std::min(ms.size() - 1, (size_t)(q * ms.size()))]; };
+    for(float x: ms) p.mean += x;
+    p.mean /= ms.size();
+    p.p50 = at(.5f), p.p95 = at(.95f), p.p99 = at(.99f);
+    p.max = ms.back();
+    return p;
+}
+
+void FrameLog::cpu(int frame, float ms) {
+    frames[frame].cpu_ms = ms;
+}
+
+void FrameLog::gpu(int frame, float ms) {
+    frames[frame].gpu_ms = ms;
+}
+
+FrameLog::Percentiles FrameLog::cpu_percentiles(int skip) const {
+    std::vector <float> ms;
+    for(auto &[frame, f]: frames) {
+        if(frame >= skip && f.cpu_ms >= 0) ms.push_back(f.cpu_ms);
+    }
+    return percentiles(ms);
+}
+
+FrameLog::Percentiles FrameLog::gpu_percentiles(int skip) const {
+    std::vector <float> ms;
+    for(auto &[frame, f]: frames) {
+        if(frame >= skip && f.gpu_ms >= 0) ms.push_back(f.gpu_ms);
+    }
+    return percentiles(ms);
+}
+
+void FrameLog::print() const {
+    printf("%-4s %6s %9s %9s %9s %9s %9s\n", "", "frames", "mean", "p50", "p95", "p99", "max");
+    for(auto [name, p]: {std::make_pair("cpu", cpu_percentiles()), std::make_pair("gpu", gpu_percentiles())}) {
+        printf("%-4s %6d %9.3f %9.3f %9.3f %9.3f %9.3f\n", name, p.count, p.mean, p.p50, p.p95, p.p99, p.max);
+    }
+}
+
+static void write_percentiles(FILE *f, const char *name, FrameLog::Percentiles p) {
+    fprintf(f, "  \"%s\": {\"frames\": %d, \"mean\": %.4f, \"p50\": %.4f, \"p95\": %.4f, \"p99\": %.4f, \"max\": %.4f},\n",
+            name, p.count, p.mean, p.p50, p.p95, p.p99, p.max);
+}
+
+bool FrameLog::write_json(const Path &path, const std::vector <std::pair <std::string, std::string>> &info,
+                          const std::vector <GpuStats::Summary> &stages) const {
+    std::error_code error;
+    if(path.has_parent_path()) fs::create_directories(path.parent_path(), error);
+    FILE *f = fopen(path.u8string().c_str(), "w");
+    if(!f) {
+        warn(2, "FrameLog: fail to open %s", path.u8string().c_str());
+        return false;
+    }
+    fprintf(f, "{\n");
+    for(auto &[key, value]: info) {
+        std::string escaped;
+        for(char c: value) {
+            if(c == '"' || c == '\\') escaped += '\\';
+            escaped += c;
+        }
+        fprintf(f, "  \"%s\": \"%s\",\n", key.c_str(), escaped.c_str());
+    }
+    write_percentiles(f, "cpu_ms", cpu_percentiles());
+    write_percentiles(f, "gpu_ms", gpu_percentiles());
+    fprintf(f, "  \"stages\": [");
+    for(size_t i = 0; i < stages.size(); ++i) {
+        fprintf(f, "%s\n    {\"name\": \"%s\", \"avg_ms\": %.4f, \"p99_ms\": %.4f}", i ? "," : "",
+                stages[i].name.c_str(), stages[i].avg_ms, stages[i].p99_ms);
+    }
+    fprintf(f, "\n  ],\n  \"frames\": [");
+    bool comma = false;
+    for(auto &[frame, x]: frames) {
+        fprintf(f, "%s\n    {\"frame\": %d, \"cpu_ms\": ", comma ? "," : "", frame);
+        if(x.cpu_ms >= 0) fprintf(f, "%.4f", x.cpu_ms);
+        else fprintf(f, "null");
+        fprintf(f, ", \"gpu_ms\": ");
+        if(x.gpu_ms >= 0) fprintf(f, "%.4f}", x.gpu_ms);
+        else fprintf(f, "null}");
+        comma = true;
+    }
+    fprintf(f, "\n  ]\n}\n");
+    fclose(f);
+    printf("FrameLog: summary written to %s\n", path.u8string().c_str());
+    return true;
+}
@@ -0,0 +1,35 @@
+#pragma once
+#include "common.hpp"
+#include "gpu_stats.hpp"
+#include <map>
+#include <string>
+#include <vector>
+
+/*
+ * CPU and GPU time of every frame of a benchmark run. The GPU time of a
+ * frame arrives a few frames after its CPU time.
+ */
+class FrameLog {
+public:
+    struct Percentiles {
+        int count = 0;
+        float mean = 0, p50 = 0, p95 = 0, p99 = 0, max = 0;
+    };
+    static Percentiles percentiles(std::vector <float> ms);
+
+    void cpu(int frame, float ms);
+    void gpu(int frame, float ms);
+    // frames before skip are left out of the percentiles
+    Percentiles cpu_percentiles(int skip = 1) const;
+    Percentiles gpu_percentiles(int skip = 1) const;
+    void print() const;
+    // info holds extra string fields, stages the per-stage GPU times
+    bool write_json(const Path &path, const std::vector <std::pair <std::string, std::string>> &info,
+                    const std::vector <GpuStats::Summary> &stages) const;
+
+private:
+    struct Frame {
+        float cpu_ms = -1, gpu_ms = -1; // -1 when not measured
+    };
+    std::map <int, Frame> frames;
+};
@@ -0,0 +1,264 @@
+#include "gpu_scene.hpp"
+#include <algorithm>
+#include <cstring>
+#include <map>
+
+bool GpuScene::supported() {
+    static int result = -1;
+    if(result < 0) {
+        GLint blocks = 0;
+        if(GLEW_VERSION_4_3) glGetIntegerv(GL_MAX_VERTEX_SHADER_STORAGE_BLOCKS, &blocks);
+        result = blocks >= 2;
+        if(!result) printf("GpuScene: needs GL 4.3 with storage buffers in vertex shaders, not available\n");
+    }
+    return result;
+}
+
+GpuScene::GpuScene(const std::vector <std::pair <std::string, std::unique_ptr <Mesh>>> &meshes) {
+    std::vector <Vertex> vertices;
+    std::vector <uint32_t> indices;
+    std::map <const Material *, uint32_t> material_ids;
+    std::vector <const Texture2D *> albedo, normal;
+    // 0 is for objects without a material, with the defaults of SSDO::set_material
+    material_list.push_back({nullptr, -1, -1});
+    auto material_id = [&](const Material *m) -> uint32_t {
+        if(!m) return 0;
+        auto [it, added] = material_ids.emplace(m, material_list.size());
+        if(added) {
+            MaterialSource source{m, -1, -1};
+            if(m->texture) source.albedo = albedo.size(), albedo.push_back(m->texture.get());
+            if(m->texture_normal) source.normal = normal.size(), normal.push_back(m->texture_normal.get());
+            material_list.push_back(source);
+        }
+        return it->second;
+    };
+    for(int i = 0; i < (int)meshes.size(); ++i) {
+        auto &mesh = *meshes[i].second;
+        uint32_t base_vertex = vertices.size();
+        vertices.insert(vertices.end(), mesh.vertices.begin(), mesh.vertices.end());
+        int first_object = objects.size();
+        for(auto &object: mesh.objects) {
+            if(object.triangles.empty()) continue;
+            glm::vec3 lo(1e30f), hi(-1e30f);
+            for(auto t: object.triangles) {
+                lo = glm::min(lo, mesh.vertices[t].position);
+                hi = glm::max(hi, mesh.vertices[t].position);
+            }
+            objects.push_back({(uint32_t)indices.size(), (uint32_t)object.triangles.size(), base_vertex,
+                               material_id(object.material()), glm::vec4((lo + hi) * .5f, glm::length(hi - lo) * .5f)});
+            indices.insert(indices.end(), object.triangles.begin(), object.triangles.end());
+        }
+        mesh_objects.emplace_back(first_object, (int)objects.size());
+    }
+
+    glGenVertexArrays(1, &vao);
+    glBindVertexArray(vao);
+    glGenBuffers(1, &vertex_buffer);
+    glBindBuffer(GL_ARRAY_BUFFER, vertex_buffer);
+    glBufferData(GL_ARRAY_BUFFER, sizeof(Vertex) * vertices.size(), vertices.data(), GL_STATIC_DRAW);
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void *)offsetof(Vertex, position));
+    glEnableVertexAttribArray(0);
+    glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void *)offsetof(Vertex, uv));
+    glEnableVertexAttribArray(1);
+    glVertexAttribPointer(2, 3, GL_FLOAT, GL_TRUE, sizeof(Vertex), (void *)offsetof(Vertex, normal));
+    glEnableVertexAttribArray(2);
+    glGenBuffers(1, &index_buffer);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, index_buffer);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, sizeof(uint32_t) * indices.size(), indices.data(), GL_STATIC_DRAW);
+    // draw i is instance 0 of command i, whose baseInstance is i; filled by update
+    glGenBuffers(1, &draw_id_buffer);
+    glBindBuffer(GL_ARRAY_BUFFER, draw_id_buffer);
+    glVertexAttribIPointer(3, 1, GL_UNSIGNED_INT, sizeof(uint32_t), nullptr);
+    glVertexAttribDivisor(3, 1);
+    glEnableVertexAttribArray(3);
+    glBindVertexArray(0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+
+    glGenBuffers(1, &draw_buffer);
+    glGenBuffers(1, &transform_buffer);
+    glGenBuffers(1, &material_buffer);
+    glGenBuffers(1, &command_buffer);
+    albedo_maps = build_array(albedo, "albedo");
+    normal_maps = build_array(normal, "normal");
+    shader = std::make_unique <IndirectGeometry> ();
+    culler = std::make_unique <DrawCuller> ();
+    printf("GpuScene: %d objects, %d vertices, %d indices, %d materials\n",
+           (int)objects.size(), (int)vertices.size(), (int)indices.size(), (int)material_list.size());
+    CheckGLError();
+}
+
+GpuScene::~GpuScene() {
+    GLuint buffers[] = {vertex_buffer, index_buffer, draw_id_buffer, draw_buffer, transform_buffer, material_buffer, command_buffer};
+    glDeleteBuffers(7, buffers);
+    GLuint textures[] = {albedo_maps, normal_maps};
+    glDeleteTextures(2, textures);
+    glDeleteVertexArrays(1, &vao);
+}
+
+GLuint GpuScene::build_array(const std::vector <const Texture2D *> &maps, const char *name) {
+    int width = 1, height = 1;
+    for(auto map: maps) width = std::max(width, map->width()), height = std::max(height, map->height());
+    width = std::min(width, max_layer_size), height = std::min(height, max_layer_size);
+    int levels = 1;
+    while(std::max(width, height) >> levels) ++levels;
+    GLuint tex;
+    glGenTextures(1, &tex);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, tex);
+    // an array without maps still needs a layer to be complete
+    glTexStorage3D(GL_TEXTURE_2D_ARRAY, levels, GL_RGBA8, width, height, std::max(1, (int)maps.size()));
+    std::vector <uint8_t> layer((size_t)width * height * 4);
+    for(int i = 0; i < (int)maps.size(); ++i) {
+        auto map = maps[i];
+        if(map->width() == width && map->height() == height) {
+            // missing channels read like the GL texture of the map: 0, and 1 for alpha
+            auto &pixels = map->pixels();
+            int channels = map->channels();
+            for(size_t p = 0; p < (size_t)width * height; ++p) {
+                for(int c = 0; c < 4; ++c) {
+                    layer[p * 4 + c] = c < channels ? pixels[p * channels + c] : (c == 3 ? 255 : 0);
+                }
+            }
+        } else {
+            // one bilinear tap per texel, the mipmaps below are built from this level
+            for(int y = 0; y < height; ++y) {
+                for(int x = 0; x < width; ++x) {
+                    glm::vec4 c = map->sample(glm::vec2((x + .5f) / width, (y + .5f) / height));
+                    for(int k = 0; k < 4; ++k) layer[((size_t)y * width + x) * 4 + k] = (uint8_t)(c[k] * 255 + .5f);
+                }
+            }
+        }
+        glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, 0, i, width, height, 1, GL_RGBA, GL_UNSIGNED_BYTE, layer.data());
+    }
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_MIRRORED_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_MIRRORED_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glGenerateMipmap(GL_TEXTURE_2D_ARRAY);
+    printf("GpuScene: %d %s maps in %dx%d layers\n", (int)maps.size(), name, width, height);
+    CheckGLError();
+    return tex;
+}
+
+static RingBuffer::Allocation allocate(RingBuffer *ring, GLsizeiptr size) {
+    static GLint alignment = 0;
+    if(!alignment) glGetIntegerv(GL_SHADER_STORAGE_BUFFER_OFFSET_ALIGNMENT, &alignment);
+    return ring ? ring->allocate(size, std::max(alignment, 16)) : RingBuffer::Allocation();
+}
+
+// streams size bytes of data through ring, or re-specifies fallback when it is full
+GpuScene::Range GpuScene::upload(RingBuffer *ring, const void *data, GLsizeiptr size, GLuint fallback) {
+    if(auto a = allocate(ring, size)) {
+        memcpy(a.data, data, size);
+        return {ring->buffer(), a.offset, size};
+    }
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, fallback);
+    glBufferData(GL_SHADER_STORAGE_BUFFER, size, data, GL_STREAM_DRAW);
+    return {fallback, 0, size};
+}
+
+void GpuScene::update(const std::vector <const std::vector <glm::mat4> *> &instances, RingBuffer *ring) {
+    std::vector <int> counts, base;
+    int total = 0;
+    for(auto models: instances) {
+        base.push_back(total);
+        counts.push_back(models->size());
+        total += models->size();
+    }
+    GLsizeiptr bytes = sizeof(glm::mat4) * total;
+    if(auto a = allocate(ring, bytes)) {
+        // straight into the mapping, the GPU reads it without a copy
+        auto out = (glm::mat4 *)a.data;
+        for(auto models: instances) out = std::copy(models->begin(), models->end(), out);
+        transform_range = {ring->buffer(), a.offset, bytes};
+    } else {
+        transforms.clear();
+        for(auto models: instances) transforms.insert(transforms.end(), models->begin(), models->end());
+        transform_range = upload(nullptr, transforms.data(), bytes, transform_buffer);
+    }
+
+    // the UI edits materials, a few dozen compares are cheaper than a stale G-buffer
+    std::vector <GpuMaterial> packed;
+    for(auto &source: material_list) {
+        GpuMaterial g{glm::vec4(0, 0, 0, .5f), glm::vec4(.5f, .1f, 0, 0), glm::vec4(1), glm::ivec4(-1, -1, 0, 0)};
+        if(auto m = source.material) {
+            g.albedo = glm::vec4(m->Kd, m->metallic);
+            g.params = glm::vec4(m->roughness, m->ao, 0, 0);
+            g.scale = glm::vec4(m->texture_scale.x, m->texture_scale.y, m->texture_normal_scale.x, m->texture_normal_scale.y);
+            g.maps = glm::ivec4(source.albedo, source.normal, m->id, 0);
+        }
+        packed.push_back(g);
+    }
+    if(packed.size() != materials.size() || memcmp(packed.data(), materials.data(), sizeof(GpuMaterial) * packed.size())) {
+        materials = packed;
+        glBindBuffer(GL_SHADER_STORAGE_BUFFER, material_buffer);
+        glBufferData(GL_SHADER_STORAGE_BUFFER, sizeof(GpuMaterial) * materials.size(), materials.data(), GL_DYNAMIC_DRAW);
+    }
+
+    if(counts != layout) {
+        // in the order of Mesh::draw, so depth ties resolve the same way
+        layout = counts;
+        draw_list.clear();
+        commands.clear();
+        for(int i = 0; i < (int)mesh_objects.size(); ++i) {
+            for(int k = 0; k < counts[i]; ++k) {
+                for(int o = mesh_objects[i].first; o < mesh_objects[i].second; ++o) {
+                    auto &object = objects[o];
+                    uint32_t id = draw_list.size();
+                    draw_list.push_back({uint32_t(base[i] + k), object.material, {0, 0}, object.sphere});
+                    commands.insert(commands.end(), {object.count, 1, object.first, object.base_vertex, id});
+                }
+            }
+        }
+        if(draws() > draw_ids) {
+            // the draw id attribute reads id i for baseInstance i, so it only ever grows
+            draw_ids = std::max(draws(), draw_ids * 2);
+            std::vector <uint32_t> ids(draw_ids);
+            for(int i = 0; i < draw_ids; ++i) ids[i] = i;
+            glBindBuffer(GL_ARRAY_BUFFER, draw_id_buffer);
+            glBufferData(GL_ARRAY_BUFFER, sizeof(uint32_t) * ids.size(), ids.data(), GL_STATIC_DRAW);
+            glBindBuffer(GL_ARRAY_BUFFER, 0);
+        }
+        if(!reported) printf("GpuScene: %d draws in one multi-draw\n", draws());
+        reported = true;
+        // while the layout keeps changing, as with notes coming and going, the
+        // draws are streamed; once it settles they move to their own buffers
+        draw_range = upload(ring, draw_list.data(), sizeof(Draw) * draw_list.size(), draw_buffer);
+        command_range = upload(ring, commands.data(), sizeof(uint32_t) * commands.size(), command_buffer);
+        settled = draw_range.buffer == draw_buffer && command_range.buffer == command_buffer;
+    } else if(!settled) {
+        draw_range = upload(nullptr, draw_list.data(), sizeof(Draw) * draw_list.size(), draw_buffer);
+        command_range = upload(nullptr, commands.data(), sizeof(uint32_t) * commands.size(), command_buffer);
+        settled = true;
+    }
+    glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+    CheckGLError();
+}
+
+void GpuScene::draw(glm::mat4 vp, bool cull) {
+    if(draw_list.empty()) return;
+    glBindBufferRange(GL_SHADER_STORAGE_BUFFER, 0, draw_range.buffer, draw_range.offset, draw_range.size);
+    glBindBufferRange(GL_SHADER_STORAGE_BUFFER, 1, transform_range.buffer, transform_range.offset, transform_range.size);
+    glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 2, material_buffer);
+    glBindBufferRange(GL_SHADER_STORAGE_BUFFER, 3, command_range.buffer, command_range.offset, command_range.size);
+
+    // frustum planes from the rows of vp
+    glm::vec4 planes[6];
+    glm::mat4 t = glm::transpose(vp);
+    for(int i = 0; i < 3; ++i) {
+        planes[2 * i] = t[3] + t[i];
+        planes[2 * i + 1] = t[3] - t[i];
+    }
+    for(auto &plane: planes) plane /= glm::length(glm::vec3(plane));
+    culler->use();
+    culler->dispatch(planes, draws(), cull);
+
+    shader->use();
+    shader->set(vp, albedo_maps, normal_maps);
+    glBindVertexArray(vao);
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, command_range.buffer);
+    glMultiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT, (void *)command_range.offset, draws(), 0);
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+    glBindVertexArray(0);
+    CheckGLError();
+}
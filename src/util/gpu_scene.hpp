@@ -0,0 +1,82 @@
+#pragma once
+#include "mesh.hpp"
+#include "shader.hpp"
+#include "ring_buffer.hpp"
+#include <memory>
+#include <string>
+#include <vector>
+
+/*
+ * GPU-driven G-buffer pass. The meshes are merged into one vertex and one
+ * index buffer, the materials go to a storage buffer and their maps to two
+ * texture arrays, and every object of every instance is a command in an
+ * indirect buffer. A compute pass sets the instance count of each command,
+ * culling the ones outside the frustum, and one glMultiDrawElementsIndirect
+ * draws them all: the CPU cost of the pass stays the same however many
+ * objects there are. Needs GL 4.3 and storage buffers in vertex shaders.
+ */
+class GpuScene {
+public:
+    static bool supported();
+    // meshes must have been through init_draw, their textures are read back from the CPU copies
+    GpuScene(const std::vector <std::pair <std::string, std::unique_ptr <Mesh>>> &meshes);
+    ~GpuScene();
+    // model matrices of each mesh, in the order of the meshes; the commands are
+    // rebuilt when an instance count changes, otherwise only the matrices are
+    // uploaded, through ring when it has room
+    void update(const std::vector <const std::vector <glm::mat4> *> &instances, RingBuffer *ring = nullptr);
+    void draw(glm::mat4 vp, bool cull);
+    int draws() const { return (int)draw_list.size(); }
+
+    // the layouts of the storage buffers, std430
+    struct Draw {
+        uint32_t transform, material, pad[2];
+        glm::vec4 sphere; // object-space bounds
+    };
+    struct GpuMaterial {
+        glm::vec4 albedo; // rgb, metallic
+        glm::vec4 params; // roughness, ao
+        glm::vec4 scale;  // uv scale of the albedo and the normal map
+        glm::ivec4 maps;  // albedo and normal map layers, -1 without; material id
+    };
+
+private:
+    struct Object {
+        uint32_t first, count, base_vertex, material;
+        glm::vec4 sphere;
+    };
+    struct MaterialSource {
+        const Material *material; // null for objects without one
+        int albedo, normal;       // layers in the arrays, -1 without
+    };
+    std::vector <Object> objects;
+    std::vector <std::pair <int, int>> mesh_objects; // range in objects of each mesh
+    std::vector <MaterialSource> material_list;
+    std::vector <GpuMaterial> materials; // as last uploaded
+    std::vector <Draw> draw_list;
+    std::vector <int> layout; // instance count per mesh the commands were built for
+    std::vector <glm::mat4> transforms; // staging for glBufferData without a ring
+    std::vector <uint32_t> commands; // DrawElementsIndirectCommand per draw
+    int draw_ids = 0;                // ids in draw_id_buffer
+    bool settled = false;            // the draws are in draw_buffer and command_buffer
+    bool reported = false;
+
+    // what the passes bind: a range of the ring this frame, or the whole own buffer
+    struct Range {
+        GLuint buffer;
+        GLintptr offset;
+        GLsizeiptr size;
+    };
+    Range transform_range, draw_range, command_range;
+    static Range upload(RingBuffer *ring, const void *data, GLsizeiptr size, GLuint fallback);
+
+    GLuint vao, vertex_buffer, index_buffer, draw_id_buffer;
+    GLuint draw_buffer, transform_buffer, material_buffer, command_buffer;
+    GLuint albedo_maps, normal_maps; // 2D arrays
+    std::unique_ptr <IndirectGeometry> shader;
+    std::unique_ptr <DrawCuller> culler;
+
+    // one layer per map, all resized to the largest map up to max_layer_size
+    static GLuint build_array(const std::vector <const Texture2D *> &maps, const char *name);
+    static constexpr int max_layer_size = 1024;
+};
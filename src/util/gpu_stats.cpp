@@ -0,0 +1,146 @@
+#include "gpu_stats.hpp"
+#include <algorithm>
+
+static const GLenum counter_targets[GpuStats::counters] = {
+    GL_VERTICES_SUBMITTED_ARB, GL_PRIMITIVES_SUBMITTED_ARB,
+    GL_FRAGMENT_SHADER_INVOCATIONS_ARB, GL_COMPUTE_SHADER_INVOCATIONS_ARB,
+};
+const char *GpuStats::counter_names[counters] = {"vertices", "primitives", "fragments", "compute"};
+
+GpuStats::~GpuStats() {
+    if(csv) fclose(csv);
+}
+
+bool GpuStats::enable_pipeline_statistics(bool on) {
+    with_counters = on && GLEW_ARB_pipeline_statistics_query;
+    return with_counters;
+}
+
+bool GpuStats::open_csv(const char *path) {
+    if(csv) fclose(csv);
+    csv = fopen(path, "w");
+    if(!csv) {
+        warn(2, "GpuStats: fail to open %s", path);
+        return false;
+    }
+    fprintf(csv, "frame,stage,gpu_ms");
+    for(auto name: counter_names) fprintf(csv, ",%s", name);
+    fprintf(csv, "\n");
+    return true;
+}
+
+void GpuStats::read(const std::string &name, Stage &stage, int slot, bool wait) {
+    if(!wait) {
+        GLint available = 0;
+        glGetQueryObjectiv(stage.time[slot], GL_QUERY_RESULT_AVAILABLE, &available);
+        for(int c = 0; c < counters && available && stage.counted[slot]; ++c) {
+            glGetQueryObjectiv(stage.stats[slot][c], GL_QUERY_RESULT_AVAILABLE, &available);
+        }
+        if(!available) return;
+    }
+    GLuint64 ns;
+    glGetQueryObjectui64v(stage.time[slot], GL_QUERY_RESULT, &ns);
+    for(int c = 0; c < counters; ++c) {
+        stage.last[c] = 0;
+        if(stage.counted[slot]) glGetQueryObjectui64v(stage.stats[slot][c], GL_QUERY_RESULT, &stage.last[c]);
+    }
+    int issued = stage.frame[slot];
+    stage.frame[slot] = -1;
+    stage.last_ms = ns / 1e6f;
+    if((int)stage.ms.size() < window) stage.ms.push_back(stage.last_ms);
+    else stage.ms[stage.next] = stage.last_ms;
+    stage.next = (stage.next + 1) % window;
+
+    auto &tally = tallies[issued];
+    tally.read++;
+    tally.ms += stage.last_ms;
+    if(csv) {
+        fprintf(csv, "%d,%s,%.4f", issued, name.c_str(), stage.last_ms);
+        for(int c = 0; c < counters; ++c) {
+            if(stage.counted[slot]) fprintf(csv, ",%llu", (unsigned long long)stage.last[c]);
+            else fprintf(csv, ",");
+        }
+        fprintf(csv, "\n");
+    }
+}
+
+void GpuStats::begin_frame(int _frame) {
+    frame = _frame;
+    position = 0;
+    for(auto &[name, stage]: stages) {
+        for(int slot = 0; slot < 2; ++slot) {
+            if(stage.frame[slot] >= 0) read(name, stage, slot);
+        }
+    }
+    for(auto it = tallies.begin(); it != tallies.end();) {
+        auto &[f, tally] = *it;
+        if(tally.read == tally.issued && f < frame) {
+            frame_ms = tally.ms;
+            measured_frame = f;
+            finished.emplace_back(f, tally.ms);
+        }
+        // complete, or lost to a query that was reused before it finished
+        if(tally.read == tally.issued || f < frame - 4) it = tallies.erase(it);
+        else ++it;
+    }
+}
+
+void GpuStats::begin(const std::string &name) {
+    // frame 0 also pays for the first use of every shader and target
+    if(frame == 0) return;
+    auto &stage = stages[name];
+    if(!stage.time[0]) {
+        glGenQueries(2, stage.time);
+        glGenQueries(2 * counters, stage.stats[0]);
+    }
+    int slot = frame & 1;
+    if(lossless && stage.frame[slot] >= 0) read(name, stage, slot, true);
+    stage.frame[slot] = frame;
+    stage.counted[slot] = with_counters;
+    stage.position = position++;
+    stage.ran = frame;
+    tallies[frame].issued++;
+    if(with_counters) {
+        for(int c = 0; c < counters; ++c) glBeginQuery(counter_targets[c], stage.stats[slot][c]);
+    }
+    glBeginQuery(GL_TIME_ELAPSED, stage.time[slot]);
+    active = &stage;
+}
+
+void GpuStats::end() {
+    if(!active) return;
+    glEndQuery(GL_TIME_ELAPSED);
+    if(active->counted[frame & 1]) {
+        for(int c = 0; c < counters; ++c) glEndQuery(counter_targets[c]);
+    }
+    active = nullptr;
+}
+
+std::vector <std::pair <int, float>> GpuStats::take_finished() {
+    auto result = std::move(finished);
+    finished.clear();
+    return result;
+}
+
+std::vector <GpuStats::Summary> GpuStats::summary() const {
+    std::vector <std::pair <std::pair <int, int>, Summary>> list;
+    for(auto &[name, stage]: stages) {
+        if(stage.ms.empty()) continue;
+        Summary s;
+        s.name = name;
+        s.last_ms = stage.last_ms;
+        float sum = 0;
+        for(float ms: stage.ms) sum += ms;
+        s.avg_ms = sum / stage.ms.size();
+        auto sorted = stage.ms;
+        size_t k = std::min(sorted.size() - 1, sorted.size() * 99 / 100);
+        std::nth_element(sorted.begin(), sorted.begin() + k, sorted.end());
+        s.p99_ms = sorted[k];
+        std::copy(stage.last, stage.last + counters, s.last);
+        list.push_back({{-stage.ran, stage.position}, s});
+    }
+    std::sort(list.begin(), list.end(), [](auto &a, auto &b) { return a.first < b.first; });
+    std::vector <Summary> result;
+    for(auto &[key, s]: list) result.push_back(s);
+    return result;
+}
@@ -0,0 +1,76 @@
+#pragma once
+#include "common.hpp"
+#include <map>
+#include <string>
+#include <vector>
+
+/*
+ * GPU time, and optionally pipeline statistics, of the named stages of a frame.
+ *
+ * Every stage owns two sets of queries used on alternating frames. They
+ * are read only once the driver reports them available, so a stage run in
+ * frame f is usually reported two frames later and the CPU never waits.
+ * A stage whose queries are still busy when their turn comes again loses
+ * that sample.
+ */
+class GpuStats {
+public:
+    static const int window = 240; // samples behind the rolling statistics
+    enum Counter { Vertices, Primitives, Fragments, Compute, counters };
+    static const char *counter_names[counters];
+    struct Summary {
+        std::string name;
+        float last_ms, avg_ms, p99_ms;
+        GLuint64 last[counters]; // pipeline statistics of the newest sample
+    };
+
+    ~GpuStats();
+    // also counts vertices, primitives and shader invocations, needs
+    // ARB_pipeline_statistics_query; returns whether they are counted
+    bool enable_pipeline_statistics(bool on);
+    bool pipeline_statistics() const { return with_counters; }
+    // reads every finished query, call before the first stage of a frame
+    void begin_frame(int frame);
+    // stages don't nest
+    void begin(const std::string &stage);
+    void end();
+    // stages in the order they ran, the newest first when they ran in different frames
+    std::vector <Summary> summary() const;
+    // appends a line per sample read from now on
+    bool open_csv(const char *path);
+    // frames fully read back since the last call, with their GPU time
+    std::vector <std::pair <int, float>> take_finished();
+
+    // wait for a query still busy when its turn comes again instead of losing
+    // the sample, for benchmarks that need every frame
+    bool lossless = false;
+
+    float frame_ms = 0;      // sum over every stage of measured_frame
+    int measured_frame = -1; // newest frame with all stages read back
+
+private:
+    struct Stage {
+        GLuint time[2] = {0, 0};
+        GLuint stats[2][counters] = {};
+        int frame[2] = {-1, -1}; // frame a slot was issued in, -1 once read
+        bool counted[2] = {false, false};
+        int position = 0;        // order within the frame it last ran in
+        int ran = -1;            // that frame
+        std::vector <float> ms;  // ring of the newest samples
+        int next = 0;
+        float last_ms = 0;
+        GLuint64 last[counters] = {};
+    };
+    struct Tally {
+        int issued = 0, read = 0;
+        float ms = 0;
+    };
+    void read(const std::string &name, Stage &stage, int slot, bool wait = false);
+    std::map <std::string, Stage> stages;
+    std::map <int, Tally> tallies;
+    std::vector <std::pair <int, float>> finished;
+    Stage *active = nullptr;
+    bool with_counters = false;
+    int frame = 0, position = 0;
+    FILE *csv = nullptr;
+};
@@ -0,0 +1,194 @@
+#include "image_metrics.hpp"
+#include <cmath>
+
+namespace ImageMetrics {
+
+using Plane = std::vector <float>;
+
+static float srgb_to_linear(float c) {
+    return c <= 0.04045f ? c / 12.92f : std::pow((c + 0.055f) / 1.055f, 2.4f);
+}
+
+// normalized 1D Gaussian of radius 3 sigma
+static std::vector <float> gaussian(float sigma) {
+    int radius = std::max(1, (int)std::ceil(3 * sigma));
+    std::vector <float> k(2 * radius + 1);
+    float sum = 0;
+    for(int i = -radius; i <= radius; ++i) sum += k[i + radius] = std::exp(-i * i / (2 * sigma * sigma));
+    for(auto &x: k) x /= sum;
+    return k;
+}
+
+// separable convolution, clamped at the borders; kernels have odd length
+static Plane convolve(const Plane &p, int width, int height, const std::vector <float> &kx, const std::vector <float> &ky) {
+    Plane tmp(p.size()), out(p.size());
+    int rx = kx.size() / 2, ry = ky.size() / 2;
+    for(int y = 0; y < height; ++y) {
+        for(int x = 0; x < width; ++x) {
+            float sum = 0;
+            for(int i = -rx; i <= rx; ++i) sum += kx[i + rx] * p[y * width + std::clamp(x + i, 0, width - 1)];
+            tmp[y * width + x] = sum;
+        }
+    }
+    for(int y = 0; y < height; ++y) {
+        for(int x = 0; x < width; ++x) {
+            float sum = 0;
+            for(int i = -ry; i <= ry; ++i) sum += ky[i + ry] * tmp[std::clamp(y + i, 0, height - 1) * width + x];
+            out[y * width + x] = sum;
+        }
+    }
+    return out;
+}
+
+float rmse(const std::vector <unsigned char> &a, const std::vector <unsigned char> &b, int width, int height) {
+    double sum = 0;
+    size_t n = (size_t)width * height * 3;
+    for(size_t i = 0; i < n; ++i) {
+        double d = (a[i] - b[i]) / 255.;
+        sum += d * d;
+    }
+    return std::sqrt(sum / n);
+}
+
+float ssim(const std::vector <unsigned char> &a, const std::vector <unsigned char> &b, int width, int height) {
+    size_t n = (size_t)width * height;
+    Plane x(n), y(n), xx(n), yy(n), xy(n);
+    for(size_t i = 0; i < n; ++i) {
+        x[i] = (0.299f * a[3 * i] + 0.587f * a[3 * i + 1] + 0.114f * a[3 * i + 2]) / 255;
+        y[i] = (0.299f * b[3 * i] + 0.587f * b[3 * i + 1] + 0.114f * b[3 * i + 2]) / 255;
+        xx[i] = x[i] * x[i], yy[i] = y[i] * y[i], xy[i] = x[i] * y[i];
+    }
+    auto g = gaussian(1.5f);
+    auto mx = convolve(x, width, height, g, g), my = convolve(y, width, height, g, g);
+    auto sxx = convolve(xx, width, height, g, g), syy = convolve(yy, width, height, g, g);
+    auto sxy = convolve(xy, width, height, g, g);
+    const double c1 = 0.01 * 0.01, c2 = 0.03 * 0.03;
+    double sum = 0;
+    for(size_t i = 0; i < n; ++i) {
+        double vx = sxx[i] - mx[i] * mx[i], vy = syy[i] - my[i] * my[i], cov = sxy[i] - mx[i] * my[i];
+        sum += (2 * mx[i] * my[i] + c1) * (2 * cov + c2) / ((mx[i] * mx[i] + my[i] * my[i] + c1) * (vx + vy + c2));
+    }
+    return sum / n;
+}
+
+/*
+ * FLIP works in YyCxCz, a linearized CIELAB: Yy = 116 Y / Yn - 16,
+ * Cx = 500 (X / Xn - Y / Yn), Cz = 200 (Y / Yn - Z / Zn), white D65.
+ */
+static const glm::vec3 white(0.950428545f, 1.f, 1.088900371f);
+
+static glm::vec3 linear_rgb_to_xyz(glm::vec3 c) {
+    return glm::vec3(0.4124564f * c.r + 0.3575761f * c.g + 0.1804375f * c.b,
+                     0.2126729f * c.r + 0.7151522f * c.g + 0.0721750f * c.b,
+                     0.0193339f * c.r + 0.1191920f * c.g + 0.9503041f * c.b);
+}
+
+static glm::vec3 xyz_to_linear_rgb(glm::vec3 c) {
+    return glm::vec3( 3.2404542f * c.x - 1.5371385f * c.y - 0.4985314f * c.z,
+                     -0.9692660f * c.x + 1.8760108f * c.y + 0.0415560f * c.z,
+                      0.0556434f * c.x - 0.2040259f * c.y + 1.0572252f * c.z);
+}
+
+static glm::vec3 xyz_to_ycxcz(glm::vec3 c) {
+    c /= white;
+    return glm::vec3(116 * c.y - 16, 500 * (c.x - c.y), 200 * (c.y - c.z));
+}
+
+static glm::vec3 ycxcz_to_xyz(glm::vec3 c) {
+    float y = (c.x + 16) / 116;
+    return glm::vec3(y + c.y / 500, y, y - c.z / 200) * white;
+}
+
+// CIELAB with a and b scaled by 0.01 L after Hunt
+static glm::vec3 hunt_lab(glm::vec3 xyz) {
+    auto f = [](float t) { return t > 0.008856f ? std::cbrt(t) : 7.787f * t + 16.f / 116; };
+    glm::vec3 c = xyz / white;
+    float l = 116 * f(c.y) - 16;
+    return glm::vec3(l, 0.01f * l * 500 * (f(c.x) - f(c.y)), 0.01f * l * 200 * (f(c.y) - f(c.z)));
+}
+
+static float hyab(glm::vec3 a, glm::vec3 b) {
+    return std::abs(a.x - b.x) + glm::length(glm::vec2(a.y - b.y, a.z - b.z));
+}
+
+// first and second derivative of a Gaussian, positive and negative weights each summing to +-1
+static void feature_kernels(float sigma, std::vector <float> &edge, std::vector <float> &point) {
+    int radius = (int)std::ceil(3 * sigma);
+    edge.resize(2 * radius + 1), point.resize(2 * radius + 1);
+    float edge_pos = 0, point_pos = 0, point_neg = 0;
+    for(int i = -radius; i <= radius; ++i) {
+        float g = std::exp(-i * i / (2 * sigma * sigma));
+        edge[i + radius] = -i * g;
+        point[i + radius] = (i * i / (sigma * sigma) - 1) * g;
+        if(i > 0) edge_pos -= edge[i + radius];
+        if(point[i + radius] > 0) point_pos += point[i + radius];
+        else point_neg -= point[i + radius];
+    }
+    for(auto &x: edge) x /= edge_pos;
+    for(auto &x: point) x /= x > 0 ? point_pos : point_neg;
+}
+
+float flip(const std::vector <unsigned char> &a, const std::vector <unsigned char> &b, int width, int height, float ppd) {
+    size_t n = (size_t)width * height;
+    const float qc = 0.7f, qf = 0.5f, pc = 0.4f, pt = 0.95f;
+
+    // contrast sensitivity: one Gaussian for Yy and Cx, two for Cz, sigma^2 = b / (2 pi^2) degrees^2
+    auto sigma = [&](float b) { return std::sqrt(b / (2 * PI * PI)) * ppd; };
+    auto g_a = gaussian(sigma(0.0047f)), g_rg = gaussian(sigma(0.0053f));
+    auto g_by1 = gaussian(sigma(0.04f)), g_by2 = gaussian(sigma(0.025f));
+    const float w_by1 = 34.1f / (34.1f + 13.5f);
+
+    std::vector <glm::vec3> lab[2];
+    Plane lum[2];
+    for(int k = 0; k < 2; ++k) {
+        auto &src = k ? b : a;
+        Plane yy(n), cx(n), cz(n);
+        lum[k].resize(n);
+        for(size_t i = 0; i < n; ++i) {
+            glm::vec3 rgb(srgb_to_linear(src[3 * i] / 255.f), srgb_to_linear(src[3 * i + 1] / 255.f),
+                          srgb_to_linear(src[3 * i + 2] / 255.f));
+            auto c = xyz_to_ycxcz(linear_rgb_to_xyz(rgb));
+            yy[i] = c.x, cx[i] = c.y, cz[i] = c.z;
+            lum[k][i] = (c.x + 16) / 116;
+        }
+        yy = convolve(yy, width, height, g_a, g_a);
+        cx = convolve(cx, width, height, g_rg, g_rg);
+        auto cz1 = convolve(cz, width, height, g_by1, g_by1), cz2 = convolve(cz, width, height, g_by2, g_by2);
+        lab[k].resize(n);
+        for(size_t i = 0; i < n; ++i) {
+            glm::vec3 c(yy[i], cx[i], w_by1 * cz1[i] + (1 - w_by1) * cz2[i]);
+            auto rgb = glm::clamp(xyz_to_linear_rgb(ycxcz_to_xyz(c)), 0.f, 1.f);
+            lab[k][i] = hunt_lab(linear_rgb_to_xyz(rgb));
+        }
+    }
+    float cmax = std::pow(hyab(hunt_lab(linear_rgb_to_xyz(glm::vec3(0, 1, 0))),
+                               hunt_lab(linear_rgb_to_xyz(glm::vec3(0, 0, 1)))), qc);
+
+    // edges and points of the luminance, over 0.082 degrees
+    std::vector <float> edge, point, smooth = gaussian(0.5f * 0.082f * ppd);
+    feature_kernels(0.5f * 0.082f * ppd, edge, point);
+    Plane features[2];
+    for(int k = 0; k < 2; ++k) {
+        auto ex = convolve(lum[k], width, height, edge, smooth), ey = convolve(lum[k], width, height, smooth, edge);
+        auto px = convolve(lum[k], width, height, point, smooth), py = convolve(lum[k], width, height, smooth, point);
+        features[k].resize(2 * n);
+        for(size_t i = 0; i < n; ++i) {
+            features[k][2 * i] = std::hypot(ex[i], ey[i]);
+            features[k][2 * i + 1] = std::hypot(px[i], py[i]);
+        }
+    }
+
+    double sum = 0;
+    for(size_t i = 0; i < n; ++i) {
+        float color = std::pow(hyab(lab[0][i], lab[1][i]), qc);
+        color = color < pc * cmax ? pt / (pc * cmax) * color
+                                  : pt + (color - pc * cmax) / (cmax - pc * cmax) * (1 - pt);
+        float feature = std::max(std::abs(features[0][2 * i] - features[1][2 * i]),
+                                 std::abs(features[0][2 * i + 1] - features[1][2 * i + 1]));
+        feature = std::pow(feature / std::sqrt(2.f), qf);
+        sum += std::pow(std::min(color, 1.f), 1 - feature);
+    }
+    return sum / n;
+}
+
+}
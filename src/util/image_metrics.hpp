@@ -0,0 +1,24 @@
+#pragma once
+#include "common.hpp"
+#include <vector>
+
+/*
+ * Error of a rendered frame against a reference, both 8-bit sRGB with
+ * 3 channels per pixel and the same size.
+ */
+namespace ImageMetrics {
+
+// root mean square error over all channels, in [0, 1]
+float rmse(const std::vector <unsigned char> &a, const std::vector <unsigned char> &b, int width, int height);
+
+// mean structural similarity of the luma, 11x11 Gaussian window of sigma 1.5; 1 for equal images
+float ssim(const std::vector <unsigned char> &a, const std::vector <unsigned char> &b, int width, int height);
+
+// Mean of a simplified FLIP (Andersson et al. 2020) error map, in [0, 1]: the images
+// are filtered by the contrast sensitivity of the eye at ppd pixels per degree, the
+// colour difference is HyAB in Hunt-adjusted CIELAB, and it is raised by the
+// difference in edges and points of the luminance.
+float flip(const std::vector <unsigned char> &a, const std::vector <unsigned char> &b, int width, int height,
+           float ppd = 67.f);
+
+}
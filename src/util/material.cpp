@@ -12,7 +12,10 @@ Material::Material() : Ns(7),
                        texture_scale(1),
                        texture_normal_scale(1),
                        metallic(0.5f),
-                       roughness(0.5f), ao(0.1f) { }
+                       roughness(0.5f), ao(0.1f) {
+    static uint32_t material_count = 0;
+    id = ++material_count;
+}
 
 void Material::verify() {
     Ns = std::clamp(Ns, 0.f, 1000.f);
@@ -12,6 +12,7 @@ struct Material {
     glm::vec3 Ke; // emit color
     uint32_t illum; // illumination type
     float metallic, roughness, ao;
+    uint32_t id; // unique per material, written to the G-buffer (0 = no material)
     /*
     0. Color on and Ambient off
     1. Color on and Ambient on
@@ -144,12 +144,6 @@ Mesh::Mesh(const Path &path) {
         objects.emplace_back(name, triangles, cur);
     }
     printf("Obj loaded, time: %lfs\n", 1. * (clock() - begin_time) / CLOCKS_PER_SEC);
-    try {
-        for(int i = 0; i < 2; ++i) shaders[i] = std::make_unique <SSDO> (i);
-    } catch (std::string msg) {
-        warn(2, "[ERROR] Fail to load shader program: %s", msg.c_str());
-        exit(1);
-    }
     vertex_buffer = 0;
 }
 
@@ -203,6 +197,12 @@ void Mesh::apply_transform(glm::mat4 trans) {
         vertex.position = apply_transform_vec3(vertex.position, trans);
 }
 void Mesh::init_draw() {
+    // loading stays free of GL, textures are uploaded here
+    for(auto &object: objects) {
+        auto material = object.material();
+        if(material && material->texture) material->texture->get();
+        if(material && material->texture_normal) material->texture_normal->get();
+    }
     glGenBuffers(1, &vertex_buffer);
     CheckGLError();
     glBindBuffer(GL_ARRAY_BUFFER, vertex_buffer);
@@ -219,21 +219,16 @@ void Mesh::init_draw() {
     glBindBuffer(GL_ARRAY_BUFFER, 0);
     CheckGLError();
 }
-void Mesh::draw(glm::mat4 model, glm::mat4 vp, glm::vec3 camera,
-                std::vector<LightInfo> light_info,
-                std::vector<GLuint> depth_map, int render_pass,
-                GLuint depth, GLuint normal, GLuint color, float time) {
-    auto &shader = shaders[render_pass];
-    shader -> use();
+void Mesh::draw(const std::function <SSDO &(const Material *)> &shader_for, glm::mat4 model, glm::mat4 vp) {
     glBindBuffer(GL_ARRAY_BUFFER, vertex_buffer);
-    shader->set_light(light_info);
-    shader->set_camera(camera);
-    shader->set_mvp(model, vp);
-    shader->set_depth(depth_map);
-    shader->set_geo(depth, normal, color);
-    shader->set_time(time);
+    SSDO *bound = nullptr;
     for(const auto &object: objects) {
-        shader->set_material(object.material());
+        auto &shader = shader_for(object.material());
+        if(&shader != bound) {
+            shader.set_mvp(model, vp);
+            bound = &shader;
+        }
+        shader.set_material(object.material());
         // printf("%s %p\n", object.c_name(), object.material());
         object.draw();
     }
@@ -254,12 +249,6 @@ Mesh::Mesh(glm::vec3 a, glm::vec3 b, glm::vec3 c, glm::vec3 normal, glm::vec3 co
     vertices.emplace_back(b, glm::vec2(0), normal);
     vertices.emplace_back(c, glm::vec2(0), normal);
     objects.emplace_back(std::string("triangle"), std::vector<uint32_t>{0,1,2}, material);
-    try {
-        for(int i = 0; i < 2; ++i) shaders[i] = std::make_unique <SSDO> (i);
-    } catch (std::string msg) {
-        warn(2, "[ERROR] Fail to load shader program: %s", msg.c_str());
-        exit(1);
-    }
     vertex_buffer = 0;
 }
 
@@ -4,6 +4,7 @@
 #include <map>
 #include "texture.hpp"
 #include <optional>
+#include <functional>
 #include "common.hpp"
 #include <cstring>
 #include <cstdio>
@@ -62,7 +63,6 @@ public:
     std::unique_ptr <MaterialLib> mtl;
     std::map <VertexIndices, uint32_t> mp;
     GLuint vertex_buffer;
-    std::unique_ptr <SSDO> shaders[3];
     // std::unique_ptr <PhongShader> shader;
     Mesh() { }
     ~Mesh() {
@@ -70,8 +70,6 @@ public:
             glDeleteBuffers(1, &vertex_buffer);
             printf("Delete vertex buffer: %d\n", vertex_buffer);
         }
-        printf("Delete program\n");
-        for(int i = 0; i < 3; ++i) shaders[i] = nullptr;
     }
     /*
      * Load from a [.obj] file
@@ -82,11 +80,9 @@ public:
      */
     Mesh(glm::vec3 a, glm::vec3 b, glm::vec3 c, glm::vec3 normal, glm::vec3 color);
     void init_draw();
-    void draw(glm::mat4 model, glm::mat4 vp, glm::vec3 camera,
-              std::vector<LightInfo> light_info, std::vector<GLuint> depth_map,
-              int render_pass, 
-              GLuint depth = 0, GLuint normal = 0, GLuint color = 0,
-              float time = 0.f);
+    // shader_for binds the variant for a material with the camera, lights and shadow maps set,
+    // the mvp is set here on each variant it returns
+    void draw(const std::function <SSDO &(const Material *)> &shader_for, glm::mat4 model, glm::mat4 vp);
     void draw_depth() const;
     Bound bound();
     void apply_transform(glm::mat4);
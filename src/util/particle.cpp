@@ -69,7 +69,8 @@ void main() {
 }
 )";
 
-ParticleShader::ParticleShader() : Shader(vertex_shader_text, fragment_shader_text) {
+ParticleShader::ParticleShader() : Shader(vertex_shader_text, fragment_shader_text) {}
+void ParticleShader::locate() {
     _center = loc("center");
     _v_angle = loc("v_angle");
     _particle_size = loc("particle_size");
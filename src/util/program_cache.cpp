@@ -0,0 +1,124 @@
+#include "program_cache.hpp"
+#include <chrono>
+#include <cstdint>
+
+Path ProgramCache::dir = "shader_cache";
+int ProgramCache::_hits = 0;
+float ProgramCache::_saved_ms = 0;
+
+namespace {
+const char magic[8] = {'G', 'L', 'P', 'B', 'I', 'N', '2', 0};
+// followed by the full key, the file name is only its hash, then the binary
+struct Header {
+    char magic[8];
+    uint32_t format, length, key_length;
+    float compile_ms;
+};
+
+uint64_t fnv1a(const std::string &s, uint64_t h = 0xcbf29ce484222325ull) {
+    for(unsigned char c: s) h = (h ^ c) * 0x100000001b3ull;
+    return h;
+}
+
+// the driver strings ahead of the program's key
+std::string full_key(const std::string &key) {
+    std::string driver;
+    for(GLenum name: {GL_VENDOR, GL_RENDERER, GL_VERSION}) {
+        auto s = (const char *)glGetString(name);
+        driver += s ? s : "";
+        driver += '\n';
+    }
+    return driver + key;
+}
+}
+
+bool ProgramCache::supported() {
+    static int formats = -1;
+    if(dir.empty()) return false;
+    if(formats < 0) {
+        formats = 0;
+        if(GLEW_VERSION_4_1 || GLEW_ARB_get_program_binary) glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+        // Mesa offers none when its own shader cache is disabled
+        if(formats == 0) printf("ProgramCache: the driver has no program binary formats, every program is compiled\n");
+    }
+    return formats > 0;
+}
+
+Path ProgramCache::file(const std::string &full_key) {
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx.bin", (unsigned long long)fnv1a(full_key));
+    return dir / name;
+}
+
+GLuint ProgramCache::load(const std::string &key) {
+    if(!supported()) return 0;
+    auto begin = std::chrono::steady_clock::now();
+    auto full = full_key(key);
+    auto path = file(full);
+    FILE *f = fopen(path.u8string().c_str(), "rb");
+    if(!f) return 0;
+    Header header;
+    std::string stored;
+    std::vector <char> binary;
+    bool ok = fread(&header, sizeof(header), 1, f) == 1 && memcmp(header.magic, magic, sizeof(magic)) == 0;
+    if(ok) {
+        stored.resize(header.key_length);
+        binary.resize(header.length);
+        ok = fread(stored.data(), 1, stored.size(), f) == stored.size() &&
+             fread(binary.data(), 1, binary.size(), f) == binary.size();
+    }
+    fclose(f);
+    if(!ok) {
+        warn(1, "ProgramCache: ignoring broken %s", path.u8string().c_str());
+        return 0;
+    }
+    if(stored != full) {
+        // two keys with one hash, the store after compiling takes the file over
+        printf("ProgramCache: %s belongs to another program, compiling\n", path.filename().u8string().c_str());
+        return 0;
+    }
+    GLuint program = glCreateProgram();
+    glProgramBinary(program, header.format, binary.data(), header.length);
+    GLint linked = 0;
+    glGetProgramiv(program, GL_LINK_STATUS, &linked);
+    if(!linked) {
+        // another driver build with the same strings, or a corrupt file
+        printf("ProgramCache: %s rejected by the driver, compiling\n", path.filename().u8string().c_str());
+        glDeleteProgram(program);
+        return 0;
+    }
+    float ms = std::chrono::duration <float, std::milli> (std::chrono::steady_clock::now() - begin).count();
+    _hits++;
+    _saved_ms += header.compile_ms - ms;
+    printf("ProgramCache: hit %s, %.1f ms instead of %.1f ms, %.1f ms saved over %d hits\n",
+           path.filename().u8string().c_str(), ms, header.compile_ms, _saved_ms, _hits);
+    return program;
+}
+
+void ProgramCache::store(const std::string &key, GLuint program, float compile_ms) {
+    if(!supported()) return;
+    GLint length = 0;
+    glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+    if(length <= 0) return;
+    Header header;
+    memcpy(header.magic, magic, sizeof(magic));
+    header.compile_ms = compile_ms;
+    std::vector <char> binary(length);
+    GLenum format = 0;
+    glGetProgramBinary(program, length, &length, &format, binary.data());
+    auto full = full_key(key);
+    header.format = format, header.length = length;
+    header.key_length = full.size();
+    std::error_code error;
+    fs::create_directories(dir, error);
+    auto path = file(full);
+    FILE *f = fopen(path.u8string().c_str(), "wb");
+    if(!f) {
+        warn(1, "ProgramCache: fail to open %s", path.u8string().c_str());
+        return;
+    }
+    fwrite(&header, sizeof(header), 1, f);
+    fwrite(full.data(), 1, full.size(), f);
+    fwrite(binary.data(), 1, length, f);
+    fclose(f);
+}
@@ -0,0 +1,29 @@
+#pragma once
+#include "common.hpp"
+#include <string>
+
+/*
+ * Linked program binaries on disk (glGetProgramBinary), one file per program
+ * named by a hash of its sources, defines and the driver's vendor, renderer
+ * and version strings, so a new driver misses instead of loading a stale
+ * binary. The file also holds that whole key, a file of another key with
+ * the same hash is a miss. A binary the driver rejects is compiled again
+ * and overwritten.
+ */
+class ProgramCache {
+public:
+    static Path dir; // empty disables the cache
+
+    // a linked program for key, or 0 when there is no usable binary
+    static GLuint load(const std::string &key);
+    // writes the binary of a freshly linked program, compile_ms is reported by later hits
+    static void store(const std::string &key, GLuint program, float compile_ms);
+    static int hits() { return _hits; }
+    static float saved_ms() { return _saved_ms; }
+
+private:
+    static bool supported();
+    static Path file(const std::string &full_key);
+    static int _hits;
+    static float _saved_ms;
+};
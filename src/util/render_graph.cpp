@@ -0,0 +1,189 @@
+#include "render_graph.hpp"
+#include <set>
+
+static bool is_depth(GLenum format) {
+    switch(format) {
+    case GL_DEPTH_COMPONENT: case GL_DEPTH_COMPONENT16: case GL_DEPTH_COMPONENT24:
+    case GL_DEPTH_COMPONENT32: case GL_DEPTH_COMPONENT32F:
+        return true;
+    default:
+        return false;
+    }
+}
+
+void RenderGraph::reset(int _frame) {
+    frame = _frame;
+    resources.clear();
+    passes.clear();
+}
+
+void RenderGraph::create(const std::string &name, TargetDesc desc) {
+    resources[name] = {Transient, desc, 0, false, -1, -1};
+}
+
+void RenderGraph::history(const std::string &name, TargetDesc desc) {
+    // the two targets trade places every frame
+    std::string a = frame & 1 ? "1" : "0", b = frame & 1 ? "0" : "1";
+    resources[name] = {History, desc, pool.get(name + "#" + a, desc), true, -1, -1};
+    resources[name + ".last"] = {History, desc, pool.get(name + "#" + b, desc), false, -1, -1};
+}
+
+void RenderGraph::import(const std::string &name, GLuint tex) {
+    resources[name] = {Imported, {0, 0, GL_NONE}, tex, false, -1, -1};
+}
+
+void RenderGraph::backbuffer(int width, int height) {
+    resources["backbuffer"] = {Backbuffer, {width, height, GL_NONE}, 0, true, -1, -1};
+}
+
+void RenderGraph::output(const std::string &name) {
+    resource(name).output = true;
+}
+
+void RenderGraph::add_pass(const std::string &name, std::vector <std::string> reads,
+                           std::vector <std::string> writes, Run run, bool framebuffer) {
+    passes.push_back({name, reads, writes, run, framebuffer});
+}
+
+RenderGraph::Resource &RenderGraph::resource(const std::string &name) {
+    auto it = resources.find(name);
+    if(it == resources.end()) {
+        warn(2, "[ERROR] render graph: undeclared resource %s", name.c_str());
+        exit(1);
+    }
+    return it->second;
+}
+
+GLuint RenderGraph::texture(const std::string &name) {
+    return resource(name).tex;
+}
+
+void RenderGraph::bind(const Pass &pass) {
+    std::vector <GLenum> buffers;
+    GLuint depth = 0;
+    TargetDesc *size = nullptr;
+    for(auto &w: pass.writes) {
+        if(w.empty()) {
+            buffers.push_back(GL_NONE);
+            continue;
+        }
+        auto &r = resource(w);
+        if(r.kind == Backbuffer) {
+            glBindFramebuffer(GL_FRAMEBUFFER, 0);
+            glViewport(0, 0, r.desc.width, r.desc.height);
+            return;
+        }
+        if(!size) size = &r.desc;
+        if(is_depth(r.desc.format)) depth = r.tex;
+        else buffers.push_back(GL_COLOR_ATTACHMENT0 + buffers.size());
+    }
+    GLuint &fbo = framebuffers[pass.name];
+    if(!fbo) glGenFramebuffers(1, &fbo);
+    glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+    size_t slot = 0;
+    for(auto &w: pass.writes) {
+        if(!w.empty() && is_depth(resource(w).desc.format)) continue;
+        GLuint tex = w.empty() ? 0 : resource(w).tex;
+        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0 + slot++, GL_TEXTURE_2D, tex, 0);
+    }
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, depth, 0);
+    glDrawBuffers(buffers.size(), buffers.data());
+    glReadBuffer(GL_NONE);
+    if(size) glViewport(0, 0, size->width, size->height);
+    CheckGLError();
+}
+
+void RenderGraph::execute() {
+    int n = passes.size();
+    std::map <std::string, std::vector <int>> writers;
+    for(int i = 0; i < n; ++i) {
+        for(auto &r: passes[i].reads) resource(r);
+        for(auto &w: passes[i].writes) {
+            if(!w.empty()) resource(w), writers[w].push_back(i);
+        }
+    }
+
+    // keep the writers of the outputs, then the writers of what they read
+    std::vector <bool> live(n);
+    std::vector <std::string> need;
+    std::set <std::string> seen;
+    for(auto &[name, r]: resources) {
+        if(r.output) need.push_back(name);
+    }
+    while(!need.empty()) {
+        auto name = need.back();
+        need.pop_back();
+        if(!seen.insert(name).second) continue;
+        for(int w: writers[name]) {
+            if(live[w]) continue;
+            live[w] = true;
+            for(auto &r: passes[w].reads) need.push_back(r);
+        }
+    }
+
+    // a pass runs after every writer of what it reads, writers of one
+    // resource keep their declaration order; ties go by declaration order
+    std::vector <std::vector <int>> next(n);
+    std::vector <int> pending(n);
+    auto edge = [&](int a, int b) {
+        if(a == b || !live[a] || !live[b]) return;
+        next[a].push_back(b);
+        pending[b]++;
+    };
+    for(int i = 0; i < n; ++i) {
+        for(auto &r: passes[i].reads) {
+            for(int w: writers[r]) edge(w, i);
+        }
+    }
+    for(auto &[name, list]: writers) {
+        for(size_t k = 1; k < list.size(); ++k) edge(list[k - 1], list[k]);
+    }
+    std::set <int> ready;
+    for(int i = 0; i < n; ++i) {
+        if(live[i] && !pending[i]) ready.insert(i);
+    }
+    std::vector <int> sorted;
+    while(!ready.empty()) {
+        int i = *ready.begin();
+        ready.erase(ready.begin());
+        sorted.push_back(i);
+        for(int j: next[i]) {
+            if(!--pending[j]) ready.insert(j);
+        }
+    }
+    if(sorted.size() != (size_t)std::count(live.begin(), live.end(), true)) {
+        warn(2, "[ERROR] render graph: passes depend on each other in a cycle");
+        exit(1);
+    }
+
+    for(int k = 0; k < (int)sorted.size(); ++k) {
+        auto &pass = passes[sorted[k]];
+        for(auto list: {&pass.reads, &pass.writes}) {
+            for(auto &name: *list) {
+                if(name.empty()) continue;
+                auto &r = resource(name);
+                if(r.first < 0) r.first = k;
+                r.last = k;
+            }
+        }
+    }
+
+    for(int k = 0; k < (int)sorted.size(); ++k) {
+        auto &pass = passes[sorted[k]];
+        for(auto &[name, r]: resources) {
+            if(r.kind == Transient && r.first == k) r.tex = pool.acquire(r.desc);
+        }
+        if(pass.framebuffer) bind(pass);
+
+        if(stats) stats->begin(pass.name);
+        pass.run();
+        if(stats) stats->end();
+        CheckGLError();
+
+        for(auto &[name, r]: resources) {
+            if(r.kind == Transient && r.last == k) pool.release(r.tex);
+        }
+    }
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    pool.end_frame();
+}
@@ -0,0 +1,69 @@
+#pragma once
+#include "common.hpp"
+#include "target_pool.hpp"
+#include "gpu_stats.hpp"
+#include <functional>
+#include <map>
+#include <string>
+#include <vector>
+
+/*
+ * Frame graph over the passes of Scene::render.
+ *
+ * The passes are declared again every frame together with the resources
+ * they read and write. execute() runs every pass after the writers of what
+ * it reads, drops passes that no output depends on, takes transient
+ * targets from the pool for exactly the passes that use them (so targets
+ * with disjoint lifetimes share memory) and times every pass in stats.
+ */
+class RenderGraph {
+public:
+    using Run = std::function <void()>;
+    TargetPool pool;
+    GpuStats *stats = nullptr; // passes are timed when set
+
+    // starts the declarations of a frame
+    void reset(int frame);
+    // target living from its first to its last user within the frame
+    void create(const std::string &name, TargetDesc desc);
+    // target kept across frames, name is written this frame and name + ".last"
+    // holds what was written the frame before
+    void history(const std::string &name, TargetDesc desc);
+    // resource owned outside the graph, tex 0 makes it a pure ordering token
+    void import(const std::string &name, GLuint tex = 0);
+    // the window, always an output
+    void backbuffer(int width, int height);
+    // keeps the writers of name even when no pass reads it
+    void output(const std::string &name);
+    // With framebuffer set the written targets are attached in order and made the
+    // viewport before run: "" leaves that draw buffer unused, a depth format goes
+    // to the depth attachment and "backbuffer" binds the window.
+    void add_pass(const std::string &name, std::vector <std::string> reads,
+                  std::vector <std::string> writes, Run run, bool framebuffer = true);
+    void execute();
+
+    // texture behind a resource, valid while its passes run
+    GLuint texture(const std::string &name);
+
+private:
+    enum Kind { Transient, History, Imported, Backbuffer };
+    struct Resource {
+        Kind kind;
+        TargetDesc desc;
+        GLuint tex;
+        bool output;
+        int first, last; // execution range of the passes using it
+    };
+    struct Pass {
+        std::string name;
+        std::vector <std::string> reads, writes;
+        Run run;
+        bool framebuffer;
+    };
+    Resource &resource(const std::string &name);
+    void bind(const Pass &pass);
+    std::map <std::string, Resource> resources;
+    std::vector <Pass> passes;
+    std::map <std::string, GLuint> framebuffers;
+    int frame = 0;
+};
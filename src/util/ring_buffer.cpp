@@ -0,0 +1,113 @@
+#include "ring_buffer.hpp"
+#include <chrono>
+
+bool RingBuffer::supported() {
+    return GLEW_VERSION_4_4 || GLEW_ARB_buffer_storage;
+}
+
+RingBuffer::RingBuffer(GLsizeiptr region_bytes): region_size(region_bytes) {}
+
+RingBuffer::~RingBuffer() {
+    if(_stats.peak_bytes) {
+        printf("RingBuffer: %d frames, %.1f KB per frame (peak %.1f KB of %.1f KB), %d fence waits (%.2f ms), %d overflows\n",
+               _stats.frames, _stats.frame_bytes / 1024., _stats.peak_bytes / 1024., _stats.region_bytes / 1024.,
+               _stats.waits, _stats.wait_ms, _stats.overflows);
+    }
+    release();
+}
+
+void RingBuffer::create(GLsizeiptr region_bytes) {
+    release();
+    region_size = region_bytes;
+    GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+    glGenBuffers(1, &id);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, id);
+    glBufferStorage(GL_COPY_WRITE_BUFFER, region_size * frames_in_flight, nullptr, flags);
+    mapped = (uint8_t *)glMapBufferRange(GL_COPY_WRITE_BUFFER, 0, region_size * frames_in_flight, flags);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+    if(!mapped) {
+        warn(1, "RingBuffer: fail to map %.1f KB", region_size * frames_in_flight / 1024.);
+        release();
+        return;
+    }
+    _stats.region_bytes = region_size;
+    printf("RingBuffer: %d regions of %.1f KB\n", frames_in_flight, region_size / 1024.);
+    CheckGLError();
+}
+
+void RingBuffer::release() {
+    for(auto &fence: fences) {
+        if(fence) glDeleteSync(fence);
+        fence = nullptr;
+    }
+    if(id) {
+        glBindBuffer(GL_COPY_WRITE_BUFFER, id);
+        glUnmapBuffer(GL_COPY_WRITE_BUFFER);
+        glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+        glDeleteBuffers(1, &id);
+    }
+    id = 0;
+    mapped = nullptr;
+}
+
+// true when the GPU was still reading the region
+bool RingBuffer::wait(int r) {
+    if(!fences[r]) return false;
+    bool waited = false;
+    GLenum status = glClientWaitSync(fences[r], 0, 0);
+    if(status == GL_TIMEOUT_EXPIRED) {
+        waited = true;
+        auto begin = std::chrono::steady_clock::now();
+        while(status == GL_TIMEOUT_EXPIRED) {
+            status = glClientWaitSync(fences[r], GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000);
+        }
+        _stats.wait_ms += std::chrono::duration <double, std::milli> (std::chrono::steady_clock::now() - begin).count();
+    }
+    glDeleteSync(fences[r]);
+    fences[r] = nullptr;
+    return waited;
+}
+
+void RingBuffer::begin_frame() {
+    if(in_frame) end_frame();
+    if(!supported()) return;
+    if(!id || wanted > region_size) {
+        // every region is replaced, so every frame reading the old buffer must be done
+        for(int r = 0; r < frames_in_flight; ++r) wait(r);
+        GLsizeiptr size = region_size;
+        while(size < wanted) size *= 2;
+        create(size);
+        if(!id) return;
+    }
+    region = (region + 1) % frames_in_flight;
+    if(wait(region)) ++_stats.waits;
+    used = wanted = 0;
+    in_frame = true;
+    overflowed = false;
+}
+
+void RingBuffer::end_frame() {
+    if(!in_frame) return;
+    in_frame = false;
+    fences[region] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    _stats.frame_bytes = used;
+    _stats.peak_bytes = std::max(_stats.peak_bytes, used);
+    ++_stats.frames;
+}
+
+RingBuffer::Allocation RingBuffer::allocate(GLsizeiptr size, GLsizeiptr alignment) {
+    if(!in_frame || size <= 0) return {};
+    GLsizeiptr offset = (used + alignment - 1) / alignment * alignment;
+    wanted = std::max(wanted, offset + size);
+    if(offset + size > region_size) {
+        if(!overflowed) {
+            printf("RingBuffer: frame needs more than %.1f KB, growing next frame\n", region_size / 1024.);
+            overflowed = true;
+            ++_stats.overflows;
+        }
+        return {};
+    }
+    used = offset + size;
+    GLintptr base = (GLintptr)region * region_size;
+    return {mapped + base + offset, base + offset, size};
+}
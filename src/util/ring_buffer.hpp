@@ -0,0 +1,57 @@
+#pragma once
+#include "common.hpp"
+
+/*
+ * Streaming uploads through one persistently mapped, coherent buffer
+ * (ARB_buffer_storage). The buffer holds a region per frame in flight; a
+ * frame sub-allocates from its region, writes through the mapping and
+ * binds the range, and end_frame fences the region. begin_frame only waits
+ * when the GPU is still reading the region from frames_in_flight frames
+ * ago, so nothing is re-specified and the driver never has to stall or
+ * orphan the storage. A frame that asks for more than its region gets
+ * empty allocations (callers fall back to glBufferData) and the buffer
+ * grows at the next begin_frame.
+ */
+class RingBuffer {
+public:
+    static constexpr int frames_in_flight = 3;
+    struct Allocation {
+        void *data = nullptr; // write only, never read it back
+        GLintptr offset = 0;  // in buffer()
+        GLsizeiptr size = 0;
+        explicit operator bool() const { return data != nullptr; }
+    };
+    struct Stats {
+        GLsizeiptr frame_bytes = 0; // allocated by the last finished frame
+        GLsizeiptr peak_bytes = 0;
+        GLsizeiptr region_bytes = 0;
+        int frames = 0;
+        int waits = 0; // frames that found the GPU still on their region
+        double wait_ms = 0;
+        int overflows = 0; // frames that outgrew their region
+    };
+
+    static bool supported();
+    explicit RingBuffer(GLsizeiptr region_bytes = 1 << 20);
+    ~RingBuffer();
+    // the buffer is made by the first begin_frame; does nothing without ARB_buffer_storage
+    void begin_frame();
+    void end_frame();
+    // empty outside a frame, without the extension or when the region is full
+    Allocation allocate(GLsizeiptr size, GLsizeiptr alignment = 16);
+    GLuint buffer() const { return id; }
+    const Stats &stats() const { return _stats; }
+
+private:
+    void create(GLsizeiptr region_bytes);
+    void release();
+    bool wait(int region);
+
+    GLuint id = 0;
+    uint8_t *mapped = nullptr;
+    GLsync fences[frames_in_flight] = {};
+    GLsizeiptr region_size, used = 0, wanted = 0;
+    int region = frames_in_flight - 1;
+    bool in_frame = false, overflowed = false;
+    Stats _stats;
+};
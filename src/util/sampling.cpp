@@ -0,0 +1,99 @@
+#include "sampling.hpp"
+#include <random>
+
+float halton(uint32_t index, uint32_t base) {
+    float f = 1, r = 0;
+    while(index > 0) {
+        f /= base;
+        r += f * (index % base);
+        index /= base;
+    }
+    return r;
+}
+
+std::vector <float> halton_points(int n) {
+    std::vector <float> points(n * 3);
+    for(int i = 0; i < n; ++i) {
+        points[i * 3 + 0] = halton(i + 1, 2);
+        points[i * 3 + 1] = halton(i + 1, 3);
+        points[i * 3 + 2] = halton(i + 1, 5);
+    }
+    return points;
+}
+
+/*
+ * Void-and-cluster (Ulichney 93).
+ * energy[i] is the gaussian-weighted count of set pixels around i on the torus,
+ * the tightest cluster is the set pixel with the highest energy and
+ * the largest void is the empty pixel with the lowest energy.
+ */
+std::vector <float> blue_noise_mask(int size, uint32_t seed) {
+    const int n = size * size;
+    const float sigma = 1.5f;
+    std::vector <float> kernel(n);
+    for(int y = 0; y < size; ++y) {
+        for(int x = 0; x < size; ++x) {
+            int dx = std::min(x, size - x), dy = std::min(y, size - y);
+            kernel[y * size + x] = expf(-(dx * dx + dy * dy) / (2 * sigma * sigma));
+        }
+    }
+    std::vector <char> set(n, 0);
+    std::vector <float> energy(n, 0.f);
+    auto splat = [&](int p, float sign) {
+        int px = p % size, py = p / size;
+        for(int y = 0; y < size; ++y) {
+            int ky = (y - py + size) % size;
+            for(int x = 0; x < size; ++x) {
+                energy[y * size + x] += sign * kernel[ky * size + (x - px + size) % size];
+            }
+        }
+    };
+    auto cluster = [&]() {
+        int best = -1;
+        for(int i = 0; i < n; ++i)
+            if(set[i] && (best < 0 || energy[i] > energy[best])) best = i;
+        return best;
+    };
+    auto void_ = [&]() {
+        int best = -1;
+        for(int i = 0; i < n; ++i)
+            if(!set[i] && (best < 0 || energy[i] < energy[best])) best = i;
+        return best;
+    };
+
+    // initial binary pattern: random 10% of pixels, relaxed until stable
+    std::mt19937 rng(seed);
+    int ones = std::max(1, n / 10);
+    for(int k = 0; k < ones; ) {
+        int p = rng() % n;
+        if(set[p]) continue;
+        set[p] = 1, splat(p, 1), k++;
+    }
+    while(true) {
+        int c = cluster();
+        set[c] = 0, splat(c, -1);
+        int v = void_();
+        set[v] = 1, splat(v, 1);
+        if(v == c) break;
+    }
+
+    std::vector <int> rank(n, 0);
+    auto initial = set;
+    auto initial_energy = energy;
+    // phase 1: remove tightest clusters, ranks ones - 1 .. 0
+    for(int r = ones - 1; r >= 0; --r) {
+        int c = cluster();
+        set[c] = 0, splat(c, -1);
+        rank[c] = r;
+    }
+    // phase 2: fill largest voids until every pixel is ranked
+    set = initial, energy = initial_energy;
+    for(int r = ones; r < n; ++r) {
+        int v = void_();
+        set[v] = 1, splat(v, 1);
+        rank[v] = r;
+    }
+    std::vector <float> mask(n);
+    for(int i = 0; i < n; ++i) mask[i] = (rank[i] + 0.5f) / n;
+    return mask;
+}
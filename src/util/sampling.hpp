@@ -0,0 +1,17 @@
+#pragma once
+#include "common.hpp"
+#include <vector>
+
+/*
+ * Low-discrepancy sequences used to drive the SSDO sampler.
+ */
+
+// Radical inverse of index in the given base, index >= 1 for the usual Halton points
+float halton(uint32_t index, uint32_t base);
+
+// n points of the (2, 3, 5) Halton sequence, 3 floats per point
+std::vector <float> halton_points(int n);
+
+// size x size blue-noise threshold mask in [0, 1) generated by void-and-cluster,
+// the mask tiles seamlessly
+std::vector <float> blue_noise_mask(int size, uint32_t seed);
@@ -1,12 +1,28 @@
 #include "scene.hpp"
+#include "sampling.hpp"
 #include <stack>
+#include <set>
 
 Scene::Scene()
-    : shadow(0), depth_buffer(0), denoiser(nullptr), mixer(nullptr) {}
+    : shadow(0), depth_buffer(0), denoiser(nullptr), box_denoiser(nullptr),
+      atrous_filter(nullptr), atrous_composite(nullptr), downsampler(nullptr), hiz_builder(nullptr), upsampler(nullptr), mixer(nullptr),
+      temporal_upsampler(nullptr) {}
 Scene::~Scene() {
+    for(auto &shaders: geometry_shaders) shaders.clear();
     depth_shader = nullptr;
+    gpu_scene = nullptr;
+    lighting.clear();
+    ssdo_shaders.clear();
+    ssdo_compute.clear();
     denoiser = nullptr;
+    box_denoiser = nullptr;
+    atrous_filter = nullptr;
+    atrous_composite = nullptr;
+    downsampler = nullptr;
+    hiz_builder = nullptr;
+    upsampler = nullptr;
     mixer = nullptr;
+    temporal_upsampler = nullptr;
 }
 std::map<std::string, std::vector<glm::mat4>> &Scene::model() {
     return _model;
@@ -35,121 +51,73 @@ void Scene::init_draw(int _width, int _height) {
     glBindBuffer(GL_ARRAY_BUFFER, 0);  
 
 
-    glGenFramebuffers(1, &buffer);
-    glGenFramebuffers(1, &buffer2);
-    glGenFramebuffers(1, &buffer3);
-    glGenFramebuffers(1, &buffer4);
-    glGenTextures(1, &depth);
-    glBindTexture(GL_TEXTURE_2D, depth);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT, width,
-                 height, 0, GL_DEPTH_COMPONENT, GL_FLOAT, NULL);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-    
-    glGenTextures(1, &depth2);
-    glBindTexture(GL_TEXTURE_2D, depth2);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT, width,
-                 height, 0, GL_DEPTH_COMPONENT, GL_FLOAT, NULL);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-
-    glGenTextures(1, &normal);
-    glBindTexture(GL_TEXTURE_2D, normal);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB16_SNORM, width, height, 0,
-                 GL_RGB, GL_FLOAT, NULL);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-
-    glGenTextures(1, &color);
-    glBindTexture(GL_TEXTURE_2D, color);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB16_SNORM, width, height, 0,
-                 GL_RGB, GL_FLOAT, NULL);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-    
-    glGenTextures(1, &ssdo);
-    glBindTexture(GL_TEXTURE_2D, ssdo);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB16_SNORM, width, height, 0,
-                 GL_RGB, GL_FLOAT, NULL);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-    
-    glGenTextures(1, &out_a);
-    glBindTexture(GL_TEXTURE_2D, out_a);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB16_SNORM, width, height, 0,
-                 GL_RGB, GL_FLOAT, NULL);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-    
-    glGenTextures(1, &out_b);
-    glBindTexture(GL_TEXTURE_2D, out_b);
-    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB16_SNORM, width, height, 0,
-                 GL_RGB, GL_FLOAT, NULL);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-
-    glBindFramebuffer(GL_FRAMEBUFFER, buffer);
-    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, depth, 0);
-    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, color, 0);
-    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT1, GL_TEXTURE_2D, normal, 0);
-    GLuint buffers[2] = {GL_COLOR_ATTACHMENT0,GL_COLOR_ATTACHMENT1};
-    glDrawBuffers(2, buffers);
-    glReadBuffer(GL_NONE);
-    CheckGLError();
-    glBindFramebuffer(GL_FRAMEBUFFER, 0);
-    CheckGLError();
-    
-    glBindFramebuffer(GL_FRAMEBUFFER, buffer2);
-    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, depth2, 0);
-    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, ssdo, 0);
-    glDrawBuffers(1, buffers);
-    glReadBuffer(GL_NONE);
-    CheckGLError();
-    glBindFramebuffer(GL_FRAMEBUFFER, 0);
-    CheckGLError();
-        
-    glBindFramebuffer(GL_FRAMEBUFFER, buffer3);
-    CheckGLError();
-    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, out_a, 0);
-    glDrawBuffer(GL_COLOR_ATTACHMENT0);
-    glReadBuffer(GL_NONE);
-    CheckGLError();
-    glBindFramebuffer(GL_FRAMEBUFFER, 0);
-    CheckGLError();
-    
-    glBindFramebuffer(GL_FRAMEBUFFER, buffer4);
-    CheckGLError();
-    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, out_b, 0);
-    glDrawBuffer(GL_COLOR_ATTACHMENT0);
-    glReadBuffer(GL_NONE);
-    CheckGLError();
-    glBindFramebuffer(GL_FRAMEBUFFER, 0);
-    CheckGLError();
-        
+    // the graph binds the framebuffers of most passes, these two bind their own
+    glGenFramebuffers(1, &hiz_buffer);
+    glGenFramebuffers(1, &blit_buffer);
+    target_size = glm::ivec3(0);
+    ssdo_scale = 1;
+    render_width = width, render_height = height;
+    render_scale = 1;
+    gpu_ms = 0;
+    gpu_frame = -1;
+    upsample_frame = -1;
+    graph.stats = &stats;
 
     try {
+        has_ssdo_compute = GLEW_VERSION_4_3 && ScreenSSDO::image_format(formats.ssdo);
+        if(has_ssdo_compute) {
+            glGenBuffers(2, tile_counters);
+            for(auto buffer: tile_counters) {
+                glBindBuffer(GL_SHADER_STORAGE_BUFFER, buffer);
+                glBufferData(GL_SHADER_STORAGE_BUFFER, 2 * sizeof(GLuint), nullptr, GL_DYNAMIC_READ);
+            }
+            glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+        }
+        prepare_variants(config);
         denoiser = std::make_unique <Denoiser>();
+        box_denoiser = std::make_unique <Denoiser>(true);
+        downsampler = std::make_unique <Downsampler>();
+        hiz_builder = std::make_unique <HiZBuilder>();
+        atrous_filter = std::make_unique <AtrousFilter>();
+        atrous_composite = std::make_unique <AtrousFilter>(true);
+        upsampler = std::make_unique <Upsampler>();
         mixer = std::make_unique <Mixer>();
+        temporal_upsampler = std::make_unique <TemporalUpsampler>();
     } catch (std::string msg) {
         warn(2, "[ERROR] Fail to load shader program: %s", msg.c_str());
         exit(1);
     }
     first = 1;
+    frame = 0;
+    history_start = 0;
+    ssdo_waiting = false;
+    wait_for_programs = false;
 
+    auto points = halton_points(max_ssdo_spp);
+    glGenTextures(1, &sample_seq);
+    glBindTexture(GL_TEXTURE_2D, sample_seq);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB32F, max_ssdo_spp, 1, 0, GL_RGB, GL_FLOAT, points.data());
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+
+    // one blue-noise mask, the three channels are toroidal shifts of it
+    auto mask = blue_noise_mask(noise_size, 1);
+    std::vector <float> noise(noise_size * noise_size * 3);
+    const int shift[3][2] = {{0, 0}, {23, 41}, {47, 11}};
+    for(int y = 0; y < noise_size; ++y) {
+        for(int x = 0; x < noise_size; ++x) {
+            for(int c = 0; c < 3; ++c) {
+                int sx = (x + shift[c][0]) % noise_size, sy = (y + shift[c][1]) % noise_size;
+                noise[(y * noise_size + x) * 3 + c] = mask[sy * noise_size + sx];
+            }
+        }
+    }
+    glGenTextures(1, &blue_noise);
+    glBindTexture(GL_TEXTURE_2D, blue_noise);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB32F, noise_size, noise_size, 0, GL_RGB, GL_FLOAT, noise.data());
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    CheckGLError();
 }
 
 void Scene::activate_shadow() {
@@ -161,138 +129,395 @@ void Scene::activate_shadow() {
 void Scene::update_light(std::vector <LightInfo> info) {
     light_info = info;
 }
-void Scene::render(GLFWwindow *window, glm::mat4 vp, glm::vec3 camera, float time, float denoise_alpha, float movement, float ssdo_alpha) {
-    glfwGetFramebufferSize(window, &width, &height);
-    CheckGLError();
-    glfwPollEvents();
+void Scene::update_render_scale() {
+    float lo = std::clamp(config.min_render_scale, .1f, 1.f);
+    float hi = std::clamp(config.max_render_scale, lo, 1.f);
+    // GPU time follows the pixel count, the square of the scale. Step a quarter
+    // of the way there in 1/16 increments, every change reallocates the targets.
+    float ideal = render_scale * std::sqrt(config.target_ms / gpu_ms);
+    render_scale = std::round((render_scale + 0.25f * (ideal - render_scale)) * 16) / 16;
+    render_scale = std::clamp(render_scale, lo, hi);
+}
+void Scene::draw_rec() {
+    glBindBuffer(GL_ARRAY_BUFFER, rec_vbo);
+    glBindVertexArray(rec_vao);
+    glDrawArrays(GL_TRIANGLES, 0, 6);
     CheckGLError();
- 
-    if (shadow) {
-        render_depth_buffer();
+}
+void Scene::render(int framebuffer_width, int framebuffer_height, glm::mat4 vp, glm::vec3 camera, float denoise_alpha, float ssdo_alpha) {
+    int last_width = width, last_height = height;
+    width = framebuffer_width, height = framebuffer_height;
+    if(width != last_width || height != last_height) upsample_frame = -1;
+
+    // the newest fully measured frame drives the render scale
+    stats.begin_frame(frame);
+    uploads.begin_frame();
+    if(stats.measured_frame > gpu_frame) {
+        gpu_frame = stats.measured_frame;
+        gpu_ms = stats.frame_ms;
+        if(config.dynamic_resolution && gpu_ms > 0) update_render_scale();
     }
-    {
-        glBindFramebuffer(GL_FRAMEBUFFER, buffer);
-        CheckGLError();
+    if(!config.dynamic_resolution) render_scale = 1;
+    render_width = std::max(1, (int)std::lround(width * render_scale));
+    render_height = std::max(1, (int)std::lround(height * render_scale));
 
-        // glfwGetFramebufferSize(window, &width, &height);
-        // CheckGLError();
-        glViewport(0, 0, width, height);
-        CheckGLError();
+    // the upsampler accumulates an 8 frame Halton (2, 3) pattern of sub-pixel offsets,
+    // every pass of the frame sees the jittered projection
+    bool upsample = config.dynamic_resolution;
+    glm::mat4 output_vp = vp;
+    glm::vec2 jitter(0.f);
+    if(upsample) {
+        int k = (frame - history_start) % 8 + 1;
+        jitter = glm::vec2(halton(k, 2), halton(k, 3)) - 0.5f;
+        glm::vec2 ndc = jitter * 2.f / glm::vec2(render_width, render_height);
+        vp = glm::translate(glm::mat4(1.f), glm::vec3(ndc, 0.f)) * vp;
+    }
+
+    /*
+     * SSDO and the denoiser run at 1 / scale of the G-buffer resolution.
+     * For scale > 1 the G-buffer is first reduced to half_* targets and
+     * the denoised result is brought back to full resolution in ssdo_up.
+     */
+    ssdo_scale = std::clamp(config.ssdo_scale, 1, 4);
+    int ssdo_width = std::max(1, render_width / ssdo_scale), ssdo_height = std::max(1, render_height / ssdo_scale);
+    auto full = [&](GLenum format) { return TargetDesc{render_width, render_height, format}; };
+    auto low = [&](GLenum format) { return TargetDesc{ssdo_width, ssdo_height, format}; };
+    bool resized = target_size != glm::ivec3(render_width, render_height, ssdo_scale);
+    target_size = glm::ivec3(render_width, render_height, ssdo_scale);
+    if(resized) first = 1; // history has the wrong size
+
+    graph.reset(frame);
+    graph.backbuffer(width, height);
+    graph.import("shadow maps");
+    graph.create("depth", full(formats.depth));
+    graph.create("normal", full(formats.normal));
+    graph.create("color", full(formats.color));
+    graph.create("albedo", full(formats.albedo));
+    // metallic, roughness, ao, material id
+    graph.create("material", full(formats.material));
+    if(ssdo_scale > 1) {
+        graph.create("half_depth", low(GL_R32F));
+        graph.create("half_normal", low(formats.normal));
+        graph.create("half_albedo", low(formats.albedo));
+        graph.create("half_material", low(formats.material));
+    }
+    std::string geo = ssdo_scale > 1 ? "half_" : "";
+    std::string ssdo_depth = geo + "depth", ssdo_normal = geo + "normal";
+    // min-depth pyramid down to 1x1
+    hiz_levels = 1;
+    while(std::max(ssdo_width, ssdo_height) >> hiz_levels) ++hiz_levels;
+    graph.create("hiz", {ssdo_width, ssdo_height, GL_R32F, hiz_levels});
+    graph.create("ssdo", low(formats.ssdo));
+    // temporally accumulated color, alpha holds the luminance variance
+    graph.history("out", low(GL_RGBA16F));
+    // normal and depth behind out, for reprojecting it
+    graph.history("hist", low(GL_RGBA32F));
+    // luminance moments and history length
+    graph.history("moments", low(GL_RGBA16F));
+
+    // a pass per light, so every shadow map is timed on its own
+    for(int i = 0; shadow && i < (int)light_info.size(); ++i) {
+        graph.add_pass("shadow " + std::to_string(i), {}, {"shadow maps"}, [&, i] {
+            render_depth_buffer(i);
+        }, false);
+    }
+    // the geometry pass of the deferred path leaves color to the lighting pass
+    graph.add_pass("geometry", {"shadow maps"},
+                   {config.deferred ? "" : "color", "normal", "albedo", "material", "depth"}, [&] {
         glClearColor(0., 0., 0., 1.);
-        CheckGLError();
         glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-        CheckGLError();
         glEnable(GL_DEPTH_TEST);
-        CheckGLError();
+        // encodes albedo to sRGB, the linear targets are left alone
+        glEnable(GL_FRAMEBUFFER_SRGB);
         glDepthFunc(GL_LESS);
         CheckGLError();
+        bool forward = !config.deferred;
+        // the forward path keeps per-object draws, its programs depend on the material
+        if(config.gpu_driven && !forward && GpuScene::supported()) {
+            if(!gpu_scene) gpu_scene = std::make_unique <GpuScene> (meshes);
+            static const std::vector <glm::mat4> identity = {glm::mat4(1.f)};
+            std::vector <const std::vector <glm::mat4> *> instances;
+            for(auto &[name, mesh]: meshes) instances.push_back(_model.count(name) ? &_model[name] : &identity);
+            gpu_scene->update(instances, &uploads);
+            gpu_scene->draw(vp, config.gpu_culling);
+            glDisable(GL_FRAMEBUFFER_SRGB);
+            glDisable(GL_DEPTH_TEST);
+            return;
+        }
+        auto maps = shadow_maps();
+        std::string lights = forward ? light_defines(light_info, !maps.empty(), config.shadow_filter) : "";
+        // programs only change where the material's maps do, the lights are set once per variant
+        SSDO *current = nullptr;
+        std::set <SSDO *> lit;
+        auto shader_for = [&](const Material *material) -> SSDO & {
+            auto &shader = geometry_shaders[forward ? 0 : 1].get(material_defines(material) + lights, forward);
+            if(&shader != current) {
+                shader.use();
+                current = &shader;
+                if(forward && lit.insert(&shader).second) {
+                    shader.set_light(light_info);
+                    shader.set_camera(camera);
+                    shader.set_depth(maps);
+                }
+            }
+            return shader;
+        };
         for(auto &[name, mesh]: meshes) {
             if(!_model.count(name)) {
-                mesh->draw(glm::mat4(1.f), vp, camera, light_info, depth_map, 0);
+                mesh->draw(shader_for, glm::mat4(1.f), vp);
             } else {
                 for(auto model: _model[name]) {
-                    mesh->draw(model, vp, camera, light_info, depth_map, 0);
+                    mesh->draw(shader_for, model, vp);
                 }
             }
-            // mesh->draw(_model.count(name) ? _model[name] : glm::mat4(1.f), vp, camera, light_info, depth_map);
         }
-        glBindFramebuffer(GL_FRAMEBUFFER, 0);
-    };
-    {
-        glBindFramebuffer(GL_FRAMEBUFFER, buffer2);
-        CheckGLError();
-
-        // glfwGetFramebufferSize(window, &width, &height);
-        // CheckGLError();
-        glViewport(0, 0, width, height);
-        CheckGLError();
+        glDisable(GL_FRAMEBUFFER_SRGB);
+        glDisable(GL_DEPTH_TEST);
+    });
+    if(config.deferred) {
+        graph.add_pass("lighting", {"depth", "normal", "albedo", "material", "shadow maps"}, {"color"}, [&] {
+            glClearColor(0., 0., 0., 1.);
+            glClear(GL_COLOR_BUFFER_BIT);
+            auto maps = shadow_maps();
+            auto &shader = lighting.get(light_defines(light_info, !maps.empty(), config.shadow_filter));
+            shader.use();
+            shader.set_camera(vp, camera);
+            shader.set_light(light_info);
+            shader.set_depth(maps);
+            shader.set_geo(graph.texture("depth"), graph.texture("normal"),
+                           graph.texture("albedo"), graph.texture("material"));
+            draw_rec();
+        });
+    }
+    if(ssdo_scale > 1) {
+        graph.add_pass("downsample", {"depth", "normal", "albedo", "material"},
+                       {"half_depth", "half_normal", "half_albedo", "half_material"}, [&] {
+            downsampler -> use();
+            downsampler -> set(graph.texture("depth"), graph.texture("normal"),
+                               graph.texture("albedo"), graph.texture("material"), ssdo_scale);
+            glEnable(GL_FRAMEBUFFER_SRGB);
+            draw_rec();
+            glDisable(GL_FRAMEBUFFER_SRGB);
+        });
+    }
+    // builds level l from level l - 1, so it binds the levels itself
+    graph.add_pass("hi-z", {ssdo_depth}, {"hiz"}, [&] {
+        GLuint hiz = graph.texture("hiz");
+        glBindFramebuffer(GL_FRAMEBUFFER, hiz_buffer);
+        glDrawBuffer(GL_COLOR_ATTACHMENT0);
+        glReadBuffer(GL_NONE);
+        hiz_builder -> use();
+        for(int l = 0; l < hiz_levels; ++l) {
+            glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, hiz, l);
+            glViewport(0, 0, std::max(1, ssdo_width >> l), std::max(1, ssdo_height >> l));
+            hiz_builder -> set(l ? hiz : graph.texture(ssdo_depth), l);
+            draw_rec();
+        }
+        glBindTexture(GL_TEXTURE_2D, hiz);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, 0);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, hiz_levels - 1);
+    }, false);
+    std::vector <std::string> ssdo_reads = {geo + "depth", geo + "normal", "color", geo + "albedo", geo + "material"};
+    if(config.ssdo_hiz) ssdo_reads.push_back("hiz");
+    // a full-screen pass over the G-buffer, no depth attachment needed
+    graph.add_pass("ssdo", ssdo_reads, {"ssdo"}, [&] {
         glClearColor(0., 0., 0., 1.);
+        glClear(GL_COLOR_BUFFER_BIT);
+
+        // the compute variant needs GL 4.3, the fragment pass is the fallback
+        bool compute = config.ssdo_compute && has_ssdo_compute;
+        int spp = std::clamp(config.ssdo_spp, 1, max_ssdo_spp);
+        ScreenSSDO *shader = &(compute ? ssdo_compute : ssdo_shaders).get(ssdo_defines(spp), compute, formats.ssdo);
+        // until the driver has linked it the frame goes out with direct light only;
+        // SSDO is the only pass with a placeholder, the others wait for their program in use()
+        if(!wait_for_programs && !shader -> ready()) {
+            ssdo_waiting = true;
+            return;
+        }
+        if(ssdo_waiting) {
+            ssdo_waiting = false;
+            reset_history();
+        }
+        shader -> use();
+        shader -> set_camera(vp, camera);
+        shader -> set_geo(graph.texture(geo + "depth"), graph.texture(geo + "normal"), graph.texture("color"),
+                          graph.texture(geo + "albedo"), graph.texture(geo + "material"));
+        shader -> set_sampling(sample_seq, blue_noise, frame - history_start, config.ssdo_radius, config.ssdo_radius_px);
+        shader -> set_hiz(config.ssdo_hiz ? graph.texture("hiz") : 0, config.ssdo_hiz ? hiz_levels : 0);
         CheckGLError();
-        glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
-        CheckGLError();
-        glEnable(GL_DEPTH_TEST);
-        CheckGLError();
-        glDepthFunc(GL_LESS);
-        CheckGLError();
-        for(auto &[name, mesh]: meshes) {
-            if(!_model.count(name)) {
-                mesh->draw(glm::mat4(1.f), vp, camera, light_info, depth_map, 1, depth, normal, color, time);
-            } else {
-                for(auto model: _model[name]) {
-                    mesh->draw(model, vp, camera, light_info, depth_map, 1, depth, normal, color, time);
+
+        if(compute) {
+            // the counters of two frames ago, that sample is lost while they are still busy
+            int slot = frame & 1;
+            glBindBuffer(GL_SHADER_STORAGE_BUFFER, tile_counters[slot]);
+            if(tile_fences[slot]) {
+                GLenum status = glClientWaitSync(tile_fences[slot], 0, 0);
+                if(status == GL_ALREADY_SIGNALED || status == GL_CONDITION_SATISFIED) {
+                    GLuint counts[2];
+                    glGetBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(counts), counts);
+                    if(counts[1]) ssdo_tile_hits = (float)counts[0] / counts[1];
                 }
+                glDeleteSync(tile_fences[slot]);
             }
-            // mesh->draw(_model.count(name) ? _model[name] : glm::mat4(1.f), vp, camera, light_info, depth_map);
+            const GLuint zero[2] = {0, 0};
+            glBufferSubData(GL_SHADER_STORAGE_BUFFER, 0, sizeof(zero), zero);
+            glBindBufferBase(GL_SHADER_STORAGE_BUFFER, 4, tile_counters[slot]);
+            shader -> dispatch(graph.texture("ssdo"), ssdo_width, ssdo_height);
+            tile_fences[slot] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+        } else {
+            draw_rec();
         }
-        glBindFramebuffer(GL_FRAMEBUFFER, 0);
-    };
-    {
-
-        glBindFramebuffer(GL_FRAMEBUFFER, buffer3);
-        CheckGLError();
-        glDisable(GL_DEPTH_TEST);
-    
-        glViewport(0, 0, width, height);
-        CheckGLError();
+    });
+    graph.add_pass("temporal", {"ssdo", ssdo_depth, ssdo_normal, "out.last", "hist.last", "moments.last"},
+                   {"out", "hist", "moments"}, [&] {
         glClearColor(0.0, 0.0, 0.0, 1.);
-        CheckGLError();
         glClear(GL_COLOR_BUFFER_BIT);
-        CheckGLError();
-
-        denoiser -> use();
-        CheckGLError();
-        float alpha = std::min(1.f, denoise_alpha * (1 + movement * 3000));
-        denoiser -> set(ssdo, first ? 0 : out_b, alpha);
+        auto &shader = config.atrous ? denoiser : box_denoiser;
+        shader -> use();
+        shader -> set(graph.texture("ssdo"), first ? 0 : graph.texture("out.last"), denoise_alpha);
+        shader -> set_reprojection(graph.texture(ssdo_depth), graph.texture(ssdo_normal), graph.texture("hist.last"),
+                                   graph.texture("moments.last"), vp, prev_vp, camera);
         CheckGLError();
         first = 0;
+        draw_rec();
+    });
+    if(upsample) {
+        graph.create("composite", full(formats.composite));
+        graph.history("upsampled", {width, height, formats.upsampled});
+    }
+    std::string output = upsample ? "composite" : "backbuffer";
+    // edge-aware a-trous passes over the accumulated result, step 1, 2, 4, ...
+    std::string denoised = "out";
+    int passes = config.atrous ? std::clamp(config.denoise_passes, 0, max_denoise_passes) : 0;
+    // at full SSDO resolution the last one also composites and tonemaps,
+    // the filtered result never goes through memory
+    bool fused = config.fused_composite && ssdo_scale == 1 && passes > 0;
+    for(int i = 0; i < passes; ++i) {
+        if(fused && i == passes - 1) {
+            graph.add_pass("atrous+mix", {denoised, "hist", "color"}, {output}, [&, i, denoised] {
+                atrous_composite -> use();
+                atrous_composite -> set(graph.texture(denoised), graph.texture("hist"), 1 << i, vp, camera);
+                atrous_composite -> set_composite(graph.texture("color"), ssdo_alpha);
+                draw_rec();
+            });
+            break;
+        }
+        std::string target = "atrous" + std::to_string(i);
+        graph.create(target, low(GL_RGBA16F));
+        graph.add_pass(target, {denoised, "hist"}, {target}, [&, i, denoised] {
+            atrous_filter -> use();
+            atrous_filter -> set(graph.texture(denoised), graph.texture("hist"), 1 << i, vp, camera);
+            draw_rec();
+        });
+        denoised = target;
+    }
+    std::string indirect = denoised;
+    if(ssdo_scale > 1) {
+        indirect = "ssdo_up";
+        graph.create(indirect, full(formats.indirect));
+        graph.add_pass("upsample", {denoised, "half_depth", "half_normal", "depth", "normal"}, {indirect}, [&] {
+            upsampler -> use();
+            upsampler -> set(graph.texture(denoised), graph.texture("half_depth"), graph.texture("half_normal"),
+                             graph.texture("depth"), graph.texture("normal"), vp, camera);
+            draw_rec();
+        });
+    }
+    if(!fused) {
+        graph.add_pass("mix", {"color", indirect}, {output}, [&] {
+            glClearColor(0.0, 0.0, 0.0, 1.);
+            glClear(GL_COLOR_BUFFER_BIT);
+            mixer -> use();
+            mixer -> set(graph.texture("color"), graph.texture(indirect), ssdo_alpha);
+            draw_rec();
+        });
+    }
+    if(upsample) {
+        graph.add_pass("temporal upsample", {"composite", "depth", "upsampled.last"}, {"upsampled"}, [&] {
+            temporal_upsampler -> use();
+            temporal_upsampler -> set(graph.texture("composite"), graph.texture("depth"), graph.texture("upsampled.last"),
+                                      upsample_frame == frame - 1, jitter, output_vp, prev_output_vp);
+            draw_rec();
+            upsample_frame = frame;
+            prev_output_vp = output_vp;
+        });
+        // the history is the output, copy it to the window
+        graph.add_pass("present", {"upsampled"}, {"backbuffer"}, [&] {
+            glBindFramebuffer(GL_READ_FRAMEBUFFER, blit_buffer);
+            glFramebufferTexture2D(GL_READ_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, graph.texture("upsampled"), 0);
+            glReadBuffer(GL_COLOR_ATTACHMENT0);
+            glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+            glBlitFramebuffer(0, 0, width, height, 0, 0, width, height, GL_COLOR_BUFFER_BIT, GL_NEAREST);
+        }, false);
+    }
+    graph.execute();
+    uploads.end_frame();
+    if(resized) {
+        size_t bytes = 0;
+        for(auto name: {"depth", "normal", "color", "albedo", "material"}) {
+            bytes += TargetPool::texture_bytes(graph.texture(name));
+        }
+        // allocated size only, the traffic depends on the passes that run
+        printf("G-buffer footprint %dx%d: %.1f bytes/pixel, %.1f MB\n",
+               render_width, render_height, 1. * bytes / render_width / render_height, bytes / 1e6);
+    }
+    prev_vp = vp;
+    frame++;
+}
 
-        glBindBuffer(GL_ARRAY_BUFFER, rec_vbo);
-        glBindVertexArray(rec_vao);
-        CheckGLError();
-        glDrawArrays(GL_TRIANGLES, 0, 6);
-        CheckGLError();
-        
-        glBindFramebuffer(GL_FRAMEBUFFER, 0);
-        CheckGLError();
-    };
-    {
-        glfwSwapBuffers(window);
-        CheckGLError();
-        glDisable(GL_DEPTH_TEST);
+std::vector <GLuint> Scene::shadow_maps() {
+    if(!shadow || depth_map.size() < light_info.size()) return {};
+    return std::vector <GLuint> (depth_map.begin(), depth_map.begin() + light_info.size());
+}
 
-        glBindBuffer(GL_ARRAY_BUFFER, rec_vbo);
-        CheckGLError();
-        glBindVertexArray(rec_vao);
-        CheckGLError();
-        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 3 * sizeof(float), (void*)0);
-        glEnableVertexAttribArray(0);  
-        
-        glViewport(0, 0, width, height);
-        CheckGLError();
-        glClearColor(0.0, 0.0, 0.0, 1.);
-        CheckGLError();
-        glClear(GL_COLOR_BUFFER_BIT);
+void Scene::prepare_variants(const RenderConfig &config) {
+    bool forward = !config.deferred;
+    // activate_shadow usually follows init_draw, so the shadowed variants are the ones to have ready
+    std::string lights = light_defines(light_info, true, config.shadow_filter);
+    for(auto &[name, mesh]: meshes) {
+        for(auto material: mesh->mtl->materials) {
+            geometry_shaders[forward ? 0 : 1].get(material_defines(material) + (forward ? lights : ""), forward);
+        }
+    }
+    if(!forward) lighting.get(lights);
+    bool compute = config.ssdo_compute && has_ssdo_compute;
+    int spp = std::clamp(config.ssdo_spp, 1, max_ssdo_spp);
+    (compute ? ssdo_compute : ssdo_shaders).get(ssdo_defines(spp), compute, formats.ssdo);
+}
 
-        mixer -> use();
-        // mixer -> set(color, ssdo);
-        float alpha = ssdo_alpha / (1 + movement * 300);
-        mixer -> set(color, out_a, alpha);
-        
-        glDrawArrays(GL_TRIANGLES, 0, 6);
-        glBindFramebuffer(GL_FRAMEBUFFER, 0);
-        CheckGLError();
-    };
-    
-    std::swap(out_a, out_b);
-    std::swap(buffer3, buffer4);
+void Scene::finish_programs() {
+    wait_for_programs = true;
+    auto begin = std::chrono::steady_clock::now();
+    int pending = ProgramRegistry::pending();
+    try {
+        ProgramRegistry::finish_all();
+    } catch (std::string msg) {
+        warn(2, "[ERROR] Fail to load shader program: %s", msg.c_str());
+        exit(1);
+    }
+    if(pending) {
+        printf("Scene: waited %.1f ms for %d programs\n",
+               std::chrono::duration <float, std::milli> (std::chrono::steady_clock::now() - begin).count(), pending);
+    }
+    static int reported = 0;
+    if(ProgramRegistry::compiled() == reported) return;
+    reported = ProgramRegistry::compiled();
+    printf("Scene: %d forward, %d G-buffer, %d lighting and %d SSDO variants, %d programs, %.1f ms compiling\n",
+           geometry_shaders[0].size(), geometry_shaders[1].size(), lighting.size(),
+           ssdo_shaders.size() + ssdo_compute.size(), ProgramRegistry::compiled(), ProgramRegistry::compile_ms());
 }
 
-void Scene::render_depth_buffer() {
+void Scene::reset_history() {
+    first = 1;
+    upsample_frame = -1;
+    history_start = frame;
+}
+
+void Scene::render_depth_buffer(int i) {
     while(light_info.size() > depth_map.size()) {
         depth_map.push_back(0);
-        auto &i = depth_map.back();
-        glGenTextures(1, &i);  
-        glBindTexture(GL_TEXTURE_2D, i);
+        auto &tex = depth_map.back();
+        glGenTextures(1, &tex);  
+        glBindTexture(GL_TEXTURE_2D, tex);
         glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT, 
                     depth_map_width, depth_map_height, 0, GL_DEPTH_COMPONENT, GL_FLOAT, NULL);
         glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
@@ -301,37 +526,35 @@ void Scene::render_depth_buffer() {
         glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);  
     }
 
-    for(int i = 0; i < (int)light_info.size(); ++i) {
-        auto &light = light_info[i];
-        glViewport(0, 0, depth_map_width, depth_map_height);
-        glBindFramebuffer(GL_FRAMEBUFFER, depth_buffer);
-        glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, depth_map[i], 0);
-        glDrawBuffer(GL_NONE);
-        glReadBuffer(GL_NONE);
-        CheckGLError();
+    auto &light = light_info[i];
+    glViewport(0, 0, depth_map_width, depth_map_height);
+    glBindFramebuffer(GL_FRAMEBUFFER, depth_buffer);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, depth_map[i], 0);
+    glDrawBuffer(GL_NONE);
+    glReadBuffer(GL_NONE);
+    CheckGLError();
 
-        glClear(GL_DEPTH_BUFFER_BIT);
-        CheckGLError();
-        glEnable(GL_DEPTH_TEST);
-        CheckGLError();
-        glDepthFunc(GL_LESS);
-        CheckGLError();
-        depth_shader -> use();
-        auto vp = light.vp();
-        for(auto &[name, mesh]: meshes) {
-            if(_model.count(name)) {
-                for(auto model: _model[name]) {
-                    depth_shader ->set_transform(vp * model);
-                    mesh->draw_depth();
-                }
-            } else {
-                depth_shader -> set_transform(vp);
+    glClear(GL_DEPTH_BUFFER_BIT);
+    CheckGLError();
+    glEnable(GL_DEPTH_TEST);
+    CheckGLError();
+    glDepthFunc(GL_LESS);
+    CheckGLError();
+    depth_shader -> use();
+    auto vp = light.vp();
+    for(auto &[name, mesh]: meshes) {
+        if(_model.count(name)) {
+            for(auto model: _model[name]) {
+                depth_shader ->set_transform(vp * model);
                 mesh->draw_depth();
             }
+        } else {
+            depth_shader -> set_transform(vp);
+            mesh->draw_depth();
         }
-        glBindFramebuffer(GL_FRAMEBUFFER, 0);
-        CheckGLError();
     }
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    CheckGLError();
 }
 
 
@@ -344,6 +567,16 @@ struct MeshInfo {
     }
 };
 
+void Scene::set_ground(const GroundMaterial &ground) {
+    for(auto &[name, mesh]: meshes) if(name == "ground") {
+        for(auto m: mesh->mtl->materials) {
+            m->roughness = ground.roughness;
+            m->metallic = ground.metallic;
+            m->Kd = ground.color;
+        }
+    }
+}
+
 void Scene::load(Path path) {
     int type = 0;
     printf("Scene: Load from %s\n", path.u8string().c_str());
@@ -363,7 +596,7 @@ void Scene::load(Path path) {
             }
             stk.pop();
         }
-        throw std::string("Format error") + str;
+        throw std::string("Format error") + (str ? str : "");
     };
     while(std::fgets(buf, BUFFLEN, f) != nullptr) {
         size_t len = strlen(buf);
@@ -398,8 +631,13 @@ void Scene::load(Path path) {
         } else if(str_equal(pos, "light")) {
             stk.push(std::make_pair(new LightInfo, 1));
         } else if(str_equal(pos, "camera")) {
-            if(stk.empty() || stk.top().second != 1) fmte();
-            stk.push(std::make_pair(&(((LightInfo*)stk.top().first) -> camera), 2));
+            // outside of a light it is the viewpoint
+            if(stk.empty()) {
+                view = Camera();
+                stk.push(std::make_pair(&*view, 2));
+            } else if(stk.top().second == 1) {
+                stk.push(std::make_pair(&(((LightInfo*)stk.top().first) -> camera), 2));
+            } else fmte();
         } else if(str_equal(pos, "pos")) {
             if(stk.empty()) fmte();
             pos = nspace(pos + 3);
@@ -1,10 +1,55 @@
 #pragma once
 #include "common.hpp"
 #include <map>
+#include <optional>
 #include <string>
 #include "mesh.hpp"
 #include "shader.hpp"
 #include "camera.hpp"
+#include "render_graph.hpp"
+#include "gpu_scene.hpp"
+#include "ring_buffer.hpp"
+
+// Material of the mesh named "ground", edited from the UI; the path tracer renders the defaults
+struct GroundMaterial {
+    float roughness = 0.1f;
+    float metallic = 0.97f;
+    glm::vec3 color = glm::vec3(1);
+};
+
+// Per-frame render options, edited from the UI
+struct RenderConfig {
+    bool deferred = true; // deferred direct lighting, false for the forward path
+    int shadow_filter = 1; // 0: one shadow map tap, 1: 7x7 PCF
+    bool gpu_driven = false;  // G-buffer from one indirect multi-draw, needs GL 4.3
+    bool gpu_culling = true;  // frustum culling of the indirect commands in a compute pass
+    int ssdo_spp = 16;    // SSDO samples per pixel, at most Scene::max_ssdo_spp
+    float ssdo_radius = 2.f;      // world-space upper bound of the sample radius
+    float ssdo_radius_px = 300.f; // screen-space footprint of the radius, 0 for a fixed radius
+    int ssdo_scale = 1;   // SSDO and denoiser resolution divider: 1, 2 or 4
+    bool ssdo_hiz = false; // trace samples through the min-depth pyramid (experimental, slower), false tests end points
+    bool ssdo_compute = false; // compute shader SSDO when the context has GL 4.3, samples within 8 pixels
+    bool atrous = false;    // edge-aware a-trous passes after the temporal blend instead of the 13x13 box loop in it
+    int denoise_passes = 2; // a-trous passes after the temporal blend, at most Scene::max_denoise_passes
+    bool fused_composite = true; // last a-trous pass also mixes and tonemaps, at full SSDO resolution
+    // render below the window size to hold target_ms of GPU time, jittered and temporally upsampled
+    bool dynamic_resolution = false;
+    float target_ms = 16.6f;
+    float min_render_scale = 0.5f, max_render_scale = 1.f;
+};
+
+// Internal formats of the render targets
+struct GBufferFormats {
+    GLenum depth = GL_DEPTH_COMPONENT32F;
+    GLenum normal = GL_RG16;              // octahedral encoding, needs two channels
+    GLenum color = GL_R11F_G11F_B10F;     // lit HDR radiance
+    GLenum albedo = GL_SRGB8_ALPHA8;      // linear albedo, sRGB encoded on write so dark values keep precision
+    GLenum material = GL_RGBA16;          // the material id takes 16 bits
+    GLenum ssdo = GL_RGBA16F;             // raw SSDO, same as the a-trous targets so they can share memory
+    GLenum indirect = GL_R11F_G11F_B10F;  // denoised SSDO upsampled to full resolution
+    GLenum composite = GL_RGBA8;          // tonemapped frame before temporal upsampling
+    GLenum upsampled = GL_RGBA16F;        // output resolution history, alpha holds the sample weight
+};
 
 class Scene {
 public:
@@ -17,20 +62,66 @@ public:
     GLuint depth_buffer;
     std::vector <GLuint> depth_map;
 
-    int width, height;
-    // Geometry Buffer for first pass
-    GLuint buffer, depth, normal, color;
-    GLuint buffer2, ssdo, depth2;
-    GLuint buffer3, out_a, buffer4, out_b; // for denoiser
-    int first;
+    int width, height; // framebuffer size
+    // dynamic resolution, the G-buffer and SSDO passes run at render_width x render_height
+    int render_width, render_height;
+    float render_scale;   // render size / framebuffer size
+    float gpu_ms;         // GPU time of frame gpu_frame, the newest one measured
+    int gpu_frame;
+    int upsample_frame;   // last frame that wrote the upsampler history
+    glm::mat4 prev_output_vp; // unjittered view-projection of that frame
+    void update_render_scale();
+
+    // passes are declared every frame, all render targets come from the graph's pool
+    RenderGraph graph;
+    GpuStats stats; // every graph pass, and whatever the caller times after render
+    RingBuffer uploads; // streamed per-frame data, a region per frame in flight
+    glm::ivec3 target_size; // render size and SSDO scale of the last frame
+    static constexpr int max_denoise_passes = 5;
+    glm::mat4 prev_vp;     // view-projection of the denoiser history
+    int ssdo_scale;        // SSDO and denoiser resolution divider
+    GLuint hiz_buffer;     // levels of the min-depth pyramid are bound one by one
+    int hiz_levels;
+    GLuint blit_buffer;    // read side of copies to the window
+    int first, frame;
+    int history_start; // frame the temporal history restarted in, the sampling patterns count from it
+    bool ssdo_waiting; // frames went out without SSDO while its program linked
+    bool wait_for_programs; // set by finish_programs, no placeholder frames from then on
+
+    // low-discrepancy SSDO sampling
+    static constexpr int max_ssdo_spp = 64, noise_size = 64;
+    GLuint sample_seq, blue_noise;
 
     GLuint rec_vao, rec_vbo;
-    std::unique_ptr <Denoiser> denoiser;
+    // picked per frame by the lights, shadow maps and SSDO sample count
+    ShaderVariants <DeferredLighting> lighting{"deferred lighting"};
+    ShaderVariants <ScreenSSDO> ssdo_shaders{"SSDO"};
+    ShaderVariants <ScreenSSDO> ssdo_compute{"compute SSDO"};
+    bool has_ssdo_compute = false; // GL 4.3 and an image format for the SSDO target
+    // hits and lookups of the compute SSDO tile, one buffer per frame parity, read once its fence passed
+    GLuint tile_counters[2] = {0, 0};
+    GLsync tile_fences[2] = {nullptr, nullptr};
+    float ssdo_tile_hits = -1; // hit rate of the newest compute SSDO frame read back, -1 before one
+    std::unique_ptr <Denoiser> denoiser, box_denoiser;
+    std::unique_ptr <AtrousFilter> atrous_filter;
+    std::unique_ptr <AtrousFilter> atrous_composite; // last pass fused with the mixer
+    std::unique_ptr <Downsampler> downsampler;
+    std::unique_ptr <HiZBuilder> hiz_builder;
+    std::unique_ptr <Upsampler> upsampler;
     std::unique_ptr <Mixer> mixer;
+    std::unique_ptr <TemporalUpsampler> temporal_upsampler;
 
+    // forward, G-buffer only; picked per material, the forward ones also by the lights
+    ShaderVariants <SSDO> geometry_shaders[2] = {ShaderVariants <SSDO> ("forward geometry"), ShaderVariants <SSDO> ("G-buffer")};
+    std::vector <GLuint> shadow_maps(); // one per light, empty until activate_shadow has rendered them
     std::unique_ptr <DepthShader> depth_shader;
+    std::unique_ptr <GpuScene> gpu_scene; // built the first time gpu_driven is on
     std::vector <LightInfo> light_info;
-    void render_depth_buffer();
+    std::optional <Camera> view; // top-level camera block of the .scene
+    RenderConfig config;
+    void render_depth_buffer(int light); // allocates missing shadow maps, then renders one
+    GBufferFormats formats;
+    void draw_rec(); // full-screen quad
     Scene();
     ~Scene();
     template <class ... T> void load_mesh(std::string name, T ... args) {
@@ -38,10 +129,18 @@ public:
         // meshes.back().second->apply_transform(meshes.back().second->bound().to_local());
     }
     void load(Path path);
+    void set_ground(const GroundMaterial &ground);
     std::map <std::string, std::vector<glm::mat4>> &model();
     void init_draw(int width, int height);
+    // makes the variants config needs with the current lights and materials, their programs compile in the background
+    void prepare_variants(const RenderConfig &config);
+    // waits for every program submitted so far, and variants made later are waited for at first use;
+    // for runs that must not have placeholder frames (only the SSDO pass draws one)
+    void finish_programs();
+    // drop the temporal history, the next frames render as if they were the first
+    void reset_history();
     void activate_shadow();
     void update_light(std::vector <LightInfo> info);
-    void render(GLFWwindow *window, glm::mat4 vp, glm::vec3 camera, float time, float denoise_alpha = 0.02f, float movement = 0.f, float ssdo_alpha = 1.f);
+    void render(int framebuffer_width, int framebuffer_height, glm::mat4 vp, glm::vec3 camera, float denoise_alpha = 0.02f, float ssdo_alpha = 1.f);
 };
 
@@ -1,20 +1,46 @@
 #include "shader.hpp"
+#include "program_cache.hpp"
+#include <chrono>
 #include<random>
-GLuint load_shader_from_text(const char *source, GLenum type) {
+// compiles without asking for the result, the driver may still be working on return
+static GLuint submit_shader(const char *source, GLenum type, const char *header) {
     GLuint shader = glCreateShader(type);
-    const char *sources[] = {source};
-    glShaderSource(shader, 1, sources, NULL);
+    // the header goes first, it carries #version and defines for the source
+    const char *sources[] = {header, source};
+    if(header) glShaderSource(shader, 2, sources, NULL);
+    else glShaderSource(shader, 1, sources + 1, NULL);
     glCompileShader(shader);
-
+    return shader;
+}
+// info log of a failed compile, empty when it succeeded
+static std::string shader_error(GLuint shader) {
     GLint is_compiled = 0;
     glGetShaderiv(shader, GL_COMPILE_STATUS, &is_compiled);
-    if (is_compiled == GL_FALSE)
+    if (is_compiled != GL_FALSE) return "";
+    GLint max_length = 0;
+    glGetShaderiv(shader, GL_INFO_LOG_LENGTH, &max_length);
+    // The maxLength includes the NULL character
+    std::string error_log; error_log.resize(max_length);
+    glGetShaderInfoLog(shader, max_length, &max_length, &error_log[0]);
+    return error_log;
+}
+static GLuint submit_program(const GLuint *shaders, uint32_t shader_count) {
+    GLuint program = glCreateProgram();
+    // lets ProgramCache read the binary back
+    if (GLEW_VERSION_4_1 || GLEW_ARB_get_program_binary)
+      glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
+    for (uint32_t i = 0; i < shader_count; i++) {
+      glAttachShader(program, shaders[i]);
+    }
+    glLinkProgram(program);
+    return program;
+}
+
+GLuint load_shader_from_text(const char *source, GLenum type, const char *header) {
+    GLuint shader = submit_shader(source, type, header);
+    auto error_log = shader_error(shader);
+    if (!error_log.empty())
     {
-        GLint max_length = 0;
-        glGetShaderiv(shader, GL_INFO_LOG_LENGTH, &max_length);
-        // The maxLength includes the NULL character
-        std::string error_log; error_log.resize(max_length);
-        glGetShaderInfoLog(shader, max_length, &max_length, &error_log[0]);
         glDeleteShader(shader); // Don't leak the shader.
         throw error_log;
     }
@@ -27,11 +53,7 @@ GLuint load_shader_from_path(const char *path, GLenum type) {
 }
 
 GLuint link_program(GLuint *shaders, uint32_t shader_count) {
-    GLuint program = glCreateProgram();
-    for (uint32_t i = 0; i < shader_count; i++) {
-      glAttachShader(program, shaders[i]);
-    }
-    glLinkProgram(program);
+  GLuint program = submit_program(shaders, shader_count);
 
   int success;
   // check for linking errors
@@ -46,34 +68,165 @@ GLuint link_program(GLuint *shaders, uint32_t shader_count) {
   }
   return program;
 }
-GLuint prepare_shader(const char *vert, const char *frag)
+GLuint prepare_shader(const char *vert, const char *frag, const char *frag_header)
 {
     GLuint shaders[2];
     shaders[0] = load_shader_from_text(vert, GL_VERTEX_SHADER);
     CheckGLError();
-    shaders[1] = load_shader_from_text(frag, GL_FRAGMENT_SHADER);
+    shaders[1] = load_shader_from_text(frag, GL_FRAGMENT_SHADER, frag_header);
     CheckGLError();
     return link_program(shaders, 2);
 }
+GLuint prepare_compute_shader(const char *comp, const char *header)
+{
+    GLuint shader = load_shader_from_text(comp, GL_COMPUTE_SHADER, header);
+    CheckGLError();
+    return link_program(&shader, 1);
+}
+
+
+
+Program::Program(GLuint id): id(id), linked(true) {}
+Program::Program(GLuint id, std::vector <GLuint> shaders, std::string key, float submit_ms)
+    : id(id), shaders(shaders), key(key), submitted(std::chrono::steady_clock::now()), submit_ms(submit_ms), linked(false) {}
+Program::~Program() {
+    for(auto shader: shaders) glDeleteShader(shader);
+    glDeleteProgram(id);
+}
+bool Program::ready() const {
+    if(linked) return true;
+    if(!ProgramRegistry::parallel()) return true;
+    GLint done = GL_FALSE;
+    glGetProgramiv(id, GL_COMPLETION_STATUS_KHR, &done);
+    return done;
+}
+void Program::finish() {
+    if(linked) return;
+    linked = true;
+    auto begin = std::chrono::steady_clock::now();
+    std::string error_log;
+    for(auto shader: shaders) error_log += shader_error(shader);
+    GLint success = GL_FALSE;
+    glGetProgramiv(id, GL_LINK_STATUS, &success);
+    if(!success && error_log.empty()) {
+        GLint max_length = 0;
+        glGetProgramiv(id, GL_INFO_LOG_LENGTH, &max_length);
+        error_log.resize(max_length);
+        glGetProgramInfoLog(id, max_length, &max_length, &error_log[0]);
+    }
+    for(auto shader: shaders) {
+        glDetachShader(id, shader);
+        glDeleteShader(shader);
+    }
+    shaders.clear();
+    if(!success) throw error_log;
+    auto end = std::chrono::steady_clock::now();
+    // the cache compares against what the program cost this thread, not the time it spent in the background
+    float wait_ms = std::chrono::duration <float, std::milli> (end - begin).count();
+    printf("ProgramRegistry: program %u ready %.1f ms after submission, %.1f ms submitting and %.1f ms waiting\n", id,
+           std::chrono::duration <float, std::milli> (end - submitted).count(), submit_ms, wait_ms);
+    ProgramRegistry::_compile_ms += submit_ms + wait_ms;
+    ProgramCache::store(key, id, submit_ms + wait_ms);
+}
+
+std::map <std::string, std::weak_ptr <Program>> ProgramRegistry::programs;
+int ProgramRegistry::_compiled = 0, ProgramRegistry::_shared = 0;
+float ProgramRegistry::_compile_ms = 0;
+
+bool ProgramRegistry::parallel() {
+    static int on = -1;
+    if(on < 0) {
+        on = 0;
+        // let the driver use as many compiler threads as it likes
+        if(GLEW_KHR_parallel_shader_compile) glMaxShaderCompilerThreadsKHR(0xffffffffu), on = 1;
+        else if(GLEW_ARB_parallel_shader_compile) glMaxShaderCompilerThreadsARB(0xffffffffu), on = 1;
+        printf("ProgramRegistry: parallel shader compile %s\n", on ? "on" : "not supported");
+    }
+    return on;
+}
 
+std::shared_ptr <Program> ProgramRegistry::find(const std::string &key, const std::vector <Stage> &stages) {
+    auto &slot = programs[key];
+    if(auto program = slot.lock()) {
+        _shared++;
+        return program;
+    }
+    std::shared_ptr <Program> program;
+    if(GLuint id = ProgramCache::load(key)) {
+        program = std::make_shared <Program> (id);
+    } else {
+        parallel();
+        auto begin = std::chrono::steady_clock::now();
+        std::vector <GLuint> shaders;
+        for(auto &stage: stages) shaders.push_back(submit_shader(stage.source, stage.type, stage.header));
+        GLuint handle = submit_program(shaders.data(), shaders.size());
+        float ms = std::chrono::duration <float, std::milli> (std::chrono::steady_clock::now() - begin).count();
+        program = std::make_shared <Program> (handle, shaders, key, ms);
+    }
+    slot = program;
+    _compiled++;
+    return program;
+}
 
+std::shared_ptr <Program> ProgramRegistry::get(const char *vert, const char *frag, const char *frag_header) {
+    // the parts are told apart by a character no GLSL source has
+    std::string key = std::string("v") + vert + '\1' + frag + '\1' + (frag_header ? frag_header : "");
+    return find(key, {{GL_VERTEX_SHADER, vert, nullptr}, {GL_FRAGMENT_SHADER, frag, frag_header}});
+}
 
-Shader::Shader(const char *vert, const char *frag)
-{
-    _program = prepare_shader(vert, frag);
+std::shared_ptr <Program> ProgramRegistry::get_compute(const char *comp, const char *header) {
+    std::string key = std::string("c") + comp + '\1' + (header ? header : "");
+    return find(key, {{GL_COMPUTE_SHADER, comp, header}});
+}
+
+void ProgramRegistry::finish_all() {
+    for(auto &[key, slot]: programs) {
+        if(auto program = slot.lock()) program->finish();
+    }
+}
+
+int ProgramRegistry::pending() {
+    int n = 0;
+    for(auto &[key, slot]: programs) {
+        auto program = slot.lock();
+        if(program && !program->ready()) ++n;
+    }
+    return n;
+}
+
+Shader::Shader(const char *vert, const char *frag, const char *frag_header)
+    : _program(ProgramRegistry::get(vert, frag, frag_header)), located(false) {
+    printf("Shader loaded\n");
+}
+Shader::Shader(std::shared_ptr <Program> program): _program(program), located(false) {
     printf("Shader loaded\n");
 }
+bool Shader::ready() {
+    if(!located && _program->ready()) finish();
+    return located;
+}
+void Shader::finish() {
+    if(located) return;
+    try {
+        _program->finish();
+    } catch (std::string msg) {
+        warn(2, "[ERROR] Fail to load shader program: %s", msg.c_str());
+        exit(1);
+    }
+    locate();
+    located = true;
+}
 void Shader::use() {
-    glUseProgram(_program);
+    finish();
+    glUseProgram(_program->id);
 }
 
 GLint Shader::loc(const char *name) {
-    return glGetUniformLocation(_program, name);
+    return glGetUniformLocation(_program->id, name);
 }
 
 Shader::~Shader() {
     printf("shader destroyed\n");
-    glDeleteShader(_program);
 }
 void Shader::init_uniform(std::vector <std::string> names) {
     for(auto &name: names) uniforms[name] = loc(name.c_str());
@@ -222,7 +375,8 @@ void main() {
 
 }
 
-PhongShader::PhongShader() : Shader(Phong::vertex_shader_text, Phong::fragment_shader_text) {
+PhongShader::PhongShader() : Shader(Phong::vertex_shader_text, Phong::fragment_shader_text) {}
+void PhongShader::locate() {
     model = loc("model");
     vp = loc("vp");
     Ka = loc("m_ka");
@@ -341,7 +495,8 @@ void main() {
 
 }
 
-DepthShader::DepthShader(): Shader(Depth::vertex_shader_text, Depth::fragment_shader_text) {
+DepthShader::DepthShader(): Shader(Depth::vertex_shader_text, Depth::fragment_shader_text) {}
+void DepthShader::locate() {
     trans = loc("transform");
 }
 void DepthShader::set_transform(glm::mat4 transform) {
@@ -557,7 +712,8 @@ void main() {
 )";
 }
 
-PBRShader::PBRShader(): Shader(PBR::vertex_shader_text, PBR::fragment_shader_text) {
+PBRShader::PBRShader(): Shader(PBR::vertex_shader_text, PBR::fragment_shader_text) {}
+void PBRShader::locate() {
     model = loc("model");
     vp = loc("vp");
     has_tex = loc("has_tex");
@@ -673,6 +829,153 @@ void PBRShader::set_depth(std::vector <GLuint> map) {
     }
 }
 
+// Octahedral normal encoding into [0, 1]^2, spliced into the shaders that
+// write or read G-buffer normals
+#define NORMAL_CODEC \
+    "vec2 encode_normal(vec3 n) {\n"                                                                 \
+    "    n /= abs(n.x) + abs(n.y) + abs(n.z);\n"                                                     \
+    "    vec2 e = n.z >= 0 ? n.xy : (1 - abs(n.yx)) * vec2(n.x >= 0 ? 1 : -1, n.y >= 0 ? 1 : -1);\n" \
+    "    return e * 0.5 + 0.5;\n"                                                                    \
+    "}\n"                                                                                            \
+    "vec3 decode_normal(vec2 e) {\n"                                                                 \
+    "    e = e * 2 - 1;\n"                                                                           \
+    "    vec3 n = vec3(e, 1 - abs(e.x) - abs(e.y));\n"                                               \
+    "    float t = max(-n.z, 0);\n"                                                                  \
+    "    n.x += n.x >= 0 ? -t : t;\n"                                                                \
+    "    n.y += n.y >= 0 ? -t : t;\n"                                                                \
+    "    return normalize(n);\n"                                                                     \
+    "}\n"
+
+// Light uniforms, GGX / Schlick / Smith BRDF and the shadowed light term L(),
+// spliced into the forward and the deferred lighting shaders. LIGHT_COUNT,
+// SHADOW and SHADOW_FILTER come from the header, L() reads the camera uniform.
+#define LIGHTING \
+    "#if LIGHT_COUNT > 0\n"                                                                                           \
+    "uniform vec3 light_position[LIGHT_COUNT];\n"                                                                     \
+    "uniform vec3 light_intense[LIGHT_COUNT];\n"                                                                      \
+    "uniform vec3 light_direction[LIGHT_COUNT];\n"                                                                    \
+    "uniform mat4 light_vp[LIGHT_COUNT];\n"                                                                           \
+    "uniform sampler2D depth_map[LIGHT_COUNT];\n"                                                                     \
+    "#endif\n"                                                                                                        \
+    "\n"                                                                                                              \
+    "float PI = 3.14159265;\n"                                                                                        \
+    "vec3 fresnel(vec3 v, vec3 h, vec3 F0) {\n"                                                                       \
+    "    return F0 + (vec3(1.0) - F0) * vec3(pow(clamp(1.0 - dot(v, h), 0.0, 1.0), 5.0));\n"                          \
+    "}\n"                                                                                                             \
+    "float D_GGX(vec3 n, vec3 h, float roughness) {\n"                                                                \
+    "    float a      = roughness * roughness;\n"                                                                     \
+    "    float a2     = a * a;\n"                                                                                     \
+    "    float NdotH  = max(dot(n, h), 0.0);\n"                                                                       \
+    "    float NdotH2 = NdotH*NdotH;\n"                                                                               \
+    "\n"                                                                                                              \
+    "    float num   = a2;\n"                                                                                         \
+    "    float denom = (NdotH2 * (a2 - 1.0) + 1.0);\n"                                                                \
+    "    denom = PI * denom * denom;\n"                                                                               \
+    "\n"                                                                                                              \
+    "    return num / denom;\n"                                                                                       \
+    "}\n"                                                                                                             \
+    "\n"                                                                                                              \
+    "float G_SchlickGGX(float NdotV, float roughness) {\n"                                                            \
+    "    float r = (roughness + 1.0);\n"                                                                              \
+    "    float k = (r*r) / 8.0;\n"                                                                                    \
+    "\n"                                                                                                              \
+    "    float num   = NdotV;\n"                                                                                      \
+    "    float denom = NdotV * (1.0 - k) + k;\n"                                                                      \
+    "\n"                                                                                                              \
+    "    return num / denom;\n"                                                                                       \
+    "}\n"                                                                                                             \
+    "float G_Smith(vec3 n, vec3 v, vec3 i, float roughness) {\n"                                                      \
+    "    return G_SchlickGGX(max(0., dot(n, v)), roughness) * G_SchlickGGX(max(0., dot(n,i)), roughness);\n"          \
+    "}\n"                                                                                                             \
+    "\n"                                                                                                              \
+    "vec3 L(vec3 light_position, vec3 light_direction, vec3 light_intense, mat4 light_vp,\n"                          \
+    "       int light_type, sampler2D depth_map, vec3 n, vec3 pos, vec3 albedo, float metallic, float roughness) {\n" \
+    "\n"                                                                                                              \
+    "    vec3 i = light_position - pos;\n"                                                                            \
+    "    float r = dot(i, i);\n"                                                                                      \
+    "    if(light_type == 2) i = -light_direction;\n"                                                                 \
+    "    i = normalize(i);\n"                                                                                         \
+    "\n"                                                                                                              \
+    "    vec3 v = normalize(camera - pos);\n"                                                                         \
+    "    vec3 h = normalize(i + v);\n"                                                                                \
+    "\n"                                                                                                              \
+    "    float theta = dot(i, n);\n"                                                                                  \
+    "    if(theta <= 0) return vec3(0);\n"                                                                            \
+    "\n"                                                                                                              \
+    "    float vis = 1;\n"                                                                                            \
+    "#if SHADOW\n"                                                                                                    \
+    "    vec4 lpos_w = light_vp * vec4(pos, 1);\n"                                                                    \
+    "    vec3 lpos = (lpos_w.xyz / lpos_w.w + vec3(1)) / 2;\n"                                                        \
+    "    if(lpos.x >= 0 && lpos.x < 1 && lpos.y >= 0 && lpos.y < 1 && lpos.z >= 0 && lpos.z < 1) {\n"                 \
+    "        vec2 step = 1.0 / textureSize(depth_map, 0);\n"                                                          \
+    "        int L = 3;\n"                                                                                            \
+    "        float w = 0, s = 0;\n"                                                                                   \
+    "        float bias = max((1.0 - dot(n, i)) * sqrt(r), 1) * 1e-4;\n"                                              \
+    "        if(lpos.z <= texture(depth_map, lpos.xy).r + bias) {\n"                                                  \
+    "            vis = 1;\n"                                                                                          \
+    "        } else {\n"                                                                                              \
+    "#if SHADOW_FILTER == 0\n"                                                                                        \
+    "            vis = 0;\n"                                                                                          \
+    "#else\n"                                                                                                         \
+    "            for(int i = -L; i <= L; ++i) {\n"                                                                    \
+    "                for(int j = -L; j <= L; ++j) {\n"                                                                \
+    "                    vec2 p = lpos.xy + vec2(step.x * i, step.y * j);\n"                                          \
+    "                    if(p.x < 0 || p.x >= 1 || p.y < 0 || p.y >= 1) continue;\n"                                  \
+    "                    float d = sqrt(i * i + j * j);\n"                                                            \
+    "                    float wi = 1 / (1 + d * d);\n"                                                               \
+    "                    w += wi;\n"                                                                                  \
+    "                    if(lpos.z <= texture(depth_map, p).r + bias * (1 + d)) {\n"                                  \
+    "                        s += wi;\n"                                                                              \
+    "                    }\n"                                                                                         \
+    "                }\n"                                                                                             \
+    "            }\n"                                                                                                 \
+    "            vis = 1.0 * s / w;\n"                                                                                \
+    "#endif\n"                                                                                                        \
+    "        }\n"                                                                                                     \
+    "    }\n"                                                                                                         \
+    "#endif\n"                                                                                                        \
+    "    if(vis <= 0) return vec3(0);\n"                                                                              \
+    "\n"                                                                                                              \
+    "    // cone light\n"                                                                                             \
+    "    if(light_type == 1 && dot(-light_direction, i) < 0.7) {\n"                                                   \
+    "        return vec3(0);\n"                                                                                       \
+    "    }\n"                                                                                                         \
+    "    // point light\n"                                                                                            \
+    "    vec3 radiance = light_intense / r;\n"                                                                        \
+    "\n"                                                                                                              \
+    "    if(light_type == 2) {\n"                                                                                     \
+    "        // directional light\n"                                                                                  \
+    "        radiance = light_intense;\n"                                                                             \
+    "    }\n"                                                                                                         \
+    "\n"                                                                                                              \
+    "    vec3 F0 = vec3(0.04);\n"                                                                                     \
+    "    F0      = mix(F0, albedo, metallic);\n"                                                                      \
+    "\n"                                                                                                              \
+    "    vec3 F =  fresnel(v, h, F0);\n"                                                                              \
+    "    float D = D_GGX(n, h, roughness);\n"                                                                         \
+    "    float G = G_Smith(n, v, i, roughness);\n"                                                                    \
+    "\n"                                                                                                              \
+    "    vec3 kD = (vec3(1.0) - F) * (1.0 - metallic);\n"                                                             \
+    "    vec3 diffuse = kD * albedo / PI * radiance * theta;\n"                                                       \
+    "\n"                                                                                                              \
+    "    vec3 specular = (F * D * G) / (4.0 * max(dot(n, v), 0.0) * max(dot(n, i), 0.0) + 0.0001);\n"                 \
+    "    specular = specular * radiance * theta;\n"                                                                   \
+    "\n"                                                                                                              \
+    "    return vis * (specular + diffuse);\n"                                                                        \
+    "}\n"
+
+static const char *vanila_vert = R"(
+#version 330 core
+layout(location = 0) in vec3 position;
+
+out vec3 pos;
+
+void main() {
+    gl_Position = vec4(position, 1.);
+    pos = position;
+}
+)";
+
 namespace SSDO_text { 
 static const char *vert = R"(
 #version 330 core
@@ -699,7 +1002,6 @@ void main() {
 )";
 
 static const char *frag1 = R"(
-#version 330 core
 // #extension GL_ARB_explicit_uniform_location : enable
 
 in vec2 o_uv;
@@ -710,132 +1012,25 @@ uniform sampler2D tex;
 uniform sampler2D tex_norm;
 uniform vec3 tex_scale;
 uniform vec3 tex_norm_scale;
-uniform int has_tex;
-uniform int has_tex_norm;
 uniform vec3 camera;
-uniform int light_cnt;
-uniform vec3 light_position[10];
-uniform vec3 light_intense[10];
-uniform vec3 light_direction[10];
-uniform mat4 light_vp[10];
-uniform int light_type[10];
-uniform sampler2D depth_map[10];
-uniform int has_depth_map;
 float F0; // constant for fresnel term
 // material parameters
 uniform vec3  m_albedo;
 uniform float m_metallic;
 uniform float m_roughness;
 uniform float m_ao;
+uniform int m_id;
 uniform float gtime;
 
 layout(location = 0) out vec3 frag_color;
-layout(location = 1) out vec3 frag_normal;
+layout(location = 1) out vec2 frag_normal; // octahedral
+layout(location = 2) out vec3 frag_albedo;
+layout(location = 3) out vec4 frag_material;
+)" NORMAL_CODEC LIGHTING R"(
 
-float PI = 3.14159265;
 vec2 scale_uv(vec2 uv, vec3 scale) {
     return vec2(uv.x / scale.x, uv.y / scale.y);
 }
-vec3 fresnel(vec3 v, vec3 h, vec3 F0) {
-    return F0 + (vec3(1.0) - F0) * vec3(pow(clamp(1.0 - dot(v, h), 0.0, 1.0), 5.0));
-}
-float D_GGX(vec3 n, vec3 h, float roughness) {
-    float a      = roughness * roughness;
-    float a2     = a * a;
-    float NdotH  = max(dot(n, h), 0.0);
-    float NdotH2 = NdotH*NdotH;
-    
-    float num   = a2;
-    float denom = (NdotH2 * (a2 - 1.0) + 1.0);
-    denom = PI * denom * denom;
-    
-    return num / denom;
-}
-
-float G_SchlickGGX(float NdotV, float roughness) {
-    float r = (roughness + 1.0);
-    float k = (r*r) / 8.0;
-
-    float num   = NdotV;
-    float denom = NdotV * (1.0 - k) + k;
-    
-    return num / denom;
-}
-float G_Smith(vec3 n, vec3 v, vec3 i, float roughness) {
-    return G_SchlickGGX(max(0., dot(n, v)), roughness) * G_SchlickGGX(max(0., dot(n,i)), roughness);
-}
-
-vec3 L(vec3 light_position, vec3 light_direction, vec3 light_intense, mat4 light_vp, int light_type, sampler2D depth_map, 
-    vec3 n, vec3 pos, vec3 albedo, float metallic, float roughness) {
-    
-    vec3 i = light_position - pos;
-    float r = dot(i, i);
-    if(light_type == 2) i = -light_direction;
-    i = normalize(i);
-    
-    vec3 v = normalize(camera - pos);
-    vec3 h = normalize(i + v);
-
-    float theta = dot(i, n);
-    if(theta <= 0) return vec3(0);
-    
-    float vis = 1; 
-    if(has_depth_map != 0) {
-        vec4 lpos_w = light_vp * vec4(pos, 1);
-        vec3 lpos = (lpos_w.xyz / lpos_w.w + vec3(1)) / 2;
-        if(lpos.x >= 0 && lpos.x < 1 && lpos.y >= 0 && lpos.y < 1 && lpos.z >= 0 && lpos.z < 1) {
-            vec2 step = 1.0 / textureSize(depth_map, 0);
-            int L = 3;
-            float w = 0, s = 0;
-            float bias = max((1.0 - dot(n, i)) * sqrt(r), 1) * 1e-4; 
-            if(lpos.z <= texture(depth_map, lpos.xy).r + bias) {
-                vis = 1;
-            } else {
-                for(int i = -L; i <= L; ++i) {
-                    for(int j = -L; j <= L; ++j) {
-                        vec2 p = lpos.xy + vec2(step.x * i, step.y * j);
-                        if(p.x < 0 || p.x >= 1 || p.y < 0 || p.y >= 1) continue;
-                        float d = sqrt(i * i + j * j);
-                        float wi = 1 / (1 + d * d);
-                        w += wi;
-                        if(lpos.z <= texture(depth_map, p).r + bias * (1 + d)) {
-                            s += wi;
-                        }
-                    }
-                }
-                vis = 1.0 * s / w;
-            }
-        }
-    }
-    if(vis <= 0) return vec3(0);
- 
-    // cone light
-    if(light_type == 1 && dot(-light_direction, i) < 0.7) {
-        return vec3(0);
-    }
-    // point light
-    vec3 radiance = light_intense / r;
-
-    if(light_type == 2) {
-        // directional light
-        radiance = light_intense;
-    }
-
-    vec3 F0 = vec3(0.04); 
-    F0      = mix(F0, albedo, metallic);
-
-    vec3 F =  fresnel(v, h, F0);
-    float D = D_GGX(n, h, roughness);
-    float G = G_Smith(n, v, i, roughness);
-
-    vec3 kD = (vec3(1.0) - F) * (1.0 - metallic);
-    vec3 diffuse = kD * albedo / PI * radiance * theta;
-    
-    vec3 specular = (F * D * G) / (4.0 * max(dot(n, v), 0.0) * max(dot(n, i), 0.0) + 0.0001);
-    specular = specular * radiance * theta;
-
-    return vis * (specular + diffuse);
-}
 
 void main() {
     vec3 albedo = m_albedo;
@@ -844,79 +1039,173 @@ void main() {
     vec3 normal = o_norm;
     vec3 pos = o_pos;
 
-    if(has_tex == 1) {
-        vec3 color = texture(tex, scale_uv(o_uv, tex_scale)).rgb;
-        albedo = pow(color, vec3(2.2));
-    }
-    if(has_tex_norm == 1) {
-        normal = texture(tex_norm, scale_uv(o_uv, tex_norm_scale)).rgb;
-        normal = normalize(normal * 2 - vec3(1,1,1));
-        vec3 tmp;
-        tmp.y = normal.z;
-        tmp.x = normal.x;
-        tmp.z = normal.y;
-        normal = tmp;
-    }
+#ifdef HAS_TEX
+    albedo = pow(texture(tex, scale_uv(o_uv, tex_scale)).rgb, vec3(2.2));
+#endif
+#ifdef HAS_TEX_NORM
+    normal = texture(tex_norm, scale_uv(o_uv, tex_norm_scale)).rgb;
+    normal = normalize(normal * 2 - vec3(1,1,1)).xzy;
+#endif
     
-    frag_normal = (normal + vec3(1)) / 2;
+    frag_normal = encode_normal(normal);
+    frag_albedo = albedo;
+    frag_material = vec4(metallic, roughness, m_ao, m_id / 65535.);
     
     vec3 color = vec3(0);
-    int i = 0;
-    for(; i < light_cnt; ++i) {
-        color += L(light_position[i], light_direction[i], light_intense[i], light_vp[i], light_type[i], depth_map[i],
-            normal, pos, albedo, metallic, roughness);
-    }
+    // sampler arrays may only be indexed by constant expressions in GLSL 3.30,
+    // LIGHTS has a LIGHT(i, type) for every light, the type folds the branches of L away
+#define LIGHT(i, type) color += L(light_position[i], light_direction[i], light_intense[i], light_vp[i], type, depth_map[i], normal, pos, albedo, metallic, roughness);
+    LIGHTS
+#undef LIGHT
 
     frag_color = color;
 }
 )";
 
-static const char *frag2 = R"(
-#version 330 core
+// G-buffer only, lighting is done by the deferred pass
+static const char *frag_geo = R"(
 // #extension GL_ARB_explicit_uniform_location : enable
 
 in vec2 o_uv;
 in vec3 o_pos;
 in vec3 o_norm;
-
-uniform mat4 vp, vp_inv;
-
 uniform sampler2D tex;
 uniform sampler2D tex_norm;
 uniform vec3 tex_scale;
 uniform vec3 tex_norm_scale;
-uniform int has_tex;
-uniform int has_tex_norm;
-uniform vec3 camera;
-
-uniform int light_cnt;
-uniform vec3 light_position[10];
-uniform vec3 light_intense[10];
-uniform vec3 light_direction[10];
-uniform mat4 light_vp[10];
-uniform int light_type[10];
-
-uniform sampler2D depth_map[10];
-uniform int has_depth_map;
-
-uniform sampler2D geo_depth, geo_normal, geo_color;
-
-float F0; // constant for fresnel term
-
 // material parameters
 uniform vec3  m_albedo;
 uniform float m_metallic;
 uniform float m_roughness;
 uniform float m_ao;
+uniform int m_id;
 
-uniform float gtime;
+layout(location = 1) out vec2 frag_normal; // octahedral
+layout(location = 2) out vec3 frag_albedo;
+layout(location = 3) out vec4 frag_material;
+)" NORMAL_CODEC R"(
+
+vec2 scale_uv(vec2 uv, vec3 scale) {
+    return vec2(uv.x / scale.x, uv.y / scale.y);
+}
+
+void main() {
+    vec3 albedo = m_albedo;
+    float metallic = m_metallic;
+    float roughness = m_roughness;
+    vec3 normal = o_norm;
+
+#ifdef HAS_TEX
+    albedo = pow(texture(tex, scale_uv(o_uv, tex_scale)).rgb, vec3(2.2));
+#endif
+#ifdef HAS_TEX_NORM
+    normal = texture(tex_norm, scale_uv(o_uv, tex_norm_scale)).rgb;
+    normal = normalize(normal * 2 - vec3(1,1,1)).xzy;
+#endif
+    
+    frag_normal = encode_normal(normal);
+    frag_albedo = albedo;
+    frag_material = vec4(metallic, roughness, m_ao, m_id / 65535.);
+}
+)";
 
+// no #version: the fragment and compute variants prepend their own header,
+// COMPUTE selects the compute shader with the shared-memory G-buffer tile;
+// it clamps the sample radius to the apron so the end points stay in the tile
+static const char *frag2 = R"(
+#ifdef COMPUTE
+#define TILE 16
+#define APRON 8
+#define CACHE (TILE + 2 * APRON)
+layout(local_size_x = TILE, local_size_y = TILE) in;
+layout(SSDO_FORMAT) uniform writeonly image2D ssdo_out;
+// G-buffer lookups of the dispatch and those the tile served
+layout(std430, binding = 4) buffer TileCounters { uint tile_hits, tile_lookups; };
+#else
+in vec3 pos;
 // out vec4 frag_color[2];
 out vec4 frag_color;
+#endif
 
-vec2 scale_uv(vec2 uv, vec3 scale) {
-    return vec2(uv.x / scale.x, uv.y / scale.y);
+uniform mat4 vp, vp_inv;
+uniform vec3 camera;
+
+// G-buffer written by the first pass
+uniform sampler2D geo_depth, geo_normal, geo_color, geo_albedo, geo_material;
+
+// low-discrepancy sampling
+uniform sampler2D sample_seq; // Halton points, one texel per sample
+uniform sampler2D blue_noise; // per-pixel rotation of the sequence
+// SSDO_SPP, the samples per pixel, comes from the header
+uniform int frame;
+uniform float rmax;      // world-space sample radius
+uniform float radius_px; // > 0: clamp the radius to this screen-space footprint
+
+// min-depth pyramid of geo_depth, hiz_levels == 0 tests the sample end point only
+uniform sampler2D hiz;
+uniform int hiz_levels;
+
+)" NORMAL_CODEC R"(
+#ifdef COMPUTE
+// depth, normal and radiance of the workgroup's tile plus apron, halves packed
+shared float tile_depth[CACHE * CACHE];
+shared uvec2 tile_normal[CACHE * CACHE];
+shared uvec2 tile_color[CACHE * CACHE];
+shared uint group_hits, group_lookups;
+ivec2 tile_origin;
+uint hits = 0u, lookups = 0u;
+
+void load_tile() {
+    tile_origin = ivec2(gl_WorkGroupID.xy) * TILE - APRON;
+    ivec2 size = textureSize(geo_depth, 0);
+    for(int k = int(gl_LocalInvocationIndex); k < CACHE * CACHE; k += TILE * TILE) {
+        // clamped texels are never looked up, lookups stay on screen
+        ivec2 t = clamp(tile_origin + ivec2(k % CACHE, k / CACHE), ivec2(0), size - 1);
+        tile_depth[k] = texelFetch(geo_depth, t, 0).r;
+        vec3 n = decode_normal(texelFetch(geo_normal, t, 0).xy);
+        vec3 c = texture(geo_color, (vec2(t) + 0.5) / vec2(size)).rgb;
+        tile_normal[k] = uvec2(packHalf2x16(n.xy), packHalf2x16(vec2(n.z, 0)));
+        tile_color[k] = uvec2(packHalf2x16(c.xy), packHalf2x16(vec2(c.z, 0)));
+    }
+    memoryBarrierShared();
+    barrier();
+}
+// index into the tile, -1 when uv falls outside of it
+int tile_index(vec2 uv) {
+    ivec2 t = ivec2(floor(uv * vec2(textureSize(geo_depth, 0)))) - tile_origin;
+    ++lookups;
+    if(any(lessThan(t, ivec2(0))) || any(greaterThanEqual(t, ivec2(CACHE)))) return -1;
+    ++hits;
+    return t.y * CACHE + t.x;
+}
+vec3 unpack_vec3(uvec2 v) {
+    return vec3(unpackHalf2x16(v.x), unpackHalf2x16(v.y).x);
+}
+#endif
+
+// G-buffer lookups, served from the tile when the compute variant has it
+float depth_at(vec2 uv) {
+#ifdef COMPUTE
+    int k = tile_index(uv);
+    if(k >= 0) return tile_depth[k];
+#endif
+    return texture(geo_depth, uv).r;
+}
+vec3 normal_at(vec2 uv) {
+#ifdef COMPUTE
+    int k = tile_index(uv);
+    if(k >= 0) return unpack_vec3(tile_normal[k]);
+#endif
+    return decode_normal(texture(geo_normal, uv).xy);
+}
+vec3 color_at(vec2 uv) {
+#ifdef COMPUTE
+    int k = tile_index(uv);
+    if(k >= 0) return unpack_vec3(tile_color[k]);
+#endif
+    return texture(geo_color, uv).rgb;
 }
+
 vec3 decw(vec4 p) {
     return p.xyz / p.w;
 }
@@ -992,19 +1281,10 @@ vec3 L(vec3 light_position, vec3 light_normal, vec3 light_intense, vec3 n, vec3
     return (specular + diffuse) * As;
 }
 
-float random (vec2 uv) {
-    return fract(sin(dot(uv, vec2(12.9898, 78.233))) * 43758.5453123);
-}
-
-int N = 1500;
-vec3 sampleHemisphereCosine(vec3 normal, vec2 seed1, vec2 seed2) {
-    // Generate two random numbers
-    float u1 = random(seed1);
-    float u2 = random(seed2);
-
+vec3 sampleHemisphereCosine(vec3 normal, vec2 u) {
     // Convert to spherical coordinates
-    float theta = acos(sqrt(u1));
-    float phi = 2.0 * PI * u2;
+    float theta = acos(sqrt(u.x));
+    float phi = 2.0 * PI * u.y;
 
     // Convert to Cartesian coordinates
     float x = sin(theta) * cos(phi);
@@ -1026,80 +1306,170 @@ vec3 sampleHemisphereCosine(vec3 normal, vec2 seed1, vec2 seed2) {
     return normalize(worldSampleDir);
 }
 
-void main() {
-    vec3 albedo = m_albedo;
-    float metallic = m_metallic;
-    float roughness = m_roughness;
-    vec3 normal = o_norm;
-    vec3 pos = o_pos;
-    vec3 pos_screen = world2screen(pos);
-    
-    // normal = texture(geo_normal, pos_screen.xy).rgb * 2 - 1;
-    // frag_color = vec4((normal + 1) / 2, 1);
-    // frag_color = vec4((pos_screen.z - 0.8) * 3);
-    // pos = screen2world(pos_screen);
-    // frag_color = vec4(pos / 3 + 0.5, 1);
-    // return;
+// March the screen-space segment o + d * t, t in (0, 1], through the
+// min-depth pyramid. Cells whose nearest depth is still behind the ray are
+// skipped whole and the next level is tried, otherwise the ray refines
+// towards level 0. Returns the first t behind the depth buffer, or -1.
+// A surface is thickness thick in world space, a ray farther behind it passes
+// under it; rays still marching after HIZ_STEPS steps count as unoccluded.
+#define HIZ_STEPS 24
+float trace_hiz(vec3 o, vec3 d, float bias, float thickness) {
+    float len = length(d.xy * vec2(textureSize(hiz, 0)));
+    if(len < 1) return -1.0;
+    vec2 dir = vec2(abs(d.x) < 1e-8 ? 1e-8 : d.x, abs(d.y) < 1e-8 ? 1e-8 : d.y);
+    // clip to the screen
+    vec2 t_screen = max(-o.xy / dir, (vec2(1) - o.xy) / dir);
+    float t_max = min(1.0, min(t_screen.x, t_screen.y));
+    float eps = 0.01 / len;
+    float t = 1 / len; // leave the receiver's own texel
+    int level = 0;
+    for(int it = 0; it < HIZ_STEPS && t <= t_max; ++it) {
+        vec3 p = o + d * t;
+        vec2 size = vec2(textureSize(hiz, level));
+        vec2 cell = floor(p.xy * size);
+        float zmin = (level == 0 ? depth_at((cell + 0.5) / size) : texelFetch(hiz, ivec2(cell), level).r) + bias;
+        vec2 edge = (cell + step(vec2(0), dir)) / size;
+        vec2 t_edge = (edge - o.xy) / dir;
+        float t_exit = min(t_edge.x, t_edge.y);
+        if(p.z >= zmin) {
+            if(level > 0) {
+                --level;
+                continue;
+            }
+            if(distance(screen2world(p), screen2world(vec3(p.xy, zmin - bias))) < thickness) return t;
+            // entered the cell behind a thin surface, go on past it
+            t = t_exit + eps;
+            continue;
+        }
+        float t_plane = d.z > 0 ? (zmin - o.z) / d.z : 2.0;
+        if(t_plane < t_exit) {
+            // the ray goes behind this cell's nearest surface before leaving it
+            if(level == 0) return t_plane <= t_max ? t_plane : -1.0;
+            t = t_plane;
+            --level;
+        } else {
+            t = t_exit + eps;
+            level = min(level + 1, hiz_levels - 1);
+        }
+    }
+    return -1.0;
+}
+
+vec3 shade(ivec2 pixel) {
+    vec3 pos_screen = vec3((vec2(pixel) + 0.5) / vec2(textureSize(geo_depth, 0)), 0);
+    pos_screen.z = depth_at(pos_screen.xy);
+    // nothing was rasterized here in the G-buffer pass
+    if(pos_screen.z >= 1) return vec3(0);
+
+    // reconstruct the receiver from the G-buffer
+    vec3 pos = screen2world(pos_screen);
+    vec3 normal = normal_at(pos_screen.xy);
+    vec3 albedo = texture(geo_albedo, pos_screen.xy).rgb;
+    vec3 material = texture(geo_material, pos_screen.xy).rgb;
+    float metallic = material.x;
+    float roughness = material.y;
     
-
-    if(texture(geo_depth, pos_screen.xy).r * (1 + 1e-3) < pos_screen.z) {
-        frag_color = vec4(0);
-        return;
+    // Cranley-Patterson rotation: blue noise per pixel, golden-ratio steps per frame
+    ivec2 noise_size = textureSize(blue_noise, 0);
+    vec3 rot = texelFetch(blue_noise, pixel % noise_size, 0).rgb;
+    rot = fract(rot + float(frame % 1024) * vec3(0.6180340, 0.7548777, 0.5698403));
+
+    float radius = rmax;
+    if(radius_px > 0) {
+        // world-space size of one pixel at this depth
+        // measured in full-resolution pixels (geo_color is never reduced)
+        float footprint = length(screen2world(pos_screen + vec3(1.0 / textureSize(geo_color, 0).x, 0, 0)) - pos);
+        radius = clamp(radius_px * footprint, 0.02, rmax);
     }
+#ifdef COMPUTE
+    // at most APRON pixels of this resolution, farther samples would miss the tile
+    float apron = APRON * length(screen2world(pos_screen + vec3(1.0 / textureSize(geo_depth, 0).x, 0, 0)) - pos);
+    radius = min(radius, apron);
+#endif
 
-    if(has_tex == 1) {
-        vec3 color = texture(tex, scale_uv(o_uv, tex_scale)).rgb;
-        albedo = pow(color, vec3(2.2));
-    }
-    if(has_tex_norm == 1) {
-        normal = texture(tex_norm, scale_uv(o_uv, tex_norm_scale)).rgb;
-        normal = normalize(normal * 2 - vec3(1,1,1));
-        vec3 tmp;
-        tmp.y = normal.z;
-        tmp.x = normal.x;
-        tmp.z = normal.y;
-        normal = tmp;
-    }
-    
-    vec3 di = texture(geo_color, pos_screen.xy).rgb; // Direct Illumination
     vec3 ind = vec3(0);
     int i = 0;
-    float rmax = 2;
-    for(i = 0; i < N; ++i) {
-        vec3 dir = sampleHemisphereCosine(normal, pos_screen.xy + vec2(i + 1, gtime / 2), pos_screen.xy + vec2(gtime / 3, i + 1));
+    for(i = 0; i < SSDO_SPP; ++i) {
+        vec3 u = fract(texelFetch(sample_seq, ivec2(i, 0), 0).rgb + rot);
+        vec3 dir = sampleHemisphereCosine(normal, u.xy);
         if(dot(dir, normal) < 1e-4) continue;
-        float r = 0.01 + (rmax - 0.01) * max(0, random(pos_screen.xy + vec2(i + 1 + gtime * 3, i + 1)));
+        float r = 0.01 + (radius - 0.01) * u.z;
         vec3 p = pos + r * dir;
         vec3 p_screen = world2screen(p);
-        if(p_screen.x < 0 || p_screen.x >= 1 || p_screen.y < 0 || p_screen.y >= 1) 
-            continue;
-        float z = texture(geo_depth, p_screen.xy).r;
         float bias = max(length(p), 1) / 3000; 
-        if(z + bias < p_screen.z) {
-            p_screen.z = z;
+        bool hit;
+        if(hiz_levels > 0) {
+            vec3 d = p_screen - pos_screen;
+            float t = trace_hiz(pos_screen, d, bias, r);
+            hit = t >= 0;
+            p_screen = pos_screen + d * t;
+        } else {
+            if(p_screen.x < 0 || p_screen.x >= 1 || p_screen.y < 0 || p_screen.y >= 1) 
+                continue;
+            hit = depth_at(p_screen.xy) + bias < p_screen.z;
+        }
+        if(hit) {
+            p_screen.z = depth_at(p_screen.xy);
             p = screen2world(p_screen);
-            vec3 p_normal = texture(geo_normal, p_screen.xy).rgb * 2 - 1;
-            vec3 p_color = texture(geo_color, p_screen.xy).rgb;
-            // ind = N * (p / 3 + 0.5);
+            vec3 p_normal = normal_at(p_screen.xy);
+            vec3 p_color = color_at(p_screen.xy);
             ind += L(p, p_normal, p_color, normal, pos, albedo, metallic, roughness);
-            // ind = p_color * N;
-            // ind = (vec3(p_screen.z) / 5 + 0.5) * N;
         }
     }
 
-    ind /= N;
-    frag_color = vec4(ind,0);
+    ind /= SSDO_SPP;
+    return ind;
+}
 
+#ifdef COMPUTE
+void main() {
+    if(gl_LocalInvocationIndex == 0u) group_hits = group_lookups = 0u;
+    // the whole group takes part in the tile load and the counters, nobody leaves early
+    load_tile();
+    ivec2 pixel = ivec2(gl_GlobalInvocationID.xy);
+    if(all(lessThan(pixel, imageSize(ssdo_out)))) imageStore(ssdo_out, pixel, vec4(shade(pixel), 0));
+    atomicAdd(group_hits, hits);
+    atomicAdd(group_lookups, lookups);
+    memoryBarrierShared();
+    barrier();
+    if(gl_LocalInvocationIndex == 0u) {
+        atomicAdd(tile_hits, group_hits);
+        atomicAdd(tile_lookups, group_lookups);
+    }
+}
+#else
+void main() {
+    frag_color = vec4(shade(ivec2(gl_FragCoord.xy)), 0);
 }
+#endif
 )";
 }
 
-SSDO::SSDO(int render_pass): Shader(SSDO_text::vert, render_pass == 0 ? SSDO_text::frag1 : SSDO_text::frag2) {
-    model = loc("model");
-    vp = loc("vp");
-    vp_inv = loc("vp_inv");
-    has_tex = loc("has_tex");
-    has_tex_norm = loc("has_tex_norm");
+std::string material_defines(const Material *material) {
+    std::string defines;
+    if(material && material->texture) defines += "#define HAS_TEX\n";
+    if(material && material->texture_normal) defines += "#define HAS_TEX_NORM\n";
+    return defines;
+}
+std::string light_defines(const std::vector <LightInfo> &info, bool shadow, int shadow_filter) {
+    std::string lights;
+    for(int i = 0; i < (int)info.size(); ++i) {
+        lights += " LIGHT(" + std::to_string(i) + ", " + std::to_string((int)info[i].type) + ")";
+    }
+    return "#define LIGHT_COUNT " + std::to_string(info.size()) + "\n" +
+           "#define LIGHTS" + lights + "\n" +
+           "#define SHADOW " + std::to_string((int)shadow) + "\n" +
+           "#define SHADOW_FILTER " + std::to_string(shadow_filter) + "\n";
+}
+std::string ssdo_defines(int spp) {
+    return "#define SSDO_SPP " + std::to_string(spp) + "\n";
+}
+
+SSDO::SSDO(bool forward, const std::string &defines)
+    : Shader(SSDO_text::vert, forward ? SSDO_text::frag1 : SSDO_text::frag_geo, ("#version 330 core\n" + defines).c_str()) {}
+void SSDO::locate() {
+    model = loc("model");
+    vp = loc("vp");
     scale = loc("tex_scale");
     norm_scale = loc("tex_norm_scale");
     camera = loc("camera");
@@ -1107,59 +1477,41 @@ SSDO::SSDO(int render_pass): Shader(SSDO_text::vert, render_pass == 0 ? SSDO_tex
     light_intense = loc("light_intense");
     light_vp = loc("light_vp");
     light_direction = loc("light_direction");
-    light_type = loc("light_type");
-    light_cnt = loc("light_cnt");
     depth_map = loc("depth_map");
     tex = loc("tex");
     tex_norm = loc("tex_norm");
-    has_depth_map = loc("has_depth_map");
     m_albedo = loc("m_albedo");
     m_metallic = loc("m_metallic");
     m_roughness = loc("m_roughness");
     m_ao = loc("m_ao");
-    normal = loc("geo_normal");
-    depth = loc("geo_depth");
-    color = loc("geo_color");
-    gtime = loc("gtime");
+    m_id = loc("m_id");
 }
 void SSDO::set_mvp(glm::mat4 _model, glm::mat4 _vp) {
     glUniformMatrix4fv(model, 1, false, (GLfloat *)&_model);
     glUniformMatrix4fv(vp, 1, false, (GLfloat *)&_vp);
-    auto inv = glm::inverse(_vp);
-    glUniformMatrix4fv(vp_inv, 1, false, (GLfloat *)&inv);
 }
 void SSDO::set_material(Material *material) {
     glUniform1i(tex, 0);
     glUniform1i(tex_norm, 1);
     if(material == nullptr) {
-        glUniform1i(has_tex, 0);
-        CheckGLError();
         uniform_vec3(m_albedo, glm::vec3(0.f,0,0));
         glUniform1f(m_metallic, 0.5);
         glUniform1f(m_roughness, 0.5);
         glUniform1f(m_ao, 0.1);
+        glUniform1i(m_id, 0);
     } else {
+        // the variant was picked by material_defines, only maps it has are sampled
         if(material->texture != nullptr) {
             CheckGLError();
             glActiveTexture(GL_TEXTURE0);
             glBindTexture(GL_TEXTURE_2D, material->texture->get());
             CheckGLError();
-            glUniform1i(has_tex, 1);
-            CheckGLError();
-        } else {
-            glUniform1i(has_tex, 0);
-            CheckGLError();
         }
         if(material->texture_normal != nullptr) {
             CheckGLError();
             glActiveTexture(GL_TEXTURE1);
             glBindTexture(GL_TEXTURE_2D, material->texture_normal->get());
             CheckGLError();
-            glUniform1i(has_tex_norm, 1);
-            CheckGLError();
-        } else {
-            glUniform1i(has_tex_norm, 0);
-            CheckGLError();
         }
         uniform_vec3(scale, material->texture_scale);
         CheckGLError();
@@ -1169,14 +1521,13 @@ void SSDO::set_material(Material *material) {
         glUniform1f(m_ao, material->ao);
         glUniform1f(m_metallic, material->metallic);
         glUniform1f(m_roughness, material->roughness);
+        glUniform1i(m_id, material->id);
     }
 }
 void SSDO::set_light(std::vector <LightInfo> info) {
     // glm::vec3 position, glm::vec3 intense, glm::vec3 direction) {
     int n = info.size();
     std::vector <glm::vec3> tmp(n);
-    glUniform1i(light_cnt, n);
-    CheckGLError();
     for(int i = 0; i < n; ++i) tmp[i] = info[i].camera.position;
     glUniform3fv(light_position, n, (GLfloat*)tmp.data());
     CheckGLError();
@@ -1190,20 +1541,14 @@ void SSDO::set_light(std::vector <LightInfo> info) {
     for(int i = 0; i < n; ++i) tmp2[i] = info[i].vp();
     glUniformMatrix4fv(light_vp, n, false, (GLfloat*)tmp2.data());
     CheckGLError();
-    std::vector <GLint> tmp3(n);
-    for(int i = 0; i < n; ++i) tmp3[i] = info[i].type;
-    glUniform1iv(light_type, n, (GLint*)tmp3.data());
-    CheckGLError();
 }
 void SSDO::set_camera(glm::vec3 cam) {
     uniform_vec3(camera, cam);
     CheckGLError();
 }
 void SSDO::set_depth(std::vector <GLuint> map) {
-    if(map.empty()) {
-        glUniform1i(has_depth_map, 0);
-    } else {
-        glUniform1i(has_depth_map, 1);
+    // empty for the variants without SHADOW
+    if(!map.empty()) {
         int n = map.size();
         std::vector <int> tmp(n);
         for(int i = 0; i < n; ++i) tmp[i] = i + 5;
@@ -1216,110 +1561,515 @@ void SSDO::set_depth(std::vector <GLuint> map) {
         }
     }
 }
-void SSDO::set_geo(GLuint d, GLuint n, GLuint c) {
-    glUniform1i(depth, 2);
-    glUniform1i(normal, 3);
-    glUniform1i(color, 4);
-    glActiveTexture(GL_TEXTURE0 + 2);
-    glBindTexture(GL_TEXTURE_2D, d);
-    glActiveTexture(GL_TEXTURE0 + 3);
-    glBindTexture(GL_TEXTURE_2D, n);
-    glActiveTexture(GL_TEXTURE0 + 4);
-    glBindTexture(GL_TEXTURE_2D, c);
+const char *ScreenSSDO::image_format(GLenum internal_format) {
+    switch(internal_format) {
+    case GL_R11F_G11F_B10F: return "r11f_g11f_b10f";
+    case GL_RGBA16F: return "rgba16f";
+    case GL_RGBA32F: return "rgba32f";
+    case GL_RGBA16: return "rgba16";
+    case GL_RGBA16_SNORM: return "rgba16_snorm";
+    case GL_RGBA8: return "rgba8";
+    case GL_RGB10_A2: return "rgb10_a2";
+    default: return nullptr;
+    }
 }
-void SSDO::set_time(float time) {
-    glUniform1f(gtime, time);
+static std::string compute_header(GLenum target_format) {
+    return std::string("#version 430 core\n#define COMPUTE\n#define SSDO_FORMAT ")
+        + ScreenSSDO::image_format(target_format) + "\n";
+}
+ScreenSSDO::ScreenSSDO(bool compute, GLenum _target_format, const std::string &defines)
+    : Shader(compute ? ProgramRegistry::get_compute(SSDO_text::frag2, (compute_header(_target_format) + defines).c_str())
+                     : ProgramRegistry::get(vanila_vert, SSDO_text::frag2, ("#version 330 core\n" + defines).c_str())),
+      target_format(_target_format) {}
+void ScreenSSDO::locate() {
+    vp = loc("vp");
+    vp_inv = loc("vp_inv");
+    camera = loc("camera");
+    depth = loc("geo_depth");
+    normal = loc("geo_normal");
+    color = loc("geo_color");
+    albedo = loc("geo_albedo");
+    material = loc("geo_material");
+    sample_seq = loc("sample_seq");
+    blue_noise = loc("blue_noise");
+    frame = loc("frame");
+    rmax = loc("rmax");
+    radius_px = loc("radius_px");
+    hiz = loc("hiz");
+    hiz_levels = loc("hiz_levels");
+    out = loc("ssdo_out");
+}
+void ScreenSSDO::set_camera(glm::mat4 _vp, glm::vec3 cam) {
+    glUniformMatrix4fv(vp, 1, false, (GLfloat *)&_vp);
+    auto inv = glm::inverse(_vp);
+    glUniformMatrix4fv(vp_inv, 1, false, (GLfloat *)&inv);
+    uniform_vec3(camera, cam);
+    CheckGLError();
+}
+void ScreenSSDO::set_geo(GLuint d, GLuint n, GLuint c, GLuint a, GLuint m) {
+    GLint locs[] = {depth, normal, color, albedo, material};
+    GLuint texs[] = {d, n, c, a, m};
+    for(int i = 0; i < 5; ++i) {
+        glUniform1i(locs[i], i);
+        glActiveTexture(GL_TEXTURE0 + i);
+        glBindTexture(GL_TEXTURE_2D, texs[i]);
+    }
+}
+void ScreenSSDO::set_sampling(GLuint seq, GLuint noise, int _frame, float radius, float _radius_px) {
+    glUniform1i(sample_seq, 5);
+    glUniform1i(blue_noise, 6);
+    glActiveTexture(GL_TEXTURE0 + 5);
+    glBindTexture(GL_TEXTURE_2D, seq);
+    glActiveTexture(GL_TEXTURE0 + 6);
+    glBindTexture(GL_TEXTURE_2D, noise);
+    glUniform1i(frame, _frame);
+    glUniform1f(rmax, radius);
+    glUniform1f(radius_px, _radius_px);
+}
+void ScreenSSDO::set_hiz(GLuint tex, int levels) {
+    glUniform1i(hiz, 7);
+    glActiveTexture(GL_TEXTURE0 + 7);
+    glBindTexture(GL_TEXTURE_2D, tex);
+    glUniform1i(hiz_levels, levels);
+}
+void ScreenSSDO::dispatch(GLuint target, int width, int height) {
+    glUniform1i(out, 0);
+    glBindImageTexture(0, target, 0, GL_FALSE, 0, GL_WRITE_ONLY, target_format);
+    glDispatchCompute((width + 15) / 16, (height + 15) / 16, 1);
+    // the denoiser samples the result next, the tile counters are read back later
+    glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT | GL_BUFFER_UPDATE_BARRIER_BIT);
+    CheckGLError();
 }
 
-static const char *vanila_vert = R"(
-#version 330 core
+namespace INDIRECT {
+// the layouts of GpuScene::Draw and GpuScene::GpuMaterial
+#define INDIRECT_BUFFERS \
+    "struct Draw {\n"                                                          \
+    "    uint transform, material, pad0, pad1;\n"                              \
+    "    vec4 sphere; // object-space bounds\n"                                \
+    "};\n"                                                                     \
+    "layout(std430, binding = 0) readonly buffer Draws { Draw draws[]; };\n"   \
+    "layout(std430, binding = 1) readonly buffer Transforms { mat4 transforms[]; };\n"
+
+static const char *vert = R"(
+#version 430 core
 layout(location = 0) in vec3 position;
+layout(location = 1) in vec2 uv;
+layout(location = 2) in vec3 normal;
+// one per instance, the command's baseInstance picks the draw
+layout(location = 3) in uint draw_id;
+)" INDIRECT_BUFFERS R"(
+uniform mat4 vp;
 
-out vec3 pos;
+out vec2 o_uv;
+out vec3 o_pos;
+out vec3 o_norm;
+flat out uint o_material;
 
 void main() {
-    gl_Position = vec4(position, 1.);
-    pos = position;
+    Draw d = draws[draw_id];
+    vec4 p = transforms[d.transform] * vec4(position, 1);
+    gl_Position = vp * p;
+    o_pos = p.xyz / p.w;
+    o_uv = uv;
+    o_norm = normal;
+    o_material = d.material;
 }
 )";
 
-namespace DENOISING {
+// the same G-buffer as SSDO_text::frag_geo
+static const char *frag = R"(
+#version 430 core
+in vec2 o_uv;
+in vec3 o_pos;
+in vec3 o_norm;
+flat in uint o_material;
+
+struct Material {
+    vec4 albedo; // rgb, metallic
+    vec4 params; // roughness, ao
+    vec4 scale;  // uv scale of the albedo and the normal map
+    ivec4 maps;  // albedo and normal map layers, -1 without; material id
+};
+layout(std430, binding = 2) readonly buffer Materials { Material materials[]; };
+uniform sampler2DArray tex;
+uniform sampler2DArray tex_norm;
+
+layout(location = 1) out vec2 frag_normal; // octahedral
+layout(location = 2) out vec3 frag_albedo;
+layout(location = 3) out vec4 frag_material;
+)" NORMAL_CODEC R"(
+
+void main() {
+    Material m = materials[o_material];
+    vec3 albedo = m.albedo.rgb;
+    vec3 normal = o_norm;
+    // explicit gradients: helper invocations may not see the storage buffer,
+    // so implicit derivatives of o_uv / m.scale can be garbage
+    vec2 dx = dFdx(o_uv), dy = dFdy(o_uv);
+    if(m.maps.x >= 0) {
+        vec2 s = m.scale.xy;
+        albedo = pow(textureGrad(tex, vec3(o_uv / s, m.maps.x), dx / s, dy / s).rgb, vec3(2.2));
+    }
+    if(m.maps.y >= 0) {
+        vec2 s = m.scale.zw;
+        normal = textureGrad(tex_norm, vec3(o_uv / s, m.maps.y), dx / s, dy / s).rgb;
+        normal = normalize(normal * 2 - vec3(1,1,1)).xzy;
+    }
+
+    frag_normal = encode_normal(normal);
+    frag_albedo = albedo;
+    frag_material = vec4(m.albedo.w, m.params.x, m.params.y, m.maps.z / 65535.);
+}
+)";
+
+static const char *cull = R"(
+layout(local_size_x = 64) in;
+)" INDIRECT_BUFFERS R"(
+// DrawElementsIndirectCommand: count, instanceCount, firstIndex, baseVertex, baseInstance
+layout(std430, binding = 3) buffer Commands { uint commands[]; };
+uniform vec4 planes[6];
+uniform int count;
+uniform int cull;
+
+void main() {
+    uint i = gl_GlobalInvocationID.x;
+    if(i >= uint(count)) return;
+    bool visible = true;
+    if(cull != 0) {
+        mat4 model = transforms[draws[i].transform];
+        vec3 c = (model * vec4(draws[i].sphere.xyz, 1)).xyz;
+        float r = draws[i].sphere.w * max(length(model[0].xyz), max(length(model[1].xyz), length(model[2].xyz)));
+        for(int k = 0; k < 6; ++k) {
+            if(dot(planes[k].xyz, c) + planes[k].w < -r) visible = false;
+        }
+    }
+    commands[i * 5u + 1u] = visible ? 1u : 0u;
+}
+)";
+#undef INDIRECT_BUFFERS
+}
+
+IndirectGeometry::IndirectGeometry(): Shader(INDIRECT::vert, INDIRECT::frag) {}
+void IndirectGeometry::locate() {
+    vp = loc("vp");
+    tex = loc("tex");
+    tex_norm = loc("tex_norm");
+}
+void IndirectGeometry::set(glm::mat4 _vp, GLuint albedo_maps, GLuint normal_maps) {
+    glUniformMatrix4fv(vp, 1, false, (GLfloat *)&_vp);
+    glUniform1i(tex, 0);
+    glUniform1i(tex_norm, 1);
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, albedo_maps);
+    glActiveTexture(GL_TEXTURE1);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, normal_maps);
+    CheckGLError();
+}
+
+DrawCuller::DrawCuller(): Shader(ProgramRegistry::get_compute(INDIRECT::cull, "#version 430 core\n")) {}
+void DrawCuller::locate() {
+    planes = loc("planes");
+    count = loc("count");
+    cull = loc("cull");
+}
+void DrawCuller::dispatch(const glm::vec4 *_planes, int _count, bool _cull) {
+    glUniform4fv(planes, 6, (GLfloat *)_planes);
+    glUniform1i(count, _count);
+    glUniform1i(cull, _cull);
+    glDispatchCompute((_count + 63) / 64, 1, 1);
+    // the draw reads the instance counts next
+    glMemoryBarrier(GL_COMMAND_BARRIER_BIT);
+    CheckGLError();
+}
+
+namespace HIZ {
 static const char *frag = R"(
 #version 330 core
+
+uniform sampler2D src; // G-buffer depth, or the pyramid limited to the previous level
+uniform int reduce;
+
+layout(location = 0) out float frag_depth;
+
+void main() {
+    ivec2 p = ivec2(gl_FragCoord.xy);
+    if(reduce == 0) {
+        frag_depth = texelFetch(src, p, 0).r;
+        return;
+    }
+    // min over 2x2, the last row / column also takes the odd texel left over
+    ivec2 size = textureSize(src, 0);
+    ivec2 last = max(size / 2, ivec2(1)) - 1;
+    ivec2 ext = ivec2(1) + ivec2(equal(p, last)) * (size % 2);
+    float z = 1;
+    for(int j = 0; j <= ext.y; ++j) {
+        for(int i = 0; i <= ext.x; ++i) {
+            z = min(z, texelFetch(src, min(p * 2 + ivec2(i, j), size - 1), 0).r);
+        }
+    }
+    frag_depth = z;
+}
+)";
+}
+
+HiZBuilder::HiZBuilder(): Shader(vanila_vert, HIZ::frag) {}
+void HiZBuilder::locate() {
+    src = loc("src");
+    reduce = loc("reduce");
+}
+void HiZBuilder::set(GLuint tex, int level) {
+    glUniform1i(src, 0);
+    glActiveTexture(GL_TEXTURE0);
+    glBindTexture(GL_TEXTURE_2D, tex);
+    if(level > 0) {
+        // only the previous level is visible, the one being written is not
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, level - 1);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, level - 1);
+    }
+    glUniform1i(reduce, level > 0);
+}
+
+namespace DEFERRED {
+static const char *frag = R"(
+// #extension GL_ARB_explicit_uniform_location : enable
+
+in vec3 pos;
+
+uniform mat4 vp_inv;
+uniform vec3 camera;
+uniform sampler2D geo_depth, geo_normal, geo_albedo, geo_material;
+)" NORMAL_CODEC LIGHTING R"(
+
+layout(location = 0) out vec3 frag_color;
+
+vec3 screen2world(vec3 p) {
+    vec4 w = vp_inv * vec4(p * 2 - vec3(1), 1);
+    return w.xyz / w.w;
+}
+
+void main() {
+    vec3 pos_screen = vec3((pos.xy + 1) / 2, 0);
+    pos_screen.z = texture(geo_depth, pos_screen.xy).r;
+    if(pos_screen.z >= 1) {
+        frag_color = vec3(0);
+        return;
+    }
+    vec3 pos = screen2world(pos_screen);
+    vec3 normal = decode_normal(texture(geo_normal, pos_screen.xy).xy);
+    vec3 albedo = texture(geo_albedo, pos_screen.xy).rgb;
+    vec4 material = texture(geo_material, pos_screen.xy);
+    float metallic = material.x;
+    float roughness = material.y;
+
+    vec3 color = vec3(0);
+    // sampler arrays may only be indexed by constant expressions in GLSL 3.30,
+    // LIGHTS has a LIGHT(i, type) for every light, the type folds the branches of L away
+#define LIGHT(i, type) color += L(light_position[i], light_direction[i], light_intense[i], light_vp[i], type, depth_map[i], normal, pos, albedo, metallic, roughness);
+    LIGHTS
+#undef LIGHT
+
+    frag_color = color;
+}
+)";
+}
+
+DeferredLighting::DeferredLighting(const std::string &defines)
+    : Shader(vanila_vert, DEFERRED::frag, ("#version 330 core\n" + defines).c_str()) {}
+void DeferredLighting::locate() {
+    vp_inv = loc("vp_inv");
+    camera = loc("camera");
+    light_position = loc("light_position");
+    light_intense = loc("light_intense");
+    light_vp = loc("light_vp");
+    light_direction = loc("light_direction");
+    depth_map = loc("depth_map");
+    depth = loc("geo_depth");
+    normal = loc("geo_normal");
+    albedo = loc("geo_albedo");
+    material = loc("geo_material");
+}
+void DeferredLighting::set_camera(glm::mat4 vp, glm::vec3 cam) {
+    auto inv = glm::inverse(vp);
+    glUniformMatrix4fv(vp_inv, 1, false, (GLfloat *)&inv);
+    uniform_vec3(camera, cam);
+    CheckGLError();
+}
+void DeferredLighting::set_light(std::vector <LightInfo> info) {
+    int n = info.size();
+    std::vector <glm::vec3> tmp(n);
+    for(int i = 0; i < n; ++i) tmp[i] = info[i].camera.position;
+    glUniform3fv(light_position, n, (GLfloat*)tmp.data());
+    CheckGLError();
+    for(int i = 0; i < n; ++i) tmp[i] = info[i].intense;
+    glUniform3fv(light_intense, n, (GLfloat*)tmp.data());
+    CheckGLError();
+    for(int i = 0; i < n; ++i) tmp[i] = info[i].camera.dir();
+    glUniform3fv(light_direction, n, (GLfloat*)tmp.data());
+    CheckGLError();
+    std::vector <glm::mat4> tmp2(n);
+    for(int i = 0; i < n; ++i) tmp2[i] = info[i].vp();
+    glUniformMatrix4fv(light_vp, n, false, (GLfloat*)tmp2.data());
+    CheckGLError();
+}
+void DeferredLighting::set_depth(std::vector <GLuint> map) {
+    // empty for the variants without SHADOW
+    if(!map.empty()) {
+        int n = map.size();
+        std::vector <int> tmp(n);
+        for(int i = 0; i < n; ++i) tmp[i] = i + 5;
+        glUniform1iv(depth_map, n, (GLint*)tmp.data());
+        for(int i = 0; i < n; ++i) {
+            glActiveTexture(GL_TEXTURE0 + 5 + i);
+            CheckGLError();
+            glBindTexture(GL_TEXTURE_2D, map[i]);
+            CheckGLError();
+        }
+    }
+}
+void DeferredLighting::set_geo(GLuint d, GLuint n, GLuint a, GLuint m) {
+    GLint locs[] = {depth, normal, albedo, material};
+    GLuint texs[] = {d, n, a, m};
+    for(int i = 0; i < 4; ++i) {
+        glUniform1i(locs[i], i);
+        glActiveTexture(GL_TEXTURE0 + i);
+        glBindTexture(GL_TEXTURE_2D, texs[i]);
+    }
+}
+
+namespace DENOISING {
+static const char *frag = R"(
 // #extension GL_ARB_explicit_uniform_location : enable
 
 in vec3 pos;
 
 uniform sampler2D tex;
 uniform int has_last;
-uniform sampler2D last;
+uniform sampler2D last, last_moments;
 uniform float alpha;
 
-layout(location = 0) out vec4 frag_color;
+// reprojection: the G-buffer at this resolution and last frame's normal / depth
+uniform sampler2D geo_depth, geo_normal, last_geo;
+uniform mat4 vp_inv, prev_vp, prev_vp_inv;
+uniform vec3 camera;
+)" NORMAL_CODEC R"(
+
+layout(location = 0) out vec4 frag_color;   // rgb: accumulated, a: luminance variance
+layout(location = 1) out vec4 frag_geo;     // normal, depth for the next frame
+layout(location = 2) out vec4 frag_moments; // luminance moments, history length
 
+#ifdef BOX_FILTER
 float random (vec2 uv) {
     return fract(sin(dot(uv, vec2(12.9898, 78.233))) * 43758.5453123);
 }
+#endif
+float luminance(vec3 c) {
+    return dot(c, vec3(0.2126, 0.7152, 0.0722));
+}
+vec3 screen2world(mat4 inv, vec3 p) {
+    vec4 w = inv * vec4(p * 2 - vec3(1), 1);
+    return w.xyz / w.w;
+}
 
 void main() {
     vec2 pos_screen = (pos.xy + 1) / 2;
-    vec2 step = 1 / textureSize(tex, 0);
-    int L = 6;
-    vec3 mi = vec3(10), mx = vec3(0);
-    vec3 res = vec3(0);
-    vec3 s = vec3(0);
+    ivec2 p = ivec2(gl_FragCoord.xy);
+    ivec2 size = textureSize(tex, 0);
+    vec3 color = texelFetch(tex, p, 0).rgb;
+
+    // moments of the 5x5 neighbourhood, for clipping and for a spatial variance
+    vec3 m1 = vec3(0), m2 = vec3(0);
+    vec2 lm = vec2(0);
+    float cnt = 0;
+#ifdef BOX_FILTER
+    // the 13x13 box loop filters the new samples before they are blended:
+    // a 1 / (1 + distance) weighted mean plus a random pick between the min and max
+    const int L = 6;
+    vec3 mi = vec3(10), mx = vec3(0), s = vec3(0);
     float w = 0;
-    for(int i = -L; i <= L; i++) {
-        float x = pos_screen.x + i * step.x;
-        if(x < 0 || x >= 1) continue;
-        for(int j = - L; j <= L; j ++) {
-            float y = pos_screen.y + j * step.x;
-            if(y < 0 || y >= 1) continue;
-            vec2 d = vec2(i, j);
-            vec3 color = texture(tex, vec2(x, y)).rgb;
-            float wi = 1 / (1 + length(d));
+#else
+    const int L = 2;
+#endif
+    for(int j = -L; j <= L; ++j) {
+        for(int i = -L; i <= L; ++i) {
+            ivec2 q = p + ivec2(i, j);
+            if(any(lessThan(q, ivec2(0))) || any(greaterThanEqual(q, size))) continue;
+            vec3 c = texelFetch(tex, q, 0).rgb;
+#ifdef BOX_FILTER
+            float wi = 1 / (1 + length(vec2(i, j)));
             w += wi;
-            s += wi * color; // ssdo indirect light
-            mi = min(mi, color);
-            mx = max(mx, color);
+            s += wi * c;
+            mi = min(mi, c);
+            mx = max(mx, c);
+            if(abs(i) > 2 || abs(j) > 2) continue;
+#endif
+            float l = luminance(c);
+            m1 += c;
+            m2 += c * c;
+            lm += vec2(l, l * l);
+            cnt += 1;
         }
     }
-    for(int i = 0; i < 3; ++i) {
-        res[i] = mi[i] + random(pos_screen + mi.xy) * (mx[i] - mi[i]);
+    m1 /= cnt, m2 /= cnt, lm /= cnt;
+#ifdef BOX_FILTER
+    vec3 res;
+    for(int k = 0; k < 3; ++k) {
+        res[k] = mi[k] + random(pos_screen + mi.xy) * (mx[k] - mi[k]);
     }
-    res = res / 3 + s / w;
-    if(has_last > 0) {
-        /*L = 0;
-        vec3 s = vec3(0);
-        float w = 0;
-        for(int i = -L; i <= L; i++) {
-            float x = pos_screen.x + i * step.x;
-            if(x < 0 || x >= 1) continue;
-            for(int j = - L; j <= L; j ++) {
-                float y = pos_screen.y + j * step.x;
-                if(y < 0 || y >= 1) continue;
-                vec2 d = vec2(i, j);
-                vec3 color = texture(last, vec2(x, y)).rgb;
-                float wi = 1 / (1 + length(d));
-                w += wi;
-                s += wi * color; // ssdo indirect light
-                mi = min(mi, color);
-                mx = max(mx, color);
+    color = res / 3 + s / w;
+#endif
+
+    float z = texture(geo_depth, pos_screen).r;
+    vec3 n = decode_normal(texture(geo_normal, pos_screen).xy);
+    frag_geo = vec4(n, z);
+    float l = luminance(color);
+    vec2 moments = vec2(l, l * l);
+    float age = 0;
+    if(has_last > 0 && z < 1) {
+        // where this surface was last frame
+        vec3 P = screen2world(vp_inv, vec3(pos_screen, z));
+        vec4 c = prev_vp * vec4(P, 1);
+        vec2 prev = (c.xy / c.w + 1) / 2;
+        if(c.w > 0 && all(greaterThanEqual(prev, vec2(0))) && all(lessThan(prev, vec2(1)))) {
+            // reject disocclusions: the history must lie on our plane and face our way
+            vec4 g = texture(last_geo, prev);
+            vec3 Q = screen2world(prev_vp_inv, vec3(prev, g.w));
+            float tol = 0.02 * length(P - camera);
+            if(g.w < 1 && abs(dot(Q - P, n)) < tol && dot(n, g.xyz) > 0.9) {
+                vec3 sigma = sqrt(max(m2 - m1 * m1, vec3(0)));
+                vec3 hist = clamp(texture(last, prev).rgb, m1 - sigma, m1 + sigma);
+                vec4 hm = texture(last_moments, prev);
+                age = min(hm.z + 1, 255);
+                float a = max(alpha, 1 / (age + 1));
+                color = mix(hist, color, a);
+                moments = mix(hm.xy, moments, a);
             }
-        }*/
-        res = res * alpha + (1 - alpha) * texture(last, pos_screen).rgb;
+        }
     }
-    frag_color = vec4(res, 1);
+    // temporal variance once enough frames are in, the neighbourhood's before
+    float variance = age >= 4 ? moments.y - moments.x * moments.x : lm.y - lm.x * lm.x;
+    frag_color = vec4(color, max(variance, 0));
+    frag_moments = vec4(moments, age, 0);
 }
 )";
 }
 
-Denoiser::Denoiser(): Shader(vanila_vert, DENOISING::frag) {
+Denoiser::Denoiser(bool box_filter)
+    : Shader(vanila_vert, DENOISING::frag, box_filter ? "#version 330 core\n#define BOX_FILTER\n" : "#version 330 core\n") {}
+void Denoiser::locate() {
     puts("DENOISER");
     tex = loc("tex");
     last = loc("last");
     has_last = loc("has_last");
     alpha = loc("alpha");
+    depth = loc("geo_depth");
+    normal = loc("geo_normal");
+    last_geo = loc("last_geo");
+    vp_inv = loc("vp_inv");
+    prev_vp = loc("prev_vp");
+    prev_vp_inv = loc("prev_vp_inv");
+    camera = loc("camera");
+    last_moments = loc("last_moments");
 }
 void Denoiser::set(GLuint _tex, GLuint _last, float _alpha) {
     glUniform1i(tex, 0);
@@ -1335,6 +2085,290 @@ void Denoiser::set(GLuint _tex, GLuint _last, float _alpha) {
     }
     glUniform1f(alpha, _alpha);
 }
+void Denoiser::set_reprojection(GLuint d, GLuint n, GLuint _last_geo, GLuint _last_moments,
+                                glm::mat4 vp, glm::mat4 _prev_vp, glm::vec3 cam) {
+    GLint locs[] = {depth, normal, last_geo, last_moments};
+    GLuint texs[] = {d, n, _last_geo, _last_moments};
+    for(int i = 0; i < 4; ++i) {
+        glUniform1i(locs[i], 2 + i);
+        glActiveTexture(GL_TEXTURE2 + i);
+        glBindTexture(GL_TEXTURE_2D, texs[i]);
+    }
+    auto inv = glm::inverse(vp), prev_inv = glm::inverse(_prev_vp);
+    glUniformMatrix4fv(vp_inv, 1, false, (GLfloat *)&inv);
+    glUniformMatrix4fv(prev_vp, 1, false, (GLfloat *)&_prev_vp);
+    glUniformMatrix4fv(prev_vp_inv, 1, false, (GLfloat *)&prev_inv);
+    uniform_vec3(camera, cam);
+}
+
+// the version line comes from the header, COMPOSITE fuses in the Mixer
+namespace ATROUS {
+static const char *frag = R"(
+uniform sampler2D tex; // rgb: color, a: luminance variance
+uniform sampler2D geo; // normal and depth of the temporal pass, one fetch per tap
+uniform mat4 vp_inv;
+uniform vec3 camera;
+uniform int step_size;
+uniform int blur_variance; // only the first pass, later ones get a variance it already filtered
+#ifdef COMPOSITE
+uniform sampler2D direct;
+uniform float alpha;
+#endif
+
+layout(location = 0) out vec4 frag_color;
+
+const float kernel[3] = float[](3.0 / 8.0, 1.0 / 4.0, 1.0 / 16.0);
+const float sigma_l = 4;
+
+float luminance(vec3 c) {
+    return dot(c, vec3(0.2126, 0.7152, 0.0722));
+}
+// normalized device coordinates of texel q at depth z
+vec4 ndc(ivec2 q, float z) {
+    vec2 uv = (vec2(q) + 0.5) / vec2(textureSize(geo, 0));
+    return vec4(vec3(uv, z) * 2 - vec3(1), 1);
+}
+vec4 finish(ivec2 p, vec4 filtered) {
+#ifdef COMPOSITE
+    vec3 color = texelFetch(direct, p, 0).rgb + filtered.rgb * alpha;
+    // Gamma correction
+    color = color / (color + vec3(1.0));
+    return vec4(pow(color, vec3(1.0 / 2.2)), 1);
+#else
+    return filtered;
+#endif
+}
+
+void main() {
+    ivec2 p = ivec2(gl_FragCoord.xy);
+    ivec2 size = textureSize(tex, 0);
+    vec4 c = texelFetch(tex, p, 0);
+    vec4 g = texelFetch(geo, p, 0);
+    float z = g.w;
+    if(z >= 1) {
+        frag_color = finish(p, c);
+        return;
+    }
+    vec4 w_p = vp_inv * ndc(p, z);
+    vec3 P = w_p.xyz / w_p.w;
+    vec3 n = g.xyz;
+    float tol = 0.01 * length(P - camera);
+    // the distance of a tap to the tangent plane is dot(world, n) - dot(P, n), with
+    // world = (vp_inv * c).xyz / (vp_inv * c).w; fold n and w into row vectors of
+    // vp_inv so a tap costs two dot products instead of a matrix product
+    vec4 plane = vec4(n, 0) * vp_inv, homogeneous = vec4(0, 0, 0, 1) * vp_inv;
+    float plane_offset = dot(P, n);
+    float l = luminance(c.rgb);
+
+    // luminance edges are scaled by the 3x3 blurred standard deviation
+    float variance = c.a;
+    if(blur_variance != 0) {
+        variance = 0;
+        for(int j = -1; j <= 1; ++j) {
+            for(int i = -1; i <= 1; ++i) {
+                ivec2 q = clamp(p + ivec2(i, j), ivec2(0), size - 1);
+                variance += (i == 0 ? 0.5 : 0.25) * (j == 0 ? 0.5 : 0.25) * texelFetch(tex, q, 0).a;
+            }
+        }
+    }
+    float denom = sigma_l * sqrt(max(variance, 0)) + 1e-4;
+
+    vec3 s = vec3(0);
+    float sv = 0, w = 0;
+    for(int j = -2; j <= 2; ++j) {
+        for(int i = -2; i <= 2; ++i) {
+            ivec2 q = p + ivec2(i, j) * step_size;
+            if(any(lessThan(q, ivec2(0))) || any(greaterThanEqual(q, size))) continue;
+            vec4 gq = texelFetch(geo, q, 0);
+            if(gq.w >= 1) continue;
+            vec4 cq = texelFetch(tex, q, 0);
+            vec4 cl = ndc(q, gq.w);
+            float dz = abs(dot(cl, plane) / dot(cl, homogeneous) - plane_offset) / tol;
+            float dl = abs(luminance(cq.rgb) - l) / denom;
+            // pow(x, 128) as seven squarings
+            float wn = max(0, dot(n, gq.xyz));
+            wn *= wn; wn *= wn; wn *= wn; wn *= wn; wn *= wn; wn *= wn; wn *= wn;
+            float wi = kernel[abs(i)] * kernel[abs(j)] * wn * exp(-dz - dl);
+            s += wi * cq.rgb;
+            sv += wi * wi * cq.a;
+            w += wi;
+        }
+    }
+    // the centre always contributes, w > 0
+    frag_color = finish(p, vec4(s / w, sv / (w * w)));
+}
+)";
+}
+
+AtrousFilter::AtrousFilter(bool composite)
+    : Shader(vanila_vert, ATROUS::frag, composite ? "#version 330 core\n#define COMPOSITE\n" : "#version 330 core\n") {}
+void AtrousFilter::locate() {
+    tex = loc("tex");
+    geo = loc("geo");
+    blur_variance = loc("blur_variance");
+    vp_inv = loc("vp_inv");
+    camera = loc("camera");
+    step_size = loc("step_size");
+    direct = loc("direct");
+    alpha = loc("alpha");
+}
+void AtrousFilter::set_composite(GLuint d, float _alpha) {
+    glUniform1i(direct, 3);
+    glActiveTexture(GL_TEXTURE3);
+    glBindTexture(GL_TEXTURE_2D, d);
+    glUniform1f(alpha, _alpha);
+}
+void AtrousFilter::set(GLuint t, GLuint g, int step, glm::mat4 vp, glm::vec3 cam) {
+    GLint locs[] = {tex, geo};
+    GLuint texs[] = {t, g};
+    for(int i = 0; i < 2; ++i) {
+        glUniform1i(locs[i], i);
+        glActiveTexture(GL_TEXTURE0 + i);
+        glBindTexture(GL_TEXTURE_2D, texs[i]);
+    }
+    glUniform1i(step_size, step);
+    glUniform1i(blur_variance, step == 1);
+    auto inv = glm::inverse(vp);
+    glUniformMatrix4fv(vp_inv, 1, false, (GLfloat *)&inv);
+    uniform_vec3(camera, cam);
+}
+
+namespace DOWNSAMPLE {
+static const char *frag = R"(
+#version 330 core
+
+uniform sampler2D geo_depth, geo_normal, geo_albedo, geo_material;
+uniform int scale;
+
+layout(location = 0) out float frag_depth;
+layout(location = 1) out vec2 frag_normal;
+layout(location = 2) out vec3 frag_albedo;
+layout(location = 3) out vec4 frag_material;
+
+void main() {
+    // keep the nearest surface of each scale x scale block
+    ivec2 size = textureSize(geo_depth, 0);
+    ivec2 base = ivec2(gl_FragCoord.xy) * scale;
+    ivec2 best = min(base, size - 1);
+    float d = 2;
+    for(int y = 0; y < scale; ++y) {
+        for(int x = 0; x < scale; ++x) {
+            ivec2 p = min(base + ivec2(x, y), size - 1);
+            float z = texelFetch(geo_depth, p, 0).r;
+            if(z < d) {
+                d = z;
+                best = p;
+            }
+        }
+    }
+    frag_depth = d;
+    frag_normal = texelFetch(geo_normal, best, 0).xy;
+    frag_albedo = texelFetch(geo_albedo, best, 0).rgb;
+    frag_material = texelFetch(geo_material, best, 0);
+}
+)";
+}
+
+Downsampler::Downsampler(): Shader(vanila_vert, DOWNSAMPLE::frag) {}
+void Downsampler::locate() {
+    depth = loc("geo_depth");
+    normal = loc("geo_normal");
+    albedo = loc("geo_albedo");
+    material = loc("geo_material");
+    scale = loc("scale");
+}
+void Downsampler::set(GLuint d, GLuint n, GLuint a, GLuint m, int _scale) {
+    GLint locs[] = {depth, normal, albedo, material};
+    GLuint texs[] = {d, n, a, m};
+    for(int i = 0; i < 4; ++i) {
+        glUniform1i(locs[i], i);
+        glActiveTexture(GL_TEXTURE0 + i);
+        glBindTexture(GL_TEXTURE_2D, texs[i]);
+    }
+    glUniform1i(scale, _scale);
+}
+
+namespace UPSAMPLE {
+static const char *frag = R"(
+#version 330 core
+
+in vec3 pos;
+
+uniform sampler2D ind, half_depth, half_normal, geo_depth, geo_normal;
+uniform mat4 vp_inv;
+uniform vec3 camera;
+)" NORMAL_CODEC R"(
+
+layout(location = 0) out vec4 frag_color;
+
+vec3 screen2world(vec3 p) {
+    vec4 w = vp_inv * vec4(p * 2 - vec3(1), 1);
+    return w.xyz / w.w;
+}
+
+void main() {
+    vec2 uv = (pos.xy + 1) / 2;
+    float z = texture(geo_depth, uv).r;
+    if(z >= 1) {
+        frag_color = vec4(0);
+        return;
+    }
+    vec3 P = screen2world(vec3(uv, z));
+    vec3 n = decode_normal(texture(geo_normal, uv).xy);
+    float tol = 0.01 * length(P - camera);
+
+    // joint bilateral over the 2x2 low resolution texels around uv,
+    // falls back to the texel closest to our surface plane
+    ivec2 size = textureSize(half_depth, 0);
+    vec2 f = uv * size - 0.5;
+    ivec2 i0 = ivec2(floor(f));
+    vec2 t = f - floor(f);
+    vec3 s = vec3(0), nearest = vec3(0);
+    float w = 0, best = 1e9;
+    for(int j = 0; j < 2; ++j) {
+        for(int i = 0; i < 2; ++i) {
+            ivec2 q = clamp(i0 + ivec2(i, j), ivec2(0), size - 1);
+            float bw = (i == 0 ? 1 - t.x : t.x) * (j == 0 ? 1 - t.y : t.y);
+            vec3 Q = screen2world(vec3((vec2(q) + 0.5) / size, texelFetch(half_depth, q, 0).r));
+            vec3 qn = decode_normal(texelFetch(half_normal, q, 0).xy);
+            vec3 c = texelFetch(ind, q, 0).rgb;
+            float plane = abs(dot(Q - P, n));
+            float wi = bw * exp(-plane / tol) * pow(max(0, dot(n, qn)), 8);
+            s += wi * c;
+            w += wi;
+            if(plane < best) {
+                best = plane;
+                nearest = c;
+            }
+        }
+    }
+    frag_color = vec4(w > 1e-4 ? s / w : nearest, 1);
+}
+)";
+}
+
+Upsampler::Upsampler(): Shader(vanila_vert, UPSAMPLE::frag) {}
+void Upsampler::locate() {
+    ind = loc("ind");
+    half_depth = loc("half_depth");
+    half_normal = loc("half_normal");
+    depth = loc("geo_depth");
+    normal = loc("geo_normal");
+    vp_inv = loc("vp_inv");
+    camera = loc("camera");
+}
+void Upsampler::set(GLuint i, GLuint hd, GLuint hn, GLuint d, GLuint n, glm::mat4 vp, glm::vec3 cam) {
+    GLint locs[] = {ind, half_depth, half_normal, depth, normal};
+    GLuint texs[] = {i, hd, hn, d, n};
+    for(int k = 0; k < 5; ++k) {
+        glUniform1i(locs[k], k);
+        glActiveTexture(GL_TEXTURE0 + k);
+        glBindTexture(GL_TEXTURE_2D, texs[k]);
+    }
+    auto inv = glm::inverse(vp);
+    glUniformMatrix4fv(vp_inv, 1, false, (GLfloat *)&inv);
+    uniform_vec3(camera, cam);
+}
 
 namespace MIXER {
 static const char *frag = R"(
@@ -1362,7 +2396,8 @@ void main() {
 )";
 }
 
-Mixer::Mixer(): Shader(vanila_vert, MIXER::frag) {
+Mixer::Mixer(): Shader(vanila_vert, MIXER::frag) {}
+void Mixer::locate() {
     direct = loc("direct");
     ind = loc("ind");
     alpha = loc("alpha");
@@ -1377,4 +2412,88 @@ void Mixer::set(GLuint _d, GLuint _i, float _alpha) {
     glUniform1f(alpha, _alpha);
 }
 
+namespace TEMPORAL_UPSAMPLE {
+static const char *frag = R"(
+#version 330 core
+
+in vec3 pos;
+
+uniform sampler2D cur, geo_depth, history;
+uniform int has_history;
+uniform vec2 jitter;
+uniform mat4 vp_inv, prev_vp;
+uniform float max_weight;
+
+layout(location = 0) out vec4 frag_color;
+
+void main() {
+    vec2 uv = (pos.xy + 1) / 2;
+    ivec2 size = textureSize(cur, 0);
+    vec2 scale = vec2(textureSize(history, 0)) / size; // output pixels per render pixel
+
+    // texel c was sampled at c + 0.5 - jitter, take the one closest to uv,
+    // weighted by that distance in output pixels
+    vec2 x = uv * size;
+    ivec2 c = clamp(ivec2(floor(x + jitter)), ivec2(0), size - 1);
+    vec2 d = (vec2(c) + 0.5 - jitter - x) * scale;
+    float w = exp(-2 * dot(d, d));
+    vec3 color = texelFetch(cur, c, 0).rgb;
+
+    // history is clamped to the current 3x3 neighbourhood to reject disocclusions
+    vec3 lo = color, hi = color;
+    for(int j = -1; j <= 1; ++j) {
+        for(int i = -1; i <= 1; ++i) {
+            vec3 s = texelFetch(cur, clamp(c + ivec2(i, j), ivec2(0), size - 1), 0).rgb;
+            lo = min(lo, s);
+            hi = max(hi, s);
+        }
+    }
 
+    float z = texelFetch(geo_depth, c, 0).r;
+    vec4 P = vp_inv * vec4(vec3(uv, z) * 2 - vec3(1), 1);
+    vec4 q = prev_vp * (P / P.w);
+    vec2 prev_uv = q.xy / q.w * 0.5 + 0.5;
+    vec4 h = vec4(0);
+    if(has_history != 0 && q.w > 0 && all(greaterThanEqual(prev_uv, vec2(0))) && all(lessThanEqual(prev_uv, vec2(1)))) {
+        h = texture(history, prev_uv);
+        h.rgb = clamp(h.rgb, lo, hi);
+    }
+    // alpha accumulates the sample weight, capped so the history keeps adapting
+    float total = h.a + w;
+    frag_color = vec4(total > 1e-4 ? (h.rgb * h.a + color * w) / total : color, min(total, max_weight));
+}
+)";
+}
+
+TemporalUpsampler::TemporalUpsampler(): Shader(vanila_vert, TEMPORAL_UPSAMPLE::frag) {}
+void TemporalUpsampler::locate() {
+    cur = loc("cur");
+    depth = loc("geo_depth");
+    history = loc("history");
+    has_history = loc("has_history");
+    jitter = loc("jitter");
+    vp_inv = loc("vp_inv");
+    prev_vp = loc("prev_vp");
+    max_weight = loc("max_weight");
+}
+void TemporalUpsampler::set(GLuint _cur, GLuint _depth, GLuint _history, bool _has_history, glm::vec2 _jitter,
+                            glm::mat4 vp, glm::mat4 _prev_vp, float _max_weight) {
+    GLint locs[] = {cur, depth, history};
+    GLuint texs[] = {_cur, _depth, _history};
+    for(int k = 0; k < 3; ++k) {
+        glUniform1i(locs[k], k);
+        glActiveTexture(GL_TEXTURE0 + k);
+        glBindTexture(GL_TEXTURE_2D, texs[k]);
+    }
+    // the history is resampled at reprojected positions
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    glUniform1i(has_history, _has_history);
+    glUniform2f(jitter, _jitter.x, _jitter.y);
+    auto inv = glm::inverse(vp);
+    glUniformMatrix4fv(vp_inv, 1, false, (GLfloat *)&inv);
+    glUniformMatrix4fv(prev_vp, 1, false, (GLfloat *)&_prev_vp);
+    glUniform1f(max_weight, _max_weight);
+}
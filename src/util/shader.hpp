@@ -4,18 +4,24 @@
 #include <GLFW/glfw3.h>
 #include <iostream>
 #include <vector>
+#include <chrono>
+#include <map>
+#include <memory>
+#include <algorithm>
+#include <string>
 #include "common.hpp"
 #include "material.hpp"
 #include "camera.hpp"
 
 GLuint prepare_program();
 
-GLuint load_shader_from_text(const char *, GLenum);
+GLuint load_shader_from_text(const char *, GLenum, const char *header = nullptr);
 GLuint load_shader_from_path(const char *, GLenum);
 GLuint link_program(GLuint *, uint32_t);
 
 GLuint prepare_phong_shader();
-GLuint prepare_shader(const char *vert, const char* frag);
+GLuint prepare_shader(const char *vert, const char* frag, const char *frag_header = nullptr);
+GLuint prepare_compute_shader(const char *comp, const char *header = nullptr);
 
 /*struct LightSource {
     glm::vec3 position;
@@ -23,12 +29,81 @@ GLuint prepare_shader(const char *vert, const char* frag);
     glm::vec3 color;
 };*/
 
+/*
+ * A program, deleted with the last handle to it. Compiling and linking are
+ * only submitted when it is made; the result is asked for by finish, so the
+ * driver can work on every program at once and on its own threads where
+ * GL_KHR_parallel_shader_compile is around.
+ */
+class Program {
+public:
+    const GLuint id;
+    // linked already, e.g. loaded by ProgramCache
+    explicit Program(GLuint id);
+    // link submitted with shaders attached, the binary goes to ProgramCache under key when it succeeds
+    Program(GLuint id, std::vector <GLuint> shaders, std::string key, float submit_ms);
+    Program(const Program &) = delete;
+    Program &operator = (const Program &) = delete;
+    ~Program();
+    // finish would not wait; always true without parallel compile
+    bool ready() const;
+    // waits for the driver, throws the info log when compiling or linking failed
+    void finish();
+
+private:
+    std::vector <GLuint> shaders;
+    std::string key;
+    std::chrono::steady_clock::time_point submitted;
+    float submit_ms;
+    bool linked;
+};
+
+/*
+ * Programs shared by key: the sources plus the header that carries #version
+ * and the defines. Each variant is compiled and linked once, later requests
+ * get a handle to the same program while any handle is alive.
+ */
+class ProgramRegistry {
+public:
+    static std::shared_ptr <Program> get(const char *vert, const char *frag, const char *frag_header = nullptr);
+    static std::shared_ptr <Program> get_compute(const char *comp, const char *header = nullptr);
+    static int compiled() { return _compiled; } // programs linked so far
+    static int shared() { return _shared; }     // requests served by an existing program
+    static bool parallel(); // the driver compiles in the background
+    static int pending();   // live programs still being compiled
+    static float compile_ms() { return _compile_ms; } // submitting and waiting, over every finished program
+    static void finish_all();
+private:
+    struct Stage {
+        GLenum type;
+        const char *source, *header;
+    };
+    static std::shared_ptr <Program> find(const std::string &key, const std::vector <Stage> &stages);
+    static std::map <std::string, std::weak_ptr <Program>> programs;
+    static int _compiled, _shared;
+    static float _compile_ms;
+    friend class Program;
+};
+
+/*
+ * Subclasses look their uniforms up in locate, which runs once the program
+ * has linked: at the first use, or when ready finds it done.
+ */
 class Shader {
-    GLuint _program;
+    std::shared_ptr <Program> _program;
     std::map <std::string, GLint> uniforms;
+    bool located;
+protected:
+    Shader(std::shared_ptr <Program> program);
+    virtual void locate() {}
 public:
-    Shader(const char* vert, const char* frag);
-    ~Shader();
+    Shader(const char* vert, const char* frag, const char *frag_header = nullptr);
+    virtual ~Shader();
+    GLuint program() const { return _program->id; }
+    // linked and located, never waits when the driver compiles in parallel
+    bool ready();
+    // waits for the program, a failed one ends the process like a failed compile always has
+    void finish();
     GLint loc(const char*);
     void use();
     void init_uniform(std::vector <std::string>);
@@ -36,12 +111,52 @@ public:
     GLint uniform(std::string);
 };
 
+/*
+ * The specialized programs of one shader class, told apart by the defines in
+ * their header. A variant is made the first time its defines are asked for,
+ * its program is shared through ProgramRegistry and compiled in the
+ * background, and it is kept until clear.
+ */
+template <class T> class ShaderVariants {
+public:
+    explicit ShaderVariants(const char *name): name(name) {}
+    // args go to the constructor of T, ahead of the defines
+    template <class ... Args> T &get(const std::string &defines, Args ... args) {
+        auto &shader = variants[defines];
+        if(!shader) {
+            shader = std::make_unique <T> (args ..., defines);
+            std::string line = defines;
+            std::replace(line.begin(), line.end(), '\n', ' ');
+            printf("ShaderVariants: %s variant %d: %s\n", name, (int)variants.size(), line.c_str());
+        }
+        return *shader;
+    }
+    int size() const { return variants.size(); }
+    template <class F> void each(F f) { for(auto &[defines, shader]: variants) f(*shader); }
+    void clear() { variants.clear(); }
+private:
+    const char *name;
+    std::map <std::string, std::unique_ptr <T>> variants;
+};
+
+// Defines of the permutations. The header of a variant is #version plus these
+// lines; everything the old uniform branches looked at is known per draw.
+// HAS_TEX, HAS_TEX_NORM: the texture maps of the material, nullptr has none
+std::string material_defines(const Material *material);
+// LIGHT_COUNT, LIGHTS as LIGHT(i, type) for each light, SHADOW when shadow maps are bound,
+// SHADOW_FILTER 0 for a single tap, 1 for the 7x7 PCF
+std::string light_defines(const std::vector <LightInfo> &light_info, bool shadow, int shadow_filter);
+// SSDO_SPP
+std::string ssdo_defines(int spp);
+
 class PhongShader: public Shader {
     // const GLint trans = 0, Ka = 1, Kd = 2, scale = 3, type = 4, camera = 5, light = 6;
     GLint model, vp, Ka, Kd, scale, norm_scale,
         has_tex, has_tex_norm, camera,
         light_position, light_intense, light_direction, light_vp,
         depth_map, tex, tex_norm, has_depth_map;
+protected:
+    void locate() override;
 public:
     PhongShader();
     void set_mvp(glm::mat4 model, glm::mat4 vp);
@@ -53,6 +168,8 @@ public:
 
 class DepthShader: public Shader {
     GLint trans;
+protected:
+    void locate() override;
 public:
     DepthShader();
     void set_transform(glm::mat4 transform);
@@ -65,6 +182,8 @@ class PBRShader : public Shader {
         depth_map, tex, tex_norm, has_depth_map,
         m_albedo, m_metallic, m_roughness, m_ao;
 
+protected:
+    void locate() override;
 public:
     PBRShader();
     void set_mvp(glm::mat4 model, glm::mat4 vp);
@@ -75,35 +194,171 @@ public:
 };
 
 class SSDO: public Shader {
-    GLint model, vp, vp_inv, scale, norm_scale,
-        has_tex, has_tex_norm, camera,
-        light_position, light_intense, light_direction, light_vp, light_type, light_cnt,
-        depth_map, tex, tex_norm, has_depth_map,
-        m_albedo, m_metallic, m_roughness, m_ao,
-        normal, depth, color, gtime;
+    GLint model, vp, scale, norm_scale,
+        camera,
+        light_position, light_intense, light_direction, light_vp,
+        depth_map, tex, tex_norm,
+        m_albedo, m_metallic, m_roughness, m_ao, m_id;
 
+protected:
+    void locate() override;
 public:
-    SSDO(int render_pass);
+    // forward: shade direct light in the G-buffer pass, otherwise only fill the G-buffer.
+    // defines: material_defines, plus light_defines for the forward pass
+    SSDO(bool forward, const std::string &defines);
     void set_mvp(glm::mat4 model, glm::mat4 vp);
     void set_material(Material *material);
     void set_light(std::vector <LightInfo> light_info);
     void set_camera(glm::vec3 camera);
     void set_depth(std::vector <GLuint> depth_map);
-    void set_render_pass(int pass);
-    void set_geo(GLuint depth, GLuint normal, GLuint color);
-    void set_time(float time);
 };
 
+// G-buffer pass of GpuScene: the draw, its transform and material come from
+// storage buffers, found through a per-instance draw id
+class IndirectGeometry: public Shader {
+    GLint vp, tex, tex_norm;
+protected:
+    void locate() override;
+public:
+    IndirectGeometry();
+    void set(glm::mat4 vp, GLuint albedo_maps, GLuint normal_maps);
+};
+
+// Sets the instance count of each indirect command, 0 for draws outside the frustum
+class DrawCuller: public Shader {
+    GLint planes, count, cull;
+protected:
+    void locate() override;
+public:
+    DrawCuller();
+    // planes: world space, normalized, points inside have dot(plane, (p, 1)) >= 0
+    void dispatch(const glm::vec4 *planes, int count, bool cull);
+};
+
+// Full-screen SSDO pass, everything is reconstructed from the G-buffer
+class ScreenSSDO: public Shader {
+    GLint vp, vp_inv, camera,
+        depth, normal, color, albedo, material,
+        sample_seq, blue_noise, frame, rmax, radius_px,
+        hiz, hiz_levels, out;
+    GLenum target_format;
+
+protected:
+    void locate() override;
+public:
+    // compute selects the GL 4.3 variant that caches the G-buffer tile in shared memory and
+    // keeps the samples within 8 pixels, it writes an image of target_format. defines: ssdo_defines
+    ScreenSSDO(bool compute, GLenum target_format, const std::string &defines);
+    // GLSL image format qualifier of an internal format, nullptr if it has none
+    static const char *image_format(GLenum internal_format);
+    void set_camera(glm::mat4 vp, glm::vec3 camera);
+    void set_geo(GLuint depth, GLuint normal, GLuint color, GLuint albedo, GLuint material);
+    // radius_px <= 0 keeps the world-space radius fixed
+    void set_sampling(GLuint sample_seq, GLuint blue_noise, int frame, float radius, float radius_px);
+    // levels == 0 falls back to testing only the end point of each sample
+    void set_hiz(GLuint hiz, int levels);
+    // compute variant only, target must have the constructor's target_format; adds the
+    // tile hits and G-buffer lookups to the two uints of the buffer bound to SSBO binding 4
+    void dispatch(GLuint target, int width, int height);
+};
+
+// Builds one level of the min-depth pyramid used for Hi-Z tracing
+class HiZBuilder: public Shader {
+    GLint src, reduce;
+protected:
+    void locate() override;
+public:
+    HiZBuilder();
+    // level 0 copies depth, later levels reduce src's level - 1
+    void set(GLuint src, int level);
+};
+
+// Full-screen direct lighting over the G-buffer
+class DeferredLighting: public Shader {
+    GLint vp_inv, camera,
+        light_position, light_intense, light_direction, light_vp,
+        depth_map,
+        depth, normal, albedo, material;
+
+protected:
+    void locate() override;
+public:
+    // defines: light_defines
+    DeferredLighting(const std::string &defines);
+    void set_camera(glm::mat4 vp, glm::vec3 camera);
+    void set_light(std::vector <LightInfo> light_info);
+    void set_depth(std::vector <GLuint> depth_map);
+    void set_geo(GLuint depth, GLuint normal, GLuint albedo, GLuint material);
+};
+
+// Temporal accumulation of SSDO, also estimates the luminance variance
 class Denoiser: public Shader {
-    GLint tex, has_last, last, alpha;
+    GLint tex, has_last, last, alpha,
+        depth, normal, last_geo, last_moments, vp_inv, prev_vp, prev_vp_inv, camera;
+protected:
+    void locate() override;
 public:
-    Denoiser();
+    // box_filter runs a 13x13 box loop over the new samples before they are blended
+    Denoiser(bool box_filter = false);
     void set(GLuint _tex, GLuint last = 0, float alpha = 0.3);
+    // depth / normal at the denoiser's resolution,
+    // last_geo and last_moments are last frame's second and third outputs
+    void set_reprojection(GLuint depth, GLuint normal, GLuint last_geo, GLuint last_moments,
+                          glm::mat4 vp, glm::mat4 prev_vp, glm::vec3 camera);
+};
+
+// One 5x5 edge-stopping a-trous pass, guided by depth, normal and luminance variance
+class AtrousFilter: public Shader {
+    GLint tex, geo, vp_inv, camera, step_size, blur_variance, direct, alpha;
+protected:
+    void locate() override;
+public:
+    // the composite variant also adds direct light and tonemaps like the Mixer
+    AtrousFilter(bool composite = false);
+    // geo is the temporal pass's normal / depth target, step 1 is the first pass
+    void set(GLuint tex, GLuint geo, int step, glm::mat4 vp, glm::vec3 camera);
+    void set_composite(GLuint direct, float alpha = 1);
+};
+
+// Reduces the G-buffer to 1 / scale resolution, keeping the nearest depth
+class Downsampler: public Shader {
+    GLint depth, normal, albedo, material, scale;
+protected:
+    void locate() override;
+public:
+    Downsampler();
+    void set(GLuint depth, GLuint normal, GLuint albedo, GLuint material, int scale);
+};
+
+// Depth and normal aware upsampling of the reduced resolution indirect light
+class Upsampler: public Shader {
+    GLint ind, half_depth, half_normal, depth, normal, vp_inv, camera;
+protected:
+    void locate() override;
+public:
+    Upsampler();
+    void set(GLuint ind, GLuint half_depth, GLuint half_normal, GLuint depth, GLuint normal,
+             glm::mat4 vp, glm::vec3 camera);
 };
 
 class Mixer: public Shader {
     GLint direct, ind, alpha;
+protected:
+    void locate() override;
 public:
     Mixer();
     void set(GLuint direct, GLuint ind, float alpha = 1);
 };
+
+// Reconstructs the jittered render resolution frame at output resolution,
+// accumulating it over frames in a reprojected history
+class TemporalUpsampler: public Shader {
+    GLint cur, depth, history, has_history, jitter, vp_inv, prev_vp, max_weight;
+protected:
+    void locate() override;
+public:
+    TemporalUpsampler();
+    // jitter is the sample offset of cur in render pixels, vp and prev_vp are unjittered
+    void set(GLuint cur, GLuint depth, GLuint history, bool has_history, glm::vec2 jitter,
+             glm::mat4 vp, glm::mat4 prev_vp, float max_weight = 8);
+};
@@ -0,0 +1,129 @@
+#include "target_pool.hpp"
+#include <algorithm>
+
+// pixel transfer format matching an internal format, for allocating storage
+static GLenum pixel_format(GLenum internal_format) {
+    switch(internal_format) {
+    case GL_DEPTH_COMPONENT: case GL_DEPTH_COMPONENT16: case GL_DEPTH_COMPONENT24:
+    case GL_DEPTH_COMPONENT32: case GL_DEPTH_COMPONENT32F:
+        return GL_DEPTH_COMPONENT;
+    case GL_R8: case GL_R16: case GL_R16F: case GL_R32F:
+        return GL_RED;
+    case GL_RG8: case GL_RG16: case GL_RG16_SNORM: case GL_RG16F: case GL_RG32F:
+        return GL_RG;
+    case GL_RGB8: case GL_RGB16: case GL_RGB16_SNORM: case GL_RGB16F: case GL_RGB32F:
+    case GL_R11F_G11F_B10F: case GL_SRGB8:
+        return GL_RGB;
+    default:
+        return GL_RGBA;
+    }
+}
+
+size_t TargetPool::texture_bytes(GLuint tex, int levels) {
+    size_t total = 0;
+    glBindTexture(GL_TEXTURE_2D, tex);
+    for(int l = 0; l < levels; ++l) {
+        GLint w, h, bits = 0;
+        glGetTexLevelParameteriv(GL_TEXTURE_2D, l, GL_TEXTURE_WIDTH, &w);
+        glGetTexLevelParameteriv(GL_TEXTURE_2D, l, GL_TEXTURE_HEIGHT, &h);
+        GLenum sizes[] = {GL_TEXTURE_RED_SIZE, GL_TEXTURE_GREEN_SIZE, GL_TEXTURE_BLUE_SIZE,
+                          GL_TEXTURE_ALPHA_SIZE, GL_TEXTURE_DEPTH_SIZE, GL_TEXTURE_STENCIL_SIZE};
+        for(auto size: sizes) {
+            GLint b;
+            glGetTexLevelParameteriv(GL_TEXTURE_2D, l, size, &b);
+            bits += b;
+        }
+        total += (size_t)w * h * ((bits + 7) / 8);
+    }
+    return total;
+}
+
+TargetPool::Target TargetPool::create(TargetDesc desc) {
+    Target t;
+    t.desc = desc;
+    t.free = false;
+    t.used = true;
+    glGenTextures(1, &t.tex);
+    glBindTexture(GL_TEXTURE_2D, t.tex);
+    for(int l = 0; l < desc.levels; ++l) {
+        glTexImage2D(GL_TEXTURE_2D, l, desc.format,
+                     std::max(1, desc.width >> l), std::max(1, desc.height >> l), 0,
+                     pixel_format(desc.format), GL_FLOAT, NULL);
+    }
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, desc.levels > 1 ? GL_NEAREST_MIPMAP_NEAREST : GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, desc.levels - 1);
+    CheckGLError();
+    t.bytes = texture_bytes(t.tex, desc.levels);
+    return t;
+}
+
+GLuint TargetPool::get(const std::string &name, TargetDesc desc) {
+    auto it = named.find(name);
+    if(it == named.end() || it->second.desc != desc) {
+        if(it != named.end()) glDeleteTextures(1, &it->second.tex);
+        named[name] = create(desc);
+        changed = true;
+    }
+    auto &t = named[name];
+    t.used = true;
+    return t.tex;
+}
+
+GLuint TargetPool::acquire(TargetDesc desc) {
+    for(auto &t: transient) {
+        if(t.free && t.desc == desc) {
+            t.free = false;
+            t.used = true;
+            requested += t.bytes;
+            return t.tex;
+        }
+    }
+    transient.push_back(create(desc));
+    changed = true;
+    requested += transient.back().bytes;
+    return transient.back().tex;
+}
+
+void TargetPool::release(GLuint tex) {
+    for(auto &t: transient) {
+        if(t.tex == tex) t.free = true;
+    }
+}
+
+void TargetPool::end_frame() {
+    auto stale = [](const Target &t) { return !t.used; };
+    for(auto &t: transient) {
+        if(stale(t)) glDeleteTextures(1, &t.tex), changed = true;
+    }
+    transient.erase(std::remove_if(transient.begin(), transient.end(), stale), transient.end());
+    // named targets nothing declared this frame, e.g. the upsampling history without dynamic resolution
+    for(auto it = named.begin(); it != named.end(); ) {
+        if(stale(it->second)) {
+            glDeleteTextures(1, &it->second.tex);
+            it = named.erase(it);
+            changed = true;
+        } else {
+            it->second.used = false;
+            ++it;
+        }
+    }
+    if(changed) {
+        size_t shared = 0;
+        for(auto &t: transient) shared += t.bytes;
+        printf("render targets: %d textures, %.1f MB (transients %.1f MB requested, %.1f MB allocated)\n",
+               (int)(named.size() + transient.size()), bytes() / 1e6, requested / 1e6, shared / 1e6);
+        changed = false;
+    }
+    for(auto &t: transient) t.free = true, t.used = false;
+    requested = 0;
+}
+
+size_t TargetPool::bytes() const {
+    size_t total = 0;
+    for(auto &[name, t]: named) total += t.bytes;
+    for(auto &t: transient) total += t.bytes;
+    return total;
+}
@@ -0,0 +1,55 @@
+#pragma once
+#include "common.hpp"
+#include <map>
+#include <string>
+#include <vector>
+
+/*
+ * Render targets requested by size and format.
+ *
+ * Named targets keep their contents across frames (history buffers) and
+ * are recreated when the descriptor asked for changes, e.g. after a resize.
+ * Transient targets are only valid between acquire and release within a
+ * frame. A released texture goes back to the pool and is handed out to the
+ * next request with the same descriptor, so passes whose outputs have
+ * disjoint lifetimes share the memory.
+ */
+
+struct TargetDesc {
+    int width, height;
+    GLenum format;
+    int levels = 1; // mip levels, level l is (width >> l) x (height >> l)
+    bool operator == (const TargetDesc &o) const {
+        return width == o.width && height == o.height && format == o.format && levels == o.levels;
+    }
+    bool operator != (const TargetDesc &o) const { return !(*this == o); }
+};
+
+class TargetPool {
+public:
+    // target that survives the frame, its contents are undefined after the descriptor changed;
+    // it is freed at the end of a frame that did not ask for it
+    GLuint get(const std::string &name, TargetDesc desc);
+    // target valid until release, possibly the memory of one released earlier this frame
+    GLuint acquire(TargetDesc desc);
+    void release(GLuint tex);
+    // releases every transient, frees those not requested this frame and logs the
+    // allocation when it changed
+    void end_frame();
+    size_t bytes() const;
+    // bytes of all levels as allocated by the driver, not as requested
+    static size_t texture_bytes(GLuint tex, int levels = 1);
+
+private:
+    struct Target {
+        GLuint tex;
+        TargetDesc desc;
+        size_t bytes;
+        bool free, used;
+    };
+    static Target create(TargetDesc desc);
+    std::map <std::string, Target> named;
+    std::vector <Target> transient;
+    size_t requested = 0; // transient bytes acquired this frame, as if nothing was shared
+    bool changed = false;
+};
@@ -3,6 +3,15 @@
 #include <stb_image.h>
 #include <iostream>
 
+static GLenum channel_format(int channels) {
+  switch (channels) {
+  case 1: return GL_RED;
+  case 2: return GL_RG;
+  case 3: return GL_RGB;
+  default: return GL_RGBA;
+  }
+}
+
 Texture2D::Texture2D(const Path &path) {
   warn(0, "loading texture from image file: %s", path.u8string().c_str());
   // auto full_path = Data::resolve(name).string();
@@ -16,18 +25,20 @@ Texture2D::Texture2D(const Path &path) {
     ss << "failed to load image " << path << " :" << stbi_failure_reason() << std::endl;
     throw ss.str();
   }
-  init(data, GL_UNSIGNED_BYTE, width, height, channels);
+  _width = width;
+  _height = height;
+  _channels = channels;
+  _pixels.assign(data, data + (size_t)width * height * channels);
+  _tex_id = 0;
   stbi_image_free(data);
 }
 
-void Texture2D::init(uint8_t *data,
+void Texture2D::init(const uint8_t *data,
                      GLenum data_type,
                      int width,
                      int height,
                      GLenum internal_format,
-                     GLenum format) {
-  _width = width;
-  _height = height;
+                     GLenum format) const {
   /*for(int i = 0; i < 1000; ++i) {
     printf("%d %d %d\n", data[i * 3 + 0], data[i * 3 + 1], data[i * 3 + 2]);
   }*/
@@ -55,8 +66,8 @@ void Texture2D::init(uint8_t *data,
   glTexImage2D(GL_TEXTURE_2D,
                0,
                internal_format,
-               _width,
-               _height,
+               width,
+               height,
                0,
                format,
                data_type,
@@ -65,24 +76,12 @@ void Texture2D::init(uint8_t *data,
   glGenerateMipmap(GL_TEXTURE_2D);
 }
 
-void Texture2D::init(uint8_t *data,
+void Texture2D::init(const uint8_t *data,
                      GLenum data_type,
                      int width,
                      int height,
-                     int channels) {
-  GLenum format = GL_RGBA;
-  if (channels == 1) {
-    format = GL_R;
-  }
-  if (channels == 2) {
-    format = GL_RG;
-  }
-  if (channels == 3) {
-    format = GL_RGB;
-  }
-  if (channels == 4) {
-    format = GL_RGBA;
-  }
+                     int channels) const {
+  GLenum format = channel_format(channels);
   init(data, data_type, width, height, format, format);
 }
 
@@ -107,13 +106,23 @@ Texture2D::Texture2D(uint8_t *data,
 }*/
 
 Texture2D::~Texture2D() {
-  glDeleteTextures(1, &_tex_id);
+  if (_tex_id)
+    glDeleteTextures(1, &_tex_id);
 }
 
 GLuint Texture2D::get() const {
+  if (_tex_id == 0 && !_pixels.empty()) {
+    init(_pixels.data(), GL_UNSIGNED_BYTE, _width, _height, _channels);
+    if (!_keep_pixels)
+      std::vector <uint8_t>().swap(_pixels);
+  }
   return _tex_id;
 }
 
+void Texture2D::keep_pixels(bool keep) {
+  _keep_pixels = keep;
+}
+
 int Texture2D::width() const {
   return _width;
 }
@@ -121,3 +130,45 @@ int Texture2D::width() const {
 int Texture2D::height() const {
   return _height;
 }
+
+int Texture2D::channels() const {
+  return _channels;
+}
+
+const std::vector <uint8_t> &Texture2D::pixels() const {
+  if (_pixels.empty() && _tex_id) {
+    // released after the upload, level 0 holds the same bytes
+    _pixels.resize((size_t)_width * _height * _channels);
+    glBindTexture(GL_TEXTURE_2D, _tex_id);
+    glPixelStorei(GL_PACK_ALIGNMENT, 1);
+    glGetTexImage(GL_TEXTURE_2D, 0, channel_format(_channels), GL_UNSIGNED_BYTE, _pixels.data());
+    glPixelStorei(GL_PACK_ALIGNMENT, 4);
+    CheckGLError();
+  }
+  return _pixels;
+}
+
+glm::vec4 Texture2D::sample(glm::vec2 uv) const {
+  if (pixels().empty())
+    return glm::vec4(1);
+  auto texel = [&](int x, int y) {
+    // mirrored repeat: ..., 1, 0, 0, 1, ..., n-1, n-1, n-2, ...
+    auto mirror = [](int i, int n) {
+      int period = 2 * n;
+      i %= period;
+      if (i < 0)
+        i += period;
+      return i < n ? i : period - 1 - i;
+    };
+    const uint8_t *p = &_pixels[((size_t)mirror(y, _height) * _width + mirror(x, _width)) * _channels];
+    glm::vec4 c(0, 0, 0, 1);
+    for (int i = 0; i < std::min(_channels, 4); ++i)
+      c[i] = p[i] / 255.f;
+    return c;
+  };
+  float x = uv.x * _width - .5f, y = uv.y * _height - .5f;
+  int x0 = (int)std::floor(x), y0 = (int)std::floor(y);
+  float fx = x - x0, fy = y - y0;
+  return glm::mix(glm::mix(texel(x0, y0), texel(x0 + 1, y0), fx),
+                  glm::mix(texel(x0, y0 + 1), texel(x0 + 1, y0 + 1), fx), fy);
+}
@@ -3,7 +3,15 @@
 #include <GL/glew.h>
 #include <glm/glm.hpp>
 #include "common.hpp"
+#include <vector>
 
+/*
+ * Images loaded from a file keep their pixels on the CPU and reach GL the
+ * first time get() is called, so they load without a context and can be
+ * sampled by the CPU path tracer. The CPU copy is released after the
+ * upload unless keep_pixels() was asked for; pixels() and sample() read it
+ * back from GL when they need it again and keep it from then on.
+ */
 class Texture2D {
 public:
   Texture2D(const Path &);
@@ -23,24 +31,35 @@ public:
   ~Texture2D();
 
   GLuint get() const;
+  // keep the CPU copy after get() uploads it
+  void keep_pixels(bool keep = true);
 
   int width() const;
   int height() const;
+  int channels() const;
+  // rows from the bottom up, as uploaded
+  const std::vector <uint8_t> &pixels() const;
+
+  // bilinear lookup with mirrored repeat like the GL sampler, no mipmaps; channels in [0, 1]
+  glm::vec4 sample(glm::vec2 uv) const;
 
 private:
-  GLuint _tex_id;
+  mutable GLuint _tex_id;
   int _width, _height;
+  int _channels;
+  bool _keep_pixels = false;
+  mutable std::vector <uint8_t> _pixels;
 
-  void init(uint8_t *data,
+  void init(const uint8_t *data,
             GLenum data_type,
             int width,
             int height,
-            int channels);
+            int channels) const;
 
-  void init(uint8_t *data,
+  void init(const uint8_t *data,
             GLenum data_type,
             int width,
             int height,
             GLenum internal_format,
-            GLenum format);
+            GLenum format) const;
 };